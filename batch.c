@@ -0,0 +1,149 @@
+#include "batch.h"
+#include "compiler.h"
+#include "memory.h"
+#include "cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// the parent runs the prelude once and forks the workers, which inherit the warm
+// VM copy on write. workers claim files from a counter in shared memory and write
+// each file's stdout to their own spill file; the parent replays the spills and
+// reports statuses and timings in input order once every worker has exited.
+//
+// between files a worker puts back the globals the prelude defined, but only the
+// bindings: the lists, maps and instances they point at are shared by every file
+// that worker runs, so a mutation made by one file is seen by the next. a prelude
+// is meant for functions, classes and constants.
+
+#define STATUS_UNCLAIMED -1
+
+typedef struct {
+	int status;
+	int worker;
+	long offset;
+	long length;
+	double seconds;
+} BatchResult;
+
+typedef struct {
+	int next;
+	BatchResult results[];
+} BatchShared;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int runOne(VM *vm, char *path) {
+	Mapping mapping = {NULL, 0};
+	char *source = loadSource(path, &mapping);
+	if(source == NULL) {
+		printf("Could not open file %s\n", path);
+		return 74;
+	}
+	InterpretResult result = interpret(vm, source);
+	releaseSource(source, &mapping);
+	if(result == INTERPRET_COMPILE_ERROR) return 65;
+	if(result == INTERPRET_RUNTIME_ERROR) return 70;
+	return 0;
+}
+
+static void worker(VM *vm, BatchShared *shared, int id, FILE *spill, int count, char **paths) {
+	Table prelude;
+	initTable(&prelude);
+	tableAddAll(&vm->globals, &prelude);
+	fflush(stdout);
+	dup2(fileno(spill), STDOUT_FILENO);
+	while(1) {
+		int i = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED);
+		if(i >= count) break;
+		BatchResult *result = &shared->results[i];
+		result->worker = id;
+		result->offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		double start = now();
+		int status = runOne(vm, paths[i]);
+		fflush(stdout);
+		result->seconds = now() - start;
+		result->length = lseek(STDOUT_FILENO, 0, SEEK_CUR) - result->offset;
+		result->status = status;
+		// every file starts from the globals the prelude left behind, not a deep copy
+		resetVM(vm);
+		tableAddAll(&prelude, &vm->globals);
+	}
+	_exit(0);
+}
+
+static void replay(FILE *spill, long offset, long length) {
+	char buffer[1 << 16];
+	while(length > 0) {
+		size_t chunk = length < (long)sizeof(buffer) ? (size_t)length : sizeof(buffer);
+		ssize_t bytesRead = pread(fileno(spill), buffer, chunk, offset);
+		if(bytesRead <= 0) break;
+		fwrite(buffer, 1, bytesRead, stdout);
+		offset += bytesRead;
+		length -= bytesRead;
+	}
+}
+
+int runBatch(VM *vm, int jobs, char *prelude, int count, char **paths) {
+	if(prelude != NULL) {
+		int status = runOne(vm, prelude);
+		if(status != 0) return status;
+	}
+	if(jobs <= 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(jobs > count) jobs = count;
+	if(jobs < 1) jobs = 1;
+
+	size_t sharedSize = sizeof(BatchShared) + sizeof(BatchResult) * count;
+	BatchShared *shared = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(shared == MAP_FAILED) {
+		printf("Could not map batch queue\n");
+		return 74;
+	}
+	shared->next = 0;
+	for(int i=0;i<count;i++) {
+		shared->results[i].status = STATUS_UNCLAIMED;
+		shared->results[i].length = 0;
+	}
+	FILE **spills = ALLOCATE(FILE *, jobs);
+	pid_t *pids = ALLOCATE(pid_t, jobs);
+	fflush(stdout);
+	for(int i=0;i<jobs;i++) {
+		spills[i] = tmpfile();
+		pids[i] = spills[i] != NULL ? fork() : -1;
+		if(pids[i] == 0) worker(vm, shared, i, spills[i], count, paths);
+	}
+	for(int i=0;i<jobs;i++) {
+		if(pids[i] > 0) waitpid(pids[i], NULL, 0);
+	}
+
+	int exitStatus = 0;
+	for(int i=0;i<count;i++) {
+		BatchResult *result = &shared->results[i];
+		if(result->status != STATUS_UNCLAIMED) replay(spills[result->worker], result->offset, result->length);
+	}
+	fflush(stdout);
+	for(int i=0;i<count;i++) {
+		BatchResult *result = &shared->results[i];
+		if(result->status == STATUS_UNCLAIMED) {
+			fprintf(stderr, "%s\tfailed\n", paths[i]);
+			if(exitStatus == 0) exitStatus = 70;
+		} else {
+			fprintf(stderr, "%s\texit %d\t%.3fms\n", paths[i], result->status, result->seconds * 1e3);
+			if(exitStatus == 0) exitStatus = result->status;
+		}
+	}
+	for(int i=0;i<jobs;i++) {
+		if(spills[i] != NULL) fclose(spills[i]);
+	}
+	FREE_ARRAY(pid_t, pids, jobs);
+	FREE_ARRAY(FILE *, spills, jobs);
+	munmap(shared, sharedSize);
+	return exitStatus;
+}
@@ -0,0 +1,8 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "vm.h"
+
+int runBatch(VM *vm, int jobs, char *prelude, int count, char **paths);
+
+#endif
@@ -0,0 +1,200 @@
+// runs each benchmark as a fresh interpreter process and reports wall time and
+// peak rss as json, so results from two revisions can be diffed. make bench drives it
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// about 30MB of source, every level stays under the 256 locals and constants a chunk holds
+#define GENERATED_OUTER 100
+#define GENERATED_MIDDLE 16
+#define GENERATED_INNER 60
+
+typedef struct {
+	double *times;
+	long peakRss; // kilobytes, the largest over all runs
+} Result;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// every run compiles from source, a .loxc left by the previous one would skip that
+static void removeCache(char *path) {
+	size_t length = strlen(path);
+	char *cache = (char *)malloc(length + 2);
+	memcpy(cache, path, length);
+	cache[length] = 'c';
+	cache[length + 1] = '\0';
+	unlink(cache);
+	free(cache);
+}
+
+// the script's own output goes to /dev/null, stderr stays visible for errors
+static bool runOnce(char *interpreter, char *path, double *seconds, long *rss) {
+	removeCache(path);
+	double start = now();
+	pid_t pid = fork();
+	if(pid < 0) return false;
+	if(pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if(null >= 0) dup2(null, STDOUT_FILENO);
+		execl(interpreter, interpreter, path, (char *)NULL);
+		_exit(127);
+	}
+	int status;
+	struct rusage usage;
+	if(wait4(pid, &status, 0, &usage) < 0) return false;
+	*seconds = now() - start;
+	*rss = usage.ru_maxrss;
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed with status %d\n", path, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+		return false;
+	}
+	return true;
+}
+
+static int compareTimes(const void *a, const void *b) {
+	double x = *(double *)a, y = *(double *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double median(double *sorted, int count) {
+	if(count % 2 == 1) return sorted[count / 2];
+	return (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+static double mean(double *times, int count) {
+	double total = 0;
+	for(int i=0;i<count;i++) total += times[i];
+	return total / count;
+}
+
+// sample standard deviation, 0 for a single run
+static double stddev(double *times, int count) {
+	if(count < 2) return 0;
+	double m = mean(times, count);
+	double total = 0;
+	for(int i=0;i<count;i++) total += (times[i] - m) * (times[i] - m);
+	return sqrt(total / (count - 1));
+}
+
+static char *benchName(char *path) {
+	char *slash = strrchr(path, '/');
+	char *name = strdup(slash != NULL ? slash + 1 : path);
+	char *dot = strrchr(name, '.');
+	if(dot != NULL) *dot = '\0';
+	return name;
+}
+
+static void writeResult(FILE *out, char *path, Result *result, int runs, bool last) {
+	char *name = benchName(path);
+	qsort(result->times, runs, sizeof(double), compareTimes);
+	fprintf(out, "    {\"name\": \"%s\", \"median\": %.6f, \"mean\": %.6f, \"stddev\": %.6f, "
+		"\"min\": %.6f, \"max\": %.6f, \"peakRssKb\": %ld}%s\n", name,
+		median(result->times, runs), mean(result->times, runs), stddev(result->times, runs),
+		result->times[0], result->times[runs - 1], result->peakRss, last ? "" : ",");
+	free(name);
+}
+
+// nested so no chunk goes over the 256 constant limit: the top level holds the
+// outer functions, each outer function holds its inner ones
+static bool generate(char *path) {
+	FILE *file = fopen(path, "w");
+	if(file == NULL) return false;
+	fprintf(file, "// generated by bench/runner.c -g, compile throughput\n");
+	for(int o=0;o<GENERATED_OUTER;o++) {
+		fprintf(file, "fun outer%d(seed) {\n", o);
+		for(int m=0;m<GENERATED_MIDDLE;m++) {
+			fprintf(file, "  fun middle%d(seed) {\n", m);
+			for(int i=0;i<GENERATED_INNER;i++) {
+				fprintf(file, "    // inner function %d of middle%d in outer%d\n", i, m, o);
+				fprintf(file, "    fun inner%d(a, b) {\n", i);
+				fprintf(file, "      var total = a * %d + b - %d.5;\n", i + 1, o);
+				fprintf(file, "      var label = \"inner %d of %d.%d\";\n", i, o, m);
+				fprintf(file, "      for (var k = 0; k < %d; k = k + 1) {\n", i % 7 + 1);
+				fprintf(file, "        if (total > %d) total = total - k; else total = total + k * 2;\n", i * 3);
+				fprintf(file, "      }\n");
+				fprintf(file, "      while (total > 1000) total = total / 2;\n");
+				fprintf(file, "      return total + len(label);\n");
+				fprintf(file, "    }\n");
+			}
+			fprintf(file, "    return inner%d(seed, %d);\n  }\n", GENERATED_INNER - 1, m);
+		}
+		fprintf(file, "  return middle%d(seed);\n}\n\n", GENERATED_MIDDLE - 1);
+	}
+	fprintf(file, "print outer0(1) + outer%d(2);\n", GENERATED_OUTER - 1);
+	return fclose(file) == 0;
+}
+
+static void usage() {
+	fprintf(stderr, "Usage: runner [-n runs] [-w warmup] [-o out.json] interpreter bench.lox...\n");
+	fprintf(stderr, "       runner -g generated.lox\n");
+	exit(64);
+}
+
+int main(int argc, char **argv) {
+	int runs = 5;
+	int warmup = 1;
+	char *output = NULL;
+	int i = 1;
+	for(;i<argc && argv[i][0] == '-';i+=2) {
+		if(i + 1 >= argc) usage();
+		if(!strcmp(argv[i], "-n")) runs = atoi(argv[i+1]);
+		else if(!strcmp(argv[i], "-w")) warmup = atoi(argv[i+1]);
+		else if(!strcmp(argv[i], "-o")) output = argv[i+1];
+		else if(!strcmp(argv[i], "-g")) {
+			if(!generate(argv[i+1])) {
+				fprintf(stderr, "Could not write %s\n", argv[i+1]);
+				exit(74);
+			}
+			return 0;
+		}
+		else usage();
+	}
+	if(argc - i < 2 || runs < 1 || warmup < 0) usage();
+	char *interpreter = argv[i];
+	char **paths = argv + i + 1;
+	int count = argc - i - 1;
+
+	Result *results = (Result *)calloc(count, sizeof(Result));
+	for(int b=0;b<count;b++) {
+		results[b].times = (double *)malloc(sizeof(double) * runs);
+		double seconds;
+		long rss;
+		for(int w=0;w<warmup;w++) {
+			if(!runOnce(interpreter, paths[b], &seconds, &rss)) exit(70);
+		}
+		for(int r=0;r<runs;r++) {
+			if(!runOnce(interpreter, paths[b], &seconds, &rss)) exit(70);
+			results[b].times[r] = seconds;
+			if(rss > results[b].peakRss) results[b].peakRss = rss;
+		}
+		removeCache(paths[b]);
+		fprintf(stderr, "%s: %d runs\n", paths[b], runs);
+	}
+
+	FILE *out = output != NULL ? fopen(output, "w") : stdout;
+	if(out == NULL) {
+		fprintf(stderr, "Could not write %s\n", output);
+		exit(74);
+	}
+	fprintf(out, "{\n  \"interpreter\": \"%s\",\n  \"runs\": %d,\n  \"warmup\": %d,\n  \"benchmarks\": [\n",
+		interpreter, runs, warmup);
+	for(int b=0;b<count;b++) {
+		writeResult(out, paths[b], &results[b], runs, b == count - 1);
+		free(results[b].times);
+	}
+	fprintf(out, "  ]\n}\n");
+	if(out != stdout) fclose(out);
+	free(results);
+	return 0;
+}
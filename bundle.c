@@ -0,0 +1,179 @@
+#include "bundle.h"
+#include "compiler.h"
+#include "scanner.h"
+#include "memory.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// a bundle is a copy of the interpreter with the compiled program appended:
+//   padding   zeros up to an 8 byte boundary so mapped chunks stay aligned
+//   payload   "LOXB", version, module count, modules (path, chunk), main chunk
+//   trailer   payload offset, "LOXBUNDL"
+// at startup the running executable is mapped and the chunks are used in place.
+
+#define SELF_EXE "/proc/self/exe"
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t moduleCount;
+} BundleHeader;
+
+typedef struct {
+	uint64_t offset;
+	char magic[8];
+} BundleTrailer;
+
+static bool containsPath(ValueArray *paths, ObjString *path) {
+	for(int i=0;i<paths->count;i++) {
+		if(AS_STRING(paths->values[i]) == path) return true;
+	}
+	return false;
+}
+
+// import paths are always string literals, so a token scan finds all of them
+static bool collectImports(VM *vm, char *source, ValueArray *paths) {
+	Scanner scanner;
+	initScanner(&scanner, source);
+	Token token = scanToken(&scanner);
+	while(token.type != TOKEN_EOF) {
+		Token next = scanToken(&scanner);
+		if(token.type == TOKEN_IMPORT && next.type == TOKEN_STRING) {
+			ObjString *path = copyString(vm, next.start + 1, next.length - 2);
+			if(!containsPath(paths, path)) {
+				writeValueArray(paths, OBJ_VAL(path));
+				Mapping mapping = {NULL, 0};
+				char *module = loadSource(path->chars, &mapping);
+				if(module == NULL) {
+					printf("Could not open module %s\n", path->chars);
+					return false;
+				}
+				bool ok = collectImports(vm, module, paths);
+				releaseSource(module, &mapping);
+				if(!ok) return false;
+			}
+		}
+		token = next;
+	}
+	return true;
+}
+
+static bool compileFile(VM *vm, char *path, Chunk *chunk) {
+	Mapping mapping = {NULL, 0};
+	char *source = loadSource(path, &mapping);
+	if(source == NULL) {
+		printf("Could not open file %s\n", path);
+		return false;
+	}
+	bool ok = compile(vm, chunk, source);
+	releaseSource(source, &mapping);
+	return ok;
+}
+
+// bundling from a bundle carries the old payload along, the new trailer still wins
+static bool copyExecutable(FILE *out) {
+	FILE *self = fopen(SELF_EXE, "rb");
+	if(self == NULL) return false;
+	char buffer[1 << 16];
+	size_t bytesRead;
+	while((bytesRead = fread(buffer, 1, sizeof(buffer), self)) > 0) {
+		fwrite(buffer, 1, bytesRead, out);
+	}
+	fclose(self);
+	return true;
+}
+
+bool writeBundle(VM *vm, char *script, char *output) {
+	Mapping mapping = {NULL, 0};
+	char *source = loadSource(script, &mapping);
+	if(source == NULL) {
+		printf("Could not open file %s\n", script);
+		return false;
+	}
+	ValueArray paths;
+	initValueArray(&paths);
+	bool ok = collectImports(vm, source, &paths);
+	releaseSource(source, &mapping);
+	Chunk main;
+	initChunk(&main);
+	Chunk *modules = ALLOCATE(Chunk, paths.count);
+	for(int i=0;i<paths.count;i++) {
+		initChunk(&modules[i]);
+	}
+	if(ok) ok = compileFile(vm, script, &main);
+	for(int i=0;i<paths.count && ok;i++) {
+		ok = compileFile(vm, AS_CSTRING(paths.values[i]), &modules[i]);
+	}
+
+	FILE *out = ok ? fopen(output, "wb") : NULL;
+	if(out != NULL) {
+		ok = copyExecutable(out);
+		static const uint8_t zeros[8] = {0};
+		fwrite(zeros, 1, (8 - ftell(out) % 8) % 8, out);
+		BundleTrailer trailer;
+		trailer.offset = ftell(out);
+		memcpy(trailer.magic, "LOXBUNDL", 8);
+		BundleHeader header;
+		memcpy(header.magic, "LOXB", 4);
+		header.version = BUNDLE_VERSION;
+		header.moduleCount = paths.count;
+		fwrite(&header, sizeof(header), 1, out);
+		for(int i=0;i<paths.count && ok;i++) {
+			ok = serializeValue(out, paths.values[i]) && serializeChunk(out, &modules[i]);
+		}
+		ok = ok && serializeChunk(out, &main);
+		fwrite(&trailer, sizeof(trailer), 1, out);
+		if(fclose(out) != 0) ok = false;
+		if(ok) chmod(output, 0755);
+		else remove(output);
+	} else if(ok) {
+		printf("Could not write %s\n", output);
+		ok = false;
+	}
+
+	for(int i=0;i<paths.count;i++) {
+		freeChunk(&modules[i]);
+	}
+	FREE_ARRAY(Chunk, modules, paths.count);
+	freeChunk(&main);
+	freeValueArray(&paths);
+	return ok;
+}
+
+bool loadBundle(VM *vm, Chunk *chunk, Mapping *mapping) {
+	int fd = open(SELF_EXE, O_RDONLY);
+	if(fd < 0) return false;
+	struct stat st;
+	BundleTrailer trailer;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(trailer) ||
+			pread(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) != sizeof(trailer) ||
+			memcmp(trailer.magic, "LOXBUNDL", 8) != 0 || trailer.offset > st.st_size - sizeof(trailer)) {
+		close(fd);
+		return false;
+	}
+	uint8_t *start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(start == MAP_FAILED) return false;
+	mapping->start = start;
+	mapping->size = st.st_size;
+	uint8_t *cursor = start + trailer.offset;
+	uint8_t *end = start + st.st_size - sizeof(trailer);
+
+	BundleHeader header;
+	if((size_t)(end - cursor) < sizeof(header)) return false;
+	memcpy(&header, cursor, sizeof(header));
+	cursor += sizeof(header);
+	if(memcmp(header.magic, "LOXB", 4) != 0 || header.version != BUNDLE_VERSION) return false;
+	for(uint32_t i=0;i<header.moduleCount;i++) {
+		Value path;
+		if(!deserializeValue(vm, &cursor, end, &path) || !IS_STRING(path)) return false;
+		ObjModule *module = newModule(vm, AS_STRING(path));
+		module->embedded = true;
+		tableSet(&vm->modules, AS_STRING(path), OBJ_VAL(module));
+		if(!deserializeChunk(vm, &cursor, end, module->chunk)) return false;
+	}
+	return deserializeChunk(vm, &cursor, end, chunk);
+}
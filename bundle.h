@@ -0,0 +1,12 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "cache.h"
+#include "vm.h"
+
+#define BUNDLE_VERSION 6
+
+bool writeBundle(VM *vm, char *script, char *output);
+bool loadBundle(VM *vm, Chunk *chunk, Mapping *mapping);
+
+#endif
@@ -0,0 +1,517 @@
+#include "cache.h"
+#include "memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// .loxc layout, native endian, every section 4 byte aligned:
+//   header    "LOXC", version, source length and 64 bit hash
+//   chunk     code count, constant count, inline cache count, int lines[], uint8_t code[] (padded), constants
+// a constant is a tag followed by a double / length + chars (padded) depending on tag,
+// functions are their arity, upvalue count, flags, upvalue pairs (padded), name and then their own chunk.
+// code and lines are used straight out of the mapping, constants are rebuilt.
+// every operand is checked against the chunk it indexes before anything runs.
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t sourceLength;
+	uint64_t sourceHash;
+} CacheHeader;
+
+typedef struct {
+	uint32_t codeCount;
+	uint32_t constantCount;
+	uint32_t cacheCount;
+} ChunkHeader;
+
+typedef enum {
+	TAG_NIL,
+	TAG_FALSE,
+	TAG_TRUE,
+	TAG_NUMBER,
+	TAG_STRING,
+	TAG_FUNCTION,
+} ConstantTag;
+
+#define ALIGN4(n) (((n) + 3) & ~(size_t)3)
+
+// 64 bit fnv-1a, the interning hash is only 32 bits and a stale cache that
+// collides runs the wrong code
+SourceKey sourceKey(char *source) {
+	SourceKey key = {strlen(source), 0xcbf29ce484222325ull};
+	for(uint64_t i=0;i<key.length;i++) {
+		key.hash ^= (uint8_t)source[i];
+		key.hash *= 0x100000001b3ull;
+	}
+	return key;
+}
+
+char *cachePath(char *sourcePath) {
+	char *dir = getenv("CLOX_CACHE_DIR");
+	size_t length = strlen(sourcePath);
+	size_t dirLength = dir != NULL ? strlen(dir) + 1 : 0;
+	char *path = ALLOCATE(char, dirLength + length + 2);
+	char *out = path;
+	if(dir != NULL) {
+		memcpy(out, dir, dirLength - 1);
+		out[dirLength - 1] = '/';
+		out += dirLength;
+	}
+	memcpy(out, sourcePath, length + 1);
+	if(dir != NULL) {
+		// flatten the source path so different directories don't collide
+		for(size_t i=0;i<length;i++) {
+			if(out[i] == '/') out[i] = '%';
+		}
+	}
+	out[length] = 'c';
+	out[length+1] = '\0';
+	return path;
+}
+
+static void writePadding(FILE *file, size_t written) {
+	static const uint8_t zeros[4] = {0};
+	fwrite(zeros, 1, ALIGN4(written) - written, file);
+}
+
+static bool serializeConstants(FILE *file, Chunk *chunk);
+
+bool serializeValue(FILE *file, Value value) {
+	uint32_t tag;
+	switch(value.type) {
+		case VAL_BOOL: tag = AS_BOOL(value) ? TAG_TRUE : TAG_FALSE; break;
+		case VAL_NUMBER: tag = TAG_NUMBER; break;
+		case VAL_OBJ:
+			if(IS_STRING(value)) tag = TAG_STRING;
+			else if(IS_FUNCTION(value)) tag = TAG_FUNCTION;
+			else return false;
+			break;
+		default: tag = TAG_NIL; break;
+	}
+	fwrite(&tag, sizeof(tag), 1, file);
+	if(tag == TAG_NUMBER) {
+		double number = AS_NUMBER(value);
+		fwrite(&number, sizeof(number), 1, file);
+	} else if(tag == TAG_STRING) {
+		ObjString *string = AS_STRING(value);
+		uint32_t length = string->length;
+		fwrite(&length, sizeof(length), 1, file);
+		fwrite(string->chars, 1, length, file);
+		writePadding(file, length);
+	} else if(tag == TAG_FUNCTION) {
+		ObjFunction *function = AS_FUNCTION(value);
+		return serializeFunctionCode(file, function) && serializeConstants(file, &function->chunk);
+	}
+	return true;
+}
+
+static bool serializeConstants(FILE *file, Chunk *chunk) {
+	for(int i=0;i<chunk->varr.count;i++) {
+		if(!serializeValue(file, chunk->varr.values[i])) return false;
+	}
+	return true;
+}
+
+void serializeCode(FILE *file, Chunk *chunk) {
+	ChunkHeader header;
+	header.codeCount = chunk->count;
+	header.constantCount = chunk->varr.count;
+	header.cacheCount = chunk->cacheCount;
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(chunk->lines, sizeof(int), chunk->count, file);
+	fwrite(chunk->code, 1, chunk->count, file);
+	writePadding(file, chunk->count);
+}
+
+bool serializeFunctionCode(FILE *file, ObjFunction *function) {
+	uint32_t fields[3] = {function->arity, function->upvalueCount, function->usesEnclosing};
+	fwrite(fields, sizeof(fields), 1, file);
+	if(function->upvalueCount > 0) fwrite(function->upvalues, 1, function->upvalueCount * 2, file);
+	writePadding(file, function->upvalueCount * 2);
+	if(!serializeValue(file, OBJ_VAL(function->name))) return false;
+	serializeCode(file, &function->chunk);
+	return true;
+}
+
+// returns false on constants that can't be written, the caller discards the file
+bool serializeChunk(FILE *file, Chunk *chunk) {
+	serializeCode(file, chunk);
+	return serializeConstants(file, chunk);
+}
+
+bool writeCache(char *path, SourceKey key, Chunk *chunk) {
+	size_t length = strlen(path);
+	char *temp = ALLOCATE(char, length + 5);
+	memcpy(temp, path, length);
+	memcpy(temp + length, ".tmp", 5);
+	FILE *file = fopen(temp, "wb");
+	if(file == NULL) {
+		FREE_ARRAY(char, temp, length + 5);
+		return false;
+	}
+	CacheHeader header;
+	memcpy(header.magic, "LOXC", 4);
+	header.version = CACHE_VERSION;
+	header.sourceLength = key.length;
+	header.sourceHash = key.hash;
+	fwrite(&header, sizeof(header), 1, file);
+	bool ok = serializeChunk(file, chunk);
+	if(fclose(file) != 0) ok = false;
+	// write then rename so concurrent runs never map a half written cache
+	if(!ok || rename(temp, path) != 0) {
+		remove(temp);
+		ok = false;
+	}
+	FREE_ARRAY(char, temp, length + 5);
+	return ok;
+}
+
+static bool readConstants(VM *vm, uint8_t **cursor, uint8_t *end, Chunk *chunk, uint32_t count, ObjFunction *owner);
+
+bool deserializeValue(VM *vm, uint8_t **cursor, uint8_t *end, Value *value) {
+	uint32_t tag;
+	if(end - *cursor < (long)sizeof(tag)) return false;
+	memcpy(&tag, *cursor, sizeof(tag));
+	*cursor += sizeof(tag);
+	switch(tag) {
+		case TAG_NIL: *value = NIL_VAL; return true;
+		case TAG_FALSE: *value = BOOL_VAL(false); return true;
+		case TAG_TRUE: *value = BOOL_VAL(true); return true;
+		case TAG_NUMBER: {
+			double number;
+			if(end - *cursor < (long)sizeof(number)) return false;
+			memcpy(&number, *cursor, sizeof(number));
+			*cursor += sizeof(number);
+			*value = NUMBER_VAL(number);
+			return true;
+		}
+		case TAG_STRING: {
+			uint32_t length;
+			if(end - *cursor < (long)sizeof(length)) return false;
+			memcpy(&length, *cursor, sizeof(length));
+			*cursor += sizeof(length);
+			if((size_t)(end - *cursor) < ALIGN4(length)) return false;
+			*value = OBJ_VAL(copyString(vm, (char *)*cursor, length));
+			*cursor += ALIGN4(length);
+			return true;
+		}
+		case TAG_FUNCTION: {
+			uint32_t constantCount;
+			ObjFunction *function = deserializeFunctionCode(vm, cursor, end, &constantCount);
+			if(function == NULL || !readConstants(vm, cursor, end, &function->chunk, constantCount, function)) return false;
+			*value = OBJ_VAL(function);
+			return true;
+		}
+		default: return false;
+	}
+}
+
+typedef enum {
+	OPERAND_NONE,
+	OPERAND_BYTE,
+	OPERAND_CONSTANT,
+	OPERAND_NAME,          // a string constant
+	OPERAND_FUNCTION,      // a function constant
+	OPERAND_NAME_CACHE,    // string constant, inline cache
+	OPERAND_NAME_BYTE,     // string constant, argument count
+	OPERAND_INVOKE,        // string constant, argument count, inline cache
+	OPERAND_JUMP,          // forward offset
+	OPERAND_LOOP,          // backward offset
+	OPERAND_BYTE_JUMP,     // slot, forward offset
+} OperandKind;
+
+static OperandKind operandKind(uint8_t op) {
+	switch(op) {
+		case OP_CONSTANT: return OPERAND_CONSTANT;
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_IMPORT:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_GET_SUPER: return OPERAND_NAME;
+		case OP_CLOSURE: return OPERAND_FUNCTION;
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY: return OPERAND_NAME_CACHE;
+		case OP_SUPER_INVOKE: return OPERAND_NAME_BYTE;
+		case OP_INVOKE: return OPERAND_INVOKE;
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_GET_ENCLOSING:
+		case OP_SET_ENCLOSING:
+		case OP_BUILD_LIST:
+		case OP_BUILD_MAP: return OPERAND_BYTE;
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP:
+		case OP_SPAWN: return OPERAND_JUMP;
+		case OP_LOOP: return OPERAND_LOOP;
+		case OP_FOR_ITER: return OPERAND_BYTE_JUMP;
+		default: return OPERAND_NONE;
+	}
+}
+
+static int operandLength(OperandKind kind) {
+	switch(kind) {
+		case OPERAND_NONE: return 0;
+		case OPERAND_BYTE:
+		case OPERAND_CONSTANT:
+		case OPERAND_NAME:
+		case OPERAND_FUNCTION: return 1;
+		case OPERAND_NAME_BYTE:
+		case OPERAND_JUMP:
+		case OPERAND_LOOP: return 2;
+		case OPERAND_NAME_CACHE:
+		case OPERAND_BYTE_JUMP: return 3;
+		case OPERAND_INVOKE: return 4;
+	}
+	return 0;
+}
+
+static bool validConstant(Chunk *chunk, uint8_t index, OperandKind kind) {
+	if(index >= chunk->varr.count) return false;
+	Value value = chunk->varr.values[index];
+	if(kind == OPERAND_NAME || kind == OPERAND_NAME_CACHE || kind == OPERAND_NAME_BYTE ||
+			kind == OPERAND_INVOKE) return IS_STRING(value);
+	if(kind == OPERAND_FUNCTION) return IS_FUNCTION(value);
+	return true;
+}
+
+static uint16_t readShort(uint8_t *code) {
+	return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+// the (isLocal, index) pairs OP_CLOSURE reads, outer upvalues have to exist in owner
+static bool validUpvalues(ObjFunction *function, int ownerUpvalues) {
+	for(int i=0;i<function->upvalueCount;i++) {
+		uint8_t isLocal = function->upvalues[i*2];
+		uint8_t index = function->upvalues[i*2 + 1];
+		if(isLocal > 1 || (!isLocal && index >= ownerUpvalues)) return false;
+	}
+	return true;
+}
+
+// the vm trusts its bytecode, so a corrupt or hand made file is turned away here:
+// every opcode known, its operands inside the code, constants of the right type,
+// caches allocated, upvalue indices inside owner's (NULL for a script's chunk) and
+// every jump landing on an instruction. stack depth isn't tracked, so local and
+// enclosing slot indices and what each op pops are still trusted
+bool validateChunk(Chunk *chunk, ObjFunction *owner) {
+	if(chunk->count == 0) return true;
+	int upvalueCount = owner == NULL ? 0 : owner->upvalueCount;
+	bool *starts = ALLOCATE(bool, chunk->count);
+	memset(starts, 0, chunk->count);
+	bool ok = true;
+	for(int offset=0;offset<chunk->count && ok;) {
+		uint8_t op = chunk->code[offset];
+		OperandKind kind = operandKind(op);
+		int length = operandLength(kind);
+		starts[offset] = true;
+		if(op > OP_RETURN || offset + length >= chunk->count) {
+			ok = false;
+			break;
+		}
+		uint8_t *operands = chunk->code + offset + 1;
+		if(kind == OPERAND_CONSTANT || kind == OPERAND_NAME || kind == OPERAND_FUNCTION ||
+				kind == OPERAND_NAME_CACHE || kind == OPERAND_NAME_BYTE || kind == OPERAND_INVOKE) {
+			ok = validConstant(chunk, operands[0], kind);
+		}
+		if(kind == OPERAND_FUNCTION) ok = ok && validUpvalues(AS_FUNCTION(chunk->varr.values[operands[0]]), upvalueCount);
+		if(op == OP_GET_UPVALUE || op == OP_SET_UPVALUE) ok = operands[0] < upvalueCount;
+		if(op == OP_GET_ENCLOSING || op == OP_SET_ENCLOSING) ok = owner != NULL && owner->usesEnclosing;
+		if(kind == OPERAND_NAME_CACHE) ok = ok && readShort(operands + 1) < chunk->cacheCount;
+		if(kind == OPERAND_INVOKE) ok = ok && readShort(operands + 2) < chunk->cacheCount;
+		offset += 1 + length;
+	}
+	for(int offset=0;offset<chunk->count && ok;) {
+		uint8_t op = chunk->code[offset];
+		OperandKind kind = operandKind(op);
+		int next = offset + 1 + operandLength(kind);
+		long target;
+		switch(kind) {
+			case OPERAND_JUMP: target = (long)next + readShort(chunk->code + offset + 1); break;
+			case OPERAND_BYTE_JUMP: target = (long)next + readShort(chunk->code + offset + 2); break;
+			case OPERAND_LOOP: target = (long)next - readShort(chunk->code + offset + 1); break;
+			default: target = offset; break;
+		}
+		ok = target >= 0 && target < chunk->count && starts[target];
+		offset = next;
+	}
+	FREE_ARRAY(bool, starts, chunk->count);
+	return ok;
+}
+
+// code and lines are used in place, constantCount is what follows for the caller to read
+bool deserializeCode(uint8_t **cursor, uint8_t *end, Chunk *chunk, uint32_t *constantCount) {
+	initChunk(chunk);
+	ChunkHeader header;
+	if((size_t)(end - *cursor) < sizeof(header)) return false;
+	memcpy(&header, *cursor, sizeof(header));
+	*cursor += sizeof(header);
+	// every cache belongs to an instruction, so there can't be more than code bytes
+	if(header.cacheCount > header.codeCount) return false;
+	size_t bodySize = (size_t)header.codeCount * sizeof(int) + ALIGN4(header.codeCount);
+	if((size_t)(end - *cursor) < bodySize) return false;
+	chunk->lines = (int *)*cursor;
+	*cursor += header.codeCount * sizeof(int);
+	chunk->code = *cursor;
+	*cursor += ALIGN4(header.codeCount);
+	chunk->count = header.codeCount;
+	chunk->capacity = header.codeCount;
+	chunk->mapped = true;
+	// caches only hold run time shapes, so they start out empty
+	allocateCaches(chunk, header.cacheCount);
+	*constantCount = header.constantCount;
+	return true;
+}
+
+ObjFunction *deserializeFunctionCode(VM *vm, uint8_t **cursor, uint8_t *end, uint32_t *constantCount) {
+	uint32_t fields[3];
+	if(end - *cursor < (long)sizeof(fields)) return NULL;
+	memcpy(fields, *cursor, sizeof(fields));
+	*cursor += sizeof(fields);
+	size_t upvalueSize = (size_t)fields[1] * 2;
+	if((size_t)(end - *cursor) < ALIGN4(upvalueSize)) return NULL;
+	ObjFunction *function = newFunction(vm);
+	function->arity = fields[0];
+	function->upvalueCount = fields[1];
+	function->usesEnclosing = fields[2];
+	function->upvalues = ALLOCATE(uint8_t, upvalueSize);
+	if(upvalueSize > 0) memcpy(function->upvalues, *cursor, upvalueSize);
+	*cursor += ALIGN4(upvalueSize);
+	Value name;
+	if(!deserializeValue(vm, cursor, end, &name) || !IS_STRING(name)) return NULL;
+	function->name = AS_STRING(name);
+	if(!deserializeCode(cursor, end, &function->chunk, constantCount)) return NULL;
+	return function;
+}
+
+static bool readConstants(VM *vm, uint8_t **cursor, uint8_t *end, Chunk *chunk, uint32_t count, ObjFunction *owner) {
+	for(uint32_t i=0;i<count;i++) {
+		Value value;
+		if(!deserializeValue(vm, cursor, end, &value)) {
+			freeChunk(chunk);
+			return false;
+		}
+		writeValueArray(&chunk->varr, value);
+	}
+	if(!validateChunk(chunk, owner)) {
+		freeChunk(chunk);
+		return false;
+	}
+	return true;
+}
+
+bool deserializeChunk(VM *vm, uint8_t **cursor, uint8_t *end, Chunk *chunk) {
+	uint32_t constantCount;
+	return deserializeCode(cursor, end, chunk, &constantCount) &&
+		readConstants(vm, cursor, end, chunk, constantCount, NULL);
+}
+
+bool loadCache(VM *vm, char *path, SourceKey key, Chunk *chunk, Mapping *mapping) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+		close(fd);
+		return false;
+	}
+	uint8_t *start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(start == MAP_FAILED) return false;
+	mapping->start = start;
+	mapping->size = st.st_size;
+
+	CacheHeader header;
+	memcpy(&header, start, sizeof(header));
+	uint8_t *cursor = start + sizeof(header);
+	if(memcmp(header.magic, "LOXC", 4) != 0 || header.version != CACHE_VERSION ||
+			header.sourceLength != key.length || header.sourceHash != key.hash ||
+			!deserializeChunk(vm, &cursor, start + st.st_size, chunk)) {
+		unloadCache(mapping);
+		return false;
+	}
+	return true;
+}
+
+// the file is mapped over a zeroed anonymous reservation one byte longer than it, so the
+// scanner finds its '\0' even when the size is a multiple of the page size
+char *mapSource(char *path, Mapping *mapping) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = (size_t)st.st_size;
+	size_t reserved = (size / page + 1) * page;
+	char *start = mmap(NULL, reserved, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(start == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if(size > 0 && mmap(start, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(start, reserved);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	// the scanner reads it once front to back
+	madvise(start, reserved, MADV_SEQUENTIAL);
+	mapping->start = start;
+	mapping->size = reserved;
+	return start;
+}
+
+void unloadCache(Mapping *mapping) {
+	if(mapping->start != NULL) munmap(mapping->start, mapping->size);
+	mapping->start = NULL;
+	mapping->size = 0;
+}
+
+// pipes and other files that can't be mapped, the size isn't known up front
+static char *readSource(char *path) {
+	FILE *file = fopen(path, "rb");
+	if(file == NULL) return NULL;
+	size_t capacity = 4096;
+	size_t size = 0;
+	char *buffer = (char *)malloc(capacity);
+	while(buffer != NULL) {
+		size += fread(buffer + size, sizeof(char), capacity - size - 1, file);
+		if(size < capacity - 1) break;
+		capacity *= 2;
+		char *grown = (char *)realloc(buffer, capacity);
+		if(grown == NULL) free(buffer);
+		buffer = grown;
+	}
+	bool failed = ferror(file);
+	fclose(file);
+	if(buffer == NULL || failed) {
+		free(buffer);
+		return NULL;
+	}
+	buffer[size] = '\0';
+	return buffer;
+}
+
+// scripts and imported modules alike: tokens and the source hash read straight
+// from the page cache, NULL if the file can't be opened or read
+char *loadSource(char *path, Mapping *mapping) {
+	char *source = mapSource(path, mapping);
+	return source != NULL ? source : readSource(path);
+}
+
+void releaseSource(char *source, Mapping *mapping) {
+	if(mapping->start != NULL) unloadCache(mapping);
+	else free(source);
+}
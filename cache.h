@@ -0,0 +1,43 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chunk.h"
+#include "vm.h"
+
+#define CACHE_VERSION 9
+
+typedef struct {
+	void *start;
+	size_t size;
+} Mapping;
+
+// what a .loxc is checked against before it's used in place of its source
+typedef struct {
+	uint64_t length;
+	uint64_t hash;
+} SourceKey;
+
+bool serializeValue(FILE *file, Value value);
+bool deserializeValue(VM *vm, uint8_t **cursor, uint8_t *end, Value *value);
+bool serializeChunk(FILE *file, Chunk *chunk);
+bool deserializeChunk(VM *vm, uint8_t **cursor, uint8_t *end, Chunk *chunk);
+// a function or chunk up to its constants, for writers that encode those themselves
+bool serializeFunctionCode(FILE *file, ObjFunction *function);
+ObjFunction *deserializeFunctionCode(VM *vm, uint8_t **cursor, uint8_t *end, uint32_t *constantCount);
+void serializeCode(FILE *file, Chunk *chunk);
+bool deserializeCode(uint8_t **cursor, uint8_t *end, Chunk *chunk, uint32_t *constantCount);
+bool validateChunk(Chunk *chunk, ObjFunction *owner);
+
+char *cachePath(char *sourcePath);
+SourceKey sourceKey(char *source);
+bool writeCache(char *path, SourceKey key, Chunk *chunk);
+bool loadCache(VM *vm, char *path, SourceKey key, Chunk *chunk, Mapping *mapping);
+void unloadCache(Mapping *mapping);
+char *mapSource(char *path, Mapping *mapping);
+char *loadSource(char *path, Mapping *mapping);
+void releaseSource(char *source, Mapping *mapping);
+
+#endif
@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "memory.h"
+#include <string.h>
 
 
 void initChunk(Chunk *chunk) {
@@ -7,6 +8,10 @@ void initChunk(Chunk *chunk) {
 	chunk->capacity = 0;
 	chunk->code = NULL;
 	chunk->lines = NULL;
+	chunk->mapped = false;
+	chunk->caches = NULL;
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
 	initValueArray(&chunk->varr);
 }
 
@@ -26,9 +31,29 @@ int addConstant(Chunk *chunk, Value val) {
 	return chunk->varr.count-1;
 }
 
+int addCache(Chunk *chunk) {
+	if(chunk->cacheCapacity <= chunk->cacheCount) {
+		int oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+	}
+	memset(&chunk->caches[chunk->cacheCount], 0, sizeof(InlineCache));
+	return chunk->cacheCount++;
+}
+
+void allocateCaches(Chunk *chunk, int count) {
+	chunk->caches = ALLOCATE(InlineCache, count);
+	if(count > 0) memset(chunk->caches, 0, sizeof(InlineCache) * count);
+	chunk->cacheCount = count;
+	chunk->cacheCapacity = count;
+}
+
 void freeChunk(Chunk *chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+	if(!chunk->mapped) {
+		FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+		FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	}
 	freeValueArray(&chunk->varr);
 	initChunk(chunk);
 }
@@ -28,20 +28,67 @@ typedef enum {
 	OP_JUMP_IF_FALSE,
 	OP_JUMP,
 	OP_LOOP,
+	OP_IMPORT,
+	OP_SPAWN,
+	OP_YIELD,
+	OP_RESUME,
+	OP_END_FIBER,
+	OP_CALL,
+	OP_TAIL_CALL,
+	OP_CLOSURE,
+	OP_GET_UPVALUE,
+	OP_SET_UPVALUE,
+	OP_CLOSE_UPVALUE,
+	OP_GET_ENCLOSING,
+	OP_SET_ENCLOSING,
+	OP_CLASS,
+	OP_INHERIT,
+	OP_METHOD,
+	OP_GET_PROPERTY,
+	OP_SET_PROPERTY,
+	OP_INVOKE,
+	OP_GET_SUPER,
+	OP_SUPER_INVOKE,
+	OP_BUILD_LIST,
+	OP_BUILD_MAP,
+	OP_GET_INDEX,
+	OP_SET_INDEX,
+	OP_FOR_ITER,
 	OP_RETURN,
 } OpCode;
 
+#define CACHE_WAYS 4
+
+// one way of a property site's inline cache, keyed on the receiver's shape
+typedef struct {
+	ObjShape *shape;
+	ObjShape *transition; // set sites adding a field: the shape after the add
+	Value method;         // the class method when the name isn't a field
+	int index;            // field slot, -1 for methods
+} CacheEntry;
+
+// most recently filled way first, a site missing on all of them goes polymorphic up to CACHE_WAYS
+typedef struct {
+	CacheEntry entries[CACHE_WAYS];
+} InlineCache;
+
 typedef struct {
 	uint8_t *code;
 	int count;
 	int capacity;
 	ValueArray varr;
 	int *lines;
+	bool mapped; // code and lines point into a loaded .loxc, not the heap
+	InlineCache *caches; // always on the heap, they fill in at run time
+	int cacheCount;
+	int cacheCapacity;
 } Chunk;
 
 void writeChunk(Chunk *, uint8_t, int);
 void initChunk(Chunk *);
 void freeChunk(Chunk *);
 int addConstant(Chunk *, Value);
+int addCache(Chunk *);
+void allocateCaches(Chunk *, int count);
 
 #endif
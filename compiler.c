@@ -1,33 +1,78 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "obj.h"
+#include "vm.h"
+#include "memory.h"
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 
+// a local function that captured something starts out as a closure candidate, every
+// use other than a direct call marks it as escaping. when its scope ends one that
+// never escaped drops the closure and reads its captures out of the declaring frame
 typedef struct {
   Token name;
   int depth;
+  int captures; // capturing closures that still need this slot closed over
+  bool escapes;
+  int closureOffset; // -1 unless this is a closure candidate
+  ObjFunction *function;
+  int *upvalueOps;
+  int upvalueOpCount;
+  int upvalueOpCapacity;
 } Local;
 
 typedef struct {
+  uint8_t index;
+  bool isLocal;
+} Upvalue;
+
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_METHOD,
+  TYPE_INITIALIZER,
+  TYPE_SCRIPT
+} FunctionType;
+
+// spawn bodies get a TYPE_SCRIPT compiler that writes into the enclosing chunk
+typedef struct Compiler {
+  struct Compiler *enclosing;
+  ObjFunction *function;
+  FunctionType type;
+  Chunk *chunk;
   Local locals[256];
   int localCount;
+  Upvalue upvalues[256];
+  int upvalueCount;
+  bool upvaluesShared; // a nested function captures through this one's upvalues
+  // offsets of this function's OP_GET_UPVALUE/OP_SET_UPVALUE, rewritten if it doesn't escape
+  int *upvalueOps;
+  int upvalueOpCount;
+  int upvalueOpCapacity;
   int scopeDepth;
 } Compiler;
 
+typedef struct ClassCompiler {
+  struct ClassCompiler *enclosing;
+  bool hasSuperclass;
+} ClassCompiler;
+
 typedef struct {
+	Scanner scanner;
 	Token current;
 	Token prev;
 	bool hadError;
 	bool panicMode;
+	Compiler *compiler;
+	ClassCompiler *currentClass;
+	// offset of the last OP_CALL, so return can tell a call in tail position
+	int lastCall;
+	VM *vm;
 } Parser;
 
-Compiler *current = NULL;
-
-Parser parser;
-
 typedef enum {
   PREC_NONE,
   PREC_ASSIGNMENT,  // =
@@ -42,7 +87,7 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool );
+typedef void (*ParseFn)(Parser *, bool);
 
 typedef struct {
   ParseFn prefix;
@@ -51,19 +96,27 @@ typedef struct {
 } ParseRule;
 
 
-static void binary(bool), grouping(bool), unary(bool), number(bool), literal(bool), string(bool), variable(bool), and_(bool),
-or_(bool);
-static int emitJump(uint8_t);
-static void expression(), decleration(), statement(), patchJump(int), varDecleration();
+static void binary(Parser *, bool), grouping(Parser *, bool), unary(Parser *, bool), number(Parser *, bool), literal(Parser *, bool),
+string(Parser *, bool), variable(Parser *, bool), and_(Parser *, bool), or_(Parser *, bool), spawn(Parser *, bool), call(Parser *, bool),
+dot(Parser *, bool), this_(Parser *, bool), super_(Parser *, bool), list(Parser *, bool), index_(Parser *, bool), map(Parser *, bool);
+static int emitJump(Parser *, uint8_t);
+static uint8_t identifierConstant(Parser *, Token *);
+static void addLocal(Parser *, Token), markInit(Parser *);
+static Token syntheticToken(char *text);
+static void expression(Parser *), decleration(Parser *), statement(Parser *), patchJump(Parser *, int), varDecleration(Parser *),
+block(Parser *), beginScope(Parser *);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser *, Precedence precedence);
 ParseRule rules[] = {
-  [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+  [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACE]    = {map,      NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {list,     index_, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
   [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM},
   [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
@@ -87,15 +140,20 @@ ParseRule rules[] = {
   [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IMPORT]        = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IN]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,     NULL,   PREC_NONE},
   [TOKEN_OR]            = {NULL,     or_,   PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_RESUME]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_THIS]          = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_SPAWN]         = {spawn,    NULL,   PREC_NONE},
+  [TOKEN_SUPER]         = {super_,   NULL,   PREC_NONE},
+  [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE},
   [TOKEN_TRUE]          = {literal,     NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_YIELD]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
@@ -106,21 +164,42 @@ static ParseRule* getRule(TokenType type) {
 }
 
 
-Chunk *compillingChunk;
-
-static Chunk *currentChunk() {
-	return compillingChunk;
+static Chunk *currentChunk(Parser *parser) {
+	return parser->compiler->chunk;
 }
 
-static void initCompiler(Compiler *compiler) {
+static void initCompiler(Parser *parser, Compiler *compiler, FunctionType type) {
+  compiler->enclosing = parser->compiler;
+  compiler->function = NULL;
+  compiler->type = type;
+  compiler->chunk = compiler->enclosing != NULL ? compiler->enclosing->chunk : NULL;
   compiler->scopeDepth = 0;
   compiler->localCount = 0;
-  current = compiler;
+  compiler->upvalueCount = 0;
+  compiler->upvaluesShared = false;
+  compiler->upvalueOps = NULL;
+  compiler->upvalueOpCount = 0;
+  compiler->upvalueOpCapacity = 0;
+  parser->compiler = compiler;
+  if(type != TYPE_SCRIPT) {
+    compiler->function = newFunction(parser->vm);
+    compiler->function->name = copyString(parser->vm, parser->prev.start, parser->prev.length);
+    compiler->chunk = &compiler->function->chunk;
+    // slot 0 holds the callee, or the receiver for methods, the arguments follow it in place
+    Local *local = &compiler->locals[compiler->localCount++];
+    local->depth = 0;
+    local->captures = 0;
+    local->escapes = false;
+    local->closureOffset = -1;
+    local->name.start = type == TYPE_FUNCTION ? "" : "this";
+    local->name.length = type == TYPE_FUNCTION ? 0 : 4;
+  }
 }
 
-static void errorAt(Token *token, char *msg) {
-	if(parser.panicMode) return;
-	parser.panicMode = true;
+static void errorAt(Parser *parser, Token *token, char *msg) {
+	if(parser->panicMode) return;
+	parser->panicMode = true;
+	flushOutput(&parser->vm->out);
 	printf("[line %d] Error", token->line);
 	if(token->type == TOKEN_EOF) {
 		printf(" at end");
@@ -130,61 +209,61 @@ static void errorAt(Token *token, char *msg) {
 		printf(" at '%.*s'", token->length, token->start);
 	}
 	printf(": %s\n", msg);
-	parser.hadError = true;
+	parser->hadError = true;
 }
 
-static void error(char *msg) {
-	errorAt(&parser.prev, msg);
+static void error(Parser *parser, char *msg) {
+	errorAt(parser, &parser->prev, msg);
 }
 
-static void errorAtCurrent(char *msg) {
-	errorAt(&parser.current, msg);
+static void errorAtCurrent(Parser *parser, char *msg) {
+	errorAt(parser, &parser->current, msg);
 }
 
-static void advance() {
-	parser.prev = parser.current;
+static void advance(Parser *parser) {
+	parser->prev = parser->current;
 	while(1) {
-		parser.current = scanToken();
-		if(parser.current.type == TOKEN_ERROR) errorAtCurrent(parser.current.start);
+		parser->current = scanToken(&parser->scanner);
+		if(parser->current.type == TOKEN_ERROR) errorAtCurrent(parser, parser->current.start);
     break;
 	}
 }
 
-static void consume(TokenType type, char *msg) {
-	if(parser.current.type != type) {
-		errorAtCurrent(msg);
+static void consume(Parser *parser, TokenType type, char *msg) {
+	if(parser->current.type != type) {
+		errorAtCurrent(parser, msg);
 		return;
 	}
-	advance();
+	advance(parser);
 	return;
 }
 
-static bool check(TokenType type) {
-  return parser.current.type == type;
+static bool check(Parser *parser, TokenType type) {
+  return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-  if(check(type)) {
-    advance();
+static bool match(Parser *parser, TokenType type) {
+  if(check(parser, type)) {
+    advance(parser);
     return true;
   }
   return false;
 }
 
-static uint8_t makeConstant(Value value) {
-	uint16_t index = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser *parser, Value value) {
+	uint16_t index = addConstant(currentChunk(parser), value);
 	if(index > 255) {
-		error("Too many Constants in one chunk");
+		error(parser, "Too many Constants in one chunk");
 		return 0;
 	}
 	return (int8_t)index;
 }
 
-static void sync() {
-  parser.panicMode = false;
-  while(parser.current.type != TOKEN_EOF) {
-    if(parser.prev.type == TOKEN_SEMICOLON) return;
-    switch(parser.current.type) {
+static void synchronize(Parser *parser) {
+  parser->panicMode = false;
+  while(parser->current.type != TOKEN_EOF) {
+    if(parser->prev.type == TOKEN_SEMICOLON) return;
+    switch(parser->current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
       case TOKEN_VAR:
@@ -193,282 +272,520 @@ static void sync() {
       case TOKEN_WHILE:
       case TOKEN_PRINT:
       case TOKEN_RETURN:
+      case TOKEN_IMPORT:
+      case TOKEN_YIELD:
+      case TOKEN_RESUME:
         return;
       default: break;
     }
-    advance();
+    advance(parser);
   }
 }
 
 
-static void emitByte(uint8_t byte) {
-	writeChunk(currentChunk(), byte, parser.prev.line);
+static void emitByte(Parser *parser, uint8_t byte) {
+	writeChunk(currentChunk(parser), byte, parser->prev.line);
+}
+
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+	emitByte(parser, byte1);
+	emitByte(parser, byte2);
+}
+
+static void emitConstant(Parser *parser, Value value) {
+	emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-	emitByte(byte1);
-	emitByte(byte2);
+static void recordUpvalueOp(Parser *parser) {
+  Compiler *compiler = parser->compiler;
+  if(compiler->upvalueOpCount == compiler->upvalueOpCapacity) {
+    int oldCapacity = compiler->upvalueOpCapacity;
+    compiler->upvalueOpCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalueOps = GROW_ARRAY(int, compiler->upvalueOps, oldCapacity, compiler->upvalueOpCapacity);
+  }
+  compiler->upvalueOps[compiler->upvalueOpCount++] = currentChunk(parser)->count;
 }
 
-static void emitConstant(Value value) {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+// decides a closure candidate once its scope is over, locals are settled innermost
+// first so the slots it captured haven't been popped yet
+static void settleLocal(Parser *parser, Local *local) {
+  if(local->closureOffset == -1) return;
+  ObjFunction *function = local->function;
+  if(!local->escapes) {
+    currentChunk(parser)->code[local->closureOffset] = OP_CONSTANT;
+    for(int i=0;i<local->upvalueOpCount;i++) {
+      uint8_t *op = function->chunk.code + local->upvalueOps[i];
+      op[0] = op[0] == OP_GET_UPVALUE ? OP_GET_ENCLOSING : OP_SET_ENCLOSING;
+      op[1] = function->upvalues[op[1]*2 + 1];
+    }
+    for(int i=0;i<function->upvalueCount;i++) {
+      parser->compiler->locals[function->upvalues[i*2 + 1]].captures--;
+    }
+    function->usesEnclosing = true;
+  }
+  FREE_ARRAY(int, local->upvalueOps, local->upvalueOpCapacity);
+  local->closureOffset = -1;
+}
+
+// for bodies that end without popping their locals
+static void settleLocals(Parser *parser) {
+  for(int i=parser->compiler->localCount-1;i>=0;i--) {
+    settleLocal(parser, &parser->compiler->locals[i]);
+  }
 }
 
-static void emitReturn() {
-	emitByte(OP_RETURN);
+static void emitReturn(Parser *parser) {
+	if(parser->compiler->type == TYPE_INITIALIZER) emitBytes(parser, OP_GET_LOCAL, 0);
+	else emitByte(parser, OP_NIL);
+	emitByte(parser, OP_RETURN);
 }
 
-static void endCompiler() {
-	emitReturn();
+static ObjFunction *endCompiler(Parser *parser) {
+	emitReturn(parser);
+	settleLocals(parser);
+	ObjFunction *function = parser->compiler->function;
+	parser->compiler = parser->compiler->enclosing;
+	return function;
 }
 
-static void parsePrecedence(Precedence precedence) {
-	advance();
-	ParseFn prefixRule = getRule(parser.prev.type)->prefix;
+static void parsePrecedence(Parser *parser, Precedence precedence) {
+	advance(parser);
+	ParseFn prefixRule = getRule(parser->prev.type)->prefix;
 	if(prefixRule == NULL) {
-		error("Expected expression");
+		error(parser, "Expected expression");
     return;
 	}
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
-	while(precedence <= getRule(parser.current.type)->precedence) {
-		advance();
-		ParseFn infixRule = getRule(parser.prev.type)->infix;
-		infixRule(canAssign);
+  prefixRule(parser, canAssign);
+	while(precedence <= getRule(parser->current.type)->precedence) {
+		advance(parser);
+		ParseFn infixRule = getRule(parser->prev.type)->infix;
+		infixRule(parser, canAssign);
 	}
-  if(canAssign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target");
+  if(canAssign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target");
   }
 }
 
-static void number(bool canAssign) {
-	double value = strtod(parser.prev.start, NULL);
-	emitConstant(NUMBER_VAL(value));
+static void number(Parser *parser, bool canAssign) {
+	emitConstant(parser, NUMBER_VAL(parser->prev.number));
 }
 
-static void literal(bool canAssign) {
-  switch(parser.prev.type) {
+static void literal(Parser *parser, bool canAssign) {
+  switch(parser->prev.type) {
     case TOKEN_FALSE:
-      emitByte(OP_FALSE);
+      emitByte(parser, OP_FALSE);
       break;
     case TOKEN_TRUE:
-      emitByte(OP_TRUE);
+      emitByte(parser, OP_TRUE);
       break;
     case TOKEN_NIL:
-      emitByte(OP_NIL);
+      emitByte(parser, OP_NIL);
       break;
     default: break;
   }
 }
 
-static void grouping(bool canAssign) {
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+static void grouping(Parser *parser, bool canAssign) {
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression");
 }
 
-static void unary(bool canAssign) {
-	TokenType operatorType = parser.prev.type;
+static void unary(Parser *parser, bool canAssign) {
+	TokenType operatorType = parser->prev.type;
 
-	parsePrecedence(PREC_UNARY);
+	parsePrecedence(parser, PREC_UNARY);
 
 	switch(operatorType) {
-		case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+		case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
 		default:
 			break;
 
 	}
 }
 
-static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(parser.prev.start + 1, parser.prev.length - 2)));
+static void string(Parser *parser, bool canAssign) {
+  emitConstant(parser, OBJ_VAL(copyString(parser->vm, parser->prev.start + 1, parser->prev.length - 2)));
 }
 
-static void binary(bool canAssign) {
-	TokenType operatorType = parser.prev.type;
+static void binary(Parser *parser, bool canAssign) {
+	TokenType operatorType = parser->prev.type;
 	ParseRule *rule = getRule(operatorType);
-	parsePrecedence((Precedence)(rule->precedence+1));
+	parsePrecedence(parser, (Precedence)(rule->precedence+1));
 	switch(operatorType) {
-    case TOKEN_PLUS:          emitByte(OP_ADD); break;
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-    case TOKEN_BANG_EQUAL:   emitBytes(OP_EQUAL, OP_NOT); break;
-    case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emitByte(OP_LESS); break;
-    case TOKEN_GREATER:       emitByte(OP_GREATER); break;
+    case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
+    case TOKEN_MINUS:         emitByte(parser, OP_SUBTRACT); break;
+    case TOKEN_STAR:          emitByte(parser, OP_MULTIPLY); break;
+    case TOKEN_SLASH:         emitByte(parser, OP_DIVIDE); break;
+    case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;
+    case TOKEN_BANG_EQUAL:   emitBytes(parser, OP_EQUAL, OP_NOT); break;
+    case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;
+    case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+    case TOKEN_LESS:          emitByte(parser, OP_LESS); break;
+    case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;
     default: return; // Unreachable.
 	}
 }
 
-static void and_(bool canAssign) {
-  int jump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  parsePrecedence(PREC_AND);
-  patchJump(jump);
+static uint8_t argumentList(Parser *parser) {
+  uint8_t argCount = 0;
+  if(!check(parser, TOKEN_RIGHT_PAREN)) {
+    do {
+      expression(parser);
+      if(argCount == 255) {
+        error(parser, "Can't have more than 255 arguments.");
+      }
+      argCount++;
+    } while(match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return argCount;
+}
+
+static void call(Parser *parser, bool canAssign) {
+  uint8_t argCount = argumentList(parser);
+  emitBytes(parser, OP_CALL, argCount);
+  parser->lastCall = currentChunk(parser)->count - 2;
+}
+
+static void emitCache(Parser *parser) {
+  int cache = addCache(currentChunk(parser));
+  if(cache > UINT16_MAX) error(parser, "Too many property accesses in one chunk.");
+  emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void dot(Parser *parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = identifierConstant(parser, &parser->prev);
+  if(canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitBytes(parser, OP_SET_PROPERTY, name);
+  } else if(match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_INVOKE, name);
+    emitByte(parser, argCount);
+  } else {
+    emitBytes(parser, OP_GET_PROPERTY, name);
+  }
+  emitCache(parser);
+}
+
+static void list(Parser *parser, bool canAssign) {
+  int count = 0;
+  if(!check(parser, TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression(parser);
+      if(count == 255) {
+        error(parser, "Can't have more than 255 elements in a list literal.");
+      }
+      count++;
+    } while(match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  emitBytes(parser, OP_BUILD_LIST, (uint8_t)count);
+}
+
+// only reached in expression position, a '{' starting a statement is still a block
+static void map(Parser *parser, bool canAssign) {
+  int count = 0;
+  if(!check(parser, TOKEN_RIGHT_BRACE)) {
+    do {
+      expression(parser);
+      consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+      expression(parser);
+      if(count == 255) {
+        error(parser, "Can't have more than 255 entries in a map literal.");
+      }
+      count++;
+    } while(match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitBytes(parser, OP_BUILD_MAP, (uint8_t)count);
 }
 
-static void or_(bool canAssign) {
+static void index_(Parser *parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+  if(canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitByte(parser, OP_SET_INDEX);
+  } else {
+    emitByte(parser, OP_GET_INDEX);
+  }
+}
+
+static void and_(Parser *parser, bool canAssign) {
+  int jump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_AND);
+  patchJump(parser, jump);
+}
+
+static void or_(Parser *parser, bool canAssign) {
   // since (x or y) == !(!x and !y), De'morgans law bro
-  emitByte(OP_NOT);
-  int jump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  parsePrecedence(PREC_OR);
-  emitByte(OP_NOT);
-  patchJump(jump);
-  emitByte(OP_NOT);
+  emitByte(parser, OP_NOT);
+  int jump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_OR);
+  emitByte(parser, OP_NOT);
+  patchJump(parser, jump);
+  emitByte(parser, OP_NOT);
 }
 
+// the body is compiled inline and jumped over, it runs on the fiber's own stack
+// so it gets a fresh Compiler and can't see the enclosing locals
+static void spawn(Parser *parser, bool canAssign) {
+  int skip = emitJump(parser, OP_SPAWN);
+  Compiler compiler;
+  initCompiler(parser, &compiler, TYPE_SCRIPT);
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' after 'spawn'.");
+  block(parser);
+  emitByte(parser, OP_END_FIBER);
+  settleLocals(parser);
+  parser->compiler = compiler.enclosing;
+  patchJump(parser, skip);
+}
 
-static void expression() {
-  parsePrecedence(PREC_ASSIGNMENT);	
+static void expression(Parser *parser) {
+  parsePrecedence(parser, PREC_ASSIGNMENT);	
 }
 
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "expect ';' after expression");
-  emitByte(OP_POP);
+static void expressionStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "expect ';' after expression");
+  emitByte(parser, OP_POP);
 }
 
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-  emitByte(OP_PRINT);
+static void printStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression");
+  emitByte(parser, OP_PRINT);
 }
 
-static void block() {
-  while(!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    decleration();
+static void block(Parser *parser) {
+  while(!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    decleration(parser);
   }
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void beginScope() {
-  current->scopeDepth++;
+static void beginScope(Parser *parser) {
+  parser->compiler->scopeDepth++;
 }
 
-static void endScope() {
-  current->scopeDepth--;
-  while(current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-    emitByte(OP_POP);
-    current->localCount--;
+static void endScope(Parser *parser) {
+  parser->compiler->scopeDepth--;
+  while(parser->compiler->localCount > 0 && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+    Local *local = &parser->compiler->locals[parser->compiler->localCount - 1];
+    settleLocal(parser, local);
+    emitByte(parser, local->captures > 0 ? OP_CLOSE_UPVALUE : OP_POP);
+    parser->compiler->localCount--;
   }
 }
 
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitBytes(0xff, 0xff);
-  return currentChunk()->count - 2;
+static int emitJump(Parser *parser, uint8_t instruction) {
+  emitByte(parser, instruction);
+  emitBytes(parser, 0xff, 0xff);
+  return currentChunk(parser)->count - 2;
 }
 
-static void patchJump(int index) {
-  int jump = currentChunk()->count - index - 2;
+static void patchJump(Parser *parser, int index) {
+  int jump = currentChunk(parser)->count - index - 2;
   if(jump > UINT16_MAX) {
-    error("Too much to jump over.");
-  }
-  currentChunk()->code[index] = (jump >> 8) & 0xff;
-  currentChunk()->code[index+1] = jump & 0xff;
-
-}
-
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
-  int elseJump = emitJump(OP_JUMP);
-  patchJump(thenJump);
-  emitByte(OP_POP);
-  if(match(TOKEN_ELSE)) statement();
-  patchJump(elseJump);
-}
-
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
-  int offset = currentChunk()->count - loopStart + 2;
-  if(offset > UINT16_MAX) error("Loop body too large.");
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
-}
-
-static void whileStatement() {
-  int loopStart = currentChunk()->count; // before jump so it goes to jump
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
-  emitLoop(loopStart);
-  patchJump(exitJump);
-  emitByte(OP_POP);
-}
-
-static void forStatement() {
-  beginScope();
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if(match(TOKEN_SEMICOLON)) {
+    error(parser, "Too much to jump over.");
+  }
+  currentChunk(parser)->code[index] = (jump >> 8) & 0xff;
+  currentChunk(parser)->code[index+1] = jump & 0xff;
+
+}
+
+static void ifStatement(Parser *parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
+  int elseJump = emitJump(parser, OP_JUMP);
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
+  if(match(parser, TOKEN_ELSE)) statement(parser);
+  patchJump(parser, elseJump);
+}
+
+static void emitLoop(Parser *parser, int loopStart) {
+  emitByte(parser, OP_LOOP);
+  int offset = currentChunk(parser)->count - loopStart + 2;
+  if(offset > UINT16_MAX) error(parser, "Loop body too large.");
+  emitByte(parser, (offset >> 8) & 0xff);
+  emitByte(parser, offset & 0xff);
+}
+
+static void whileStatement(Parser *parser) {
+  int loopStart = currentChunk(parser)->count; // before jump so it goes to jump
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
+  emitLoop(parser, loopStart);
+  patchJump(parser, exitJump);
+  emitByte(parser, OP_POP);
+}
+
+// the sequence and the next index live in two hidden locals, OP_FOR_ITER pushes
+// the next element or jumps out once the index runs off the end
+static void forInStatement(Parser *parser) {
+  consume(parser, TOKEN_VAR, "Expect 'var' after '('.");
+  consume(parser, TOKEN_IDENTIFIER, "Expect loop variable name.");
+  Token name = parser->prev;
+  consume(parser, TOKEN_IN, "Expect 'in' after loop variable.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+  int sequence = parser->compiler->localCount;
+  addLocal(parser, syntheticToken("for sequence"));
+  markInit(parser);
+  emitConstant(parser, NUMBER_VAL(0));
+  addLocal(parser, syntheticToken("for index"));
+  markInit(parser);
+  int loopStart = currentChunk(parser)->count;
+  emitBytes(parser, OP_FOR_ITER, (uint8_t)sequence);
+  int exitJump = currentChunk(parser)->count;
+  emitBytes(parser, 0xff, 0xff);
+  // a fresh variable per iteration, so closures in the body capture their own
+  beginScope(parser);
+  addLocal(parser, name);
+  markInit(parser);
+  statement(parser);
+  endScope(parser);
+  emitLoop(parser, loopStart);
+  patchJump(parser, exitJump);
+}
+
+static bool isForIn(Parser *parser) {
+  if(!check(parser, TOKEN_VAR)) return false;
+  Scanner lookahead = parser->scanner;
+  Token name = scanToken(&lookahead);
+  return name.type == TOKEN_IDENTIFIER && scanToken(&lookahead).type == TOKEN_IN;
+}
+
+static void forStatement(Parser *parser) {
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if(isForIn(parser)) {
+    forInStatement(parser);
+    endScope(parser);
+    return;
+  }
+  if(match(parser, TOKEN_SEMICOLON)) {
     
-  } else if(match(TOKEN_VAR)) {
-    varDecleration();
+  } else if(match(parser, TOKEN_VAR)) {
+    varDecleration(parser);
   } else {
-    expressionStatement(); // pop the value after setting it (or after any other type of expression)
+    expressionStatement(parser); // pop the value after setting it (or after any other type of expression)
   }
-  int loopStart = currentChunk()->count;
+  int loopStart = currentChunk(parser)->count;
   int exitJump = -1;
-  if(!match(TOKEN_SEMICOLON)) {
-    expression(); 
-    consume(TOKEN_SEMICOLON, "Expect ';' after condition.");
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+  if(!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser); 
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after condition.");
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
   } else {
-    emitByte(OP_TRUE);
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-  }
-  if(!match(TOKEN_RIGHT_PAREN)) {
-    int bodyJump = emitJump(OP_JUMP);
-    int incrementJump = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-    emitLoop(loopStart);
+    emitByte(parser, OP_TRUE);
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+  }
+  if(!match(parser, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(parser, OP_JUMP);
+    int incrementJump = currentChunk(parser)->count;
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    emitLoop(parser, loopStart);
     loopStart = incrementJump; // add loop to increment statement
-    patchJump(bodyJump);
+    patchJump(parser, bodyJump);
   }
-  statement();
-  emitLoop(loopStart);
+  statement(parser);
+  emitLoop(parser, loopStart);
   if(exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP);
-  }
-  endScope();
-}
-
-
-static void statement() {
-  if(match(TOKEN_PRINT)) {
-    printStatement();
-  } else if(match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
-  } else if(match(TOKEN_IF)) {
-    ifStatement();
-  } else if(match(TOKEN_WHILE)) {
-    whileStatement();
-  } else if(match(TOKEN_FOR)) {
-    forStatement();
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
+  }
+  endScope(parser);
+}
+
+
+// the module body runs in its own frame, so imports work at any depth
+static void importStatement(Parser *parser) {
+  consume(parser, TOKEN_STRING, "Expect module path after 'import'.");
+  uint8_t path = makeConstant(parser, OBJ_VAL(copyString(parser->vm, parser->prev.start + 1, parser->prev.length - 2)));
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after module path.");
+  emitBytes(parser, OP_IMPORT, path);
+}
+
+static void yieldStatement(Parser *parser) {
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after 'yield'.");
+  emitByte(parser, OP_YIELD);
+}
+
+static void resumeStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after fiber.");
+  emitByte(parser, OP_RESUME);
+}
+
+static void returnStatement(Parser *parser) {
+  if(parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "Can't return from top-level code.");
+  }
+  if(match(parser, TOKEN_SEMICOLON)) {
+    emitReturn(parser);
   } else {
-    expressionStatement();
+    if(parser->compiler->type == TYPE_INITIALIZER) {
+      error(parser, "Can't return a value from an initializer.");
+    }
+    parser->lastCall = -1;
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // the OP_RETURN stays behind it for natives and for jumps that land past the call
+    if(parser->lastCall == currentChunk(parser)->count - 2) {
+      currentChunk(parser)->code[parser->lastCall] = OP_TAIL_CALL;
+    }
+    emitByte(parser, OP_RETURN);
   }
 }
 
-static uint8_t identifierConstant(Token *token) {
-  return makeConstant(OBJ_VAL(copyString(token->start, token->length)));
+static void statement(Parser *parser) {
+  if(match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if(match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
+  } else if(match(parser, TOKEN_YIELD)) {
+    yieldStatement(parser);
+  } else if(match(parser, TOKEN_RESUME)) {
+    resumeStatement(parser);
+  } else if(match(parser, TOKEN_IMPORT)) {
+    importStatement(parser);
+  } else if(match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
+  } else if(match(parser, TOKEN_IF)) {
+    ifStatement(parser);
+  } else if(match(parser, TOKEN_WHILE)) {
+    whileStatement(parser);
+  } else if(match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else {
+    expressionStatement(parser);
+  }
+}
+
+static uint8_t identifierConstant(Parser *parser, Token *token) {
+  return makeConstant(parser, OBJ_VAL(copyString(parser->vm, token->start, token->length)));
 }
 
 static bool identifiersEqual(Token *a1, Token *a2) {
@@ -476,67 +793,71 @@ static bool identifiersEqual(Token *a1, Token *a2) {
   return true;
 }
 
-static void addLocal(Token name) {
-  if(current->localCount >= UINT8_MAX) {
-    error("Too many local variables in one block.");
+static void addLocal(Parser *parser, Token name) {
+  if(parser->compiler->localCount >= UINT8_MAX) {
+    error(parser, "Too many local variables in one block.");
     return;
   }
-  Local *local = current->locals + current->localCount++;
+  Local *local = parser->compiler->locals + parser->compiler->localCount++;
   local->name = name;
   local->depth = -1;
+  local->captures = 0;
+  local->escapes = false;
+  local->closureOffset = -1;
 }
 
-static void declareVariable() {
-  if(current->scopeDepth == 0) return;
-  Token *name = &parser.prev;
-  for(int i=current->localCount-1;i>=0;i--) {
-    Local *local = &current->locals[i];
-    if(local->depth != -1 && local->depth < current->scopeDepth) {
+static void declareVariable(Parser *parser) {
+  if(parser->compiler->scopeDepth == 0) return;
+  Token *name = &parser->prev;
+  for(int i=parser->compiler->localCount-1;i>=0;i--) {
+    Local *local = &parser->compiler->locals[i];
+    if(local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
       break;
     }
     if(identifiersEqual(name, &local->name)) {
-      error("Already a variable with the same name in this scope.");
+      error(parser, "Already a variable with the same name in this scope.");
     } 
   }
-  addLocal(*name);
+  addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(char *msg) {
-  consume(TOKEN_IDENTIFIER, msg); // consume identifier name and make it prev
-  declareVariable();
-  if(current->scopeDepth > 0) return 0;
-  return identifierConstant(&parser.prev);
+static uint8_t parseVariable(Parser *parser, char *msg) {
+  consume(parser, TOKEN_IDENTIFIER, msg); // consume identifier name and make it prev
+  declareVariable(parser);
+  if(parser->compiler->scopeDepth > 0) return 0;
+  return identifierConstant(parser, &parser->prev);
 }
 
-static void markInit() {
-  current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInit(Parser *parser) {
+  if(parser->compiler->scopeDepth == 0) return;
+  parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t id) {
-  if(current->scopeDepth > 0) {
-    markInit();
+static void defineVariable(Parser *parser, uint8_t id) {
+  if(parser->compiler->scopeDepth > 0) {
+    markInit(parser);
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, id);
+  emitBytes(parser, OP_DEFINE_GLOBAL, id);
 }
 
-static void varDecleration() {
-  uint8_t global = parseVariable("expected Variable name");
-  if(match(TOKEN_EQUAL)) {
-    expression();
+static void varDecleration(Parser *parser) {
+  uint8_t global = parseVariable(parser, "expected Variable name");
+  if(match(parser, TOKEN_EQUAL)) {
+    expression(parser);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
-  consume(TOKEN_SEMICOLON,"Expect ';' after variable decleration");
-  defineVariable(global);
+  consume(parser, TOKEN_SEMICOLON,"Expect ';' after variable decleration");
+  defineVariable(parser, global);
 }
 
-static int resloveLocal(Compiler *compiler, Token *name) {
+static int resloveLocal(Parser *parser, Compiler *compiler, Token *name) {
   for(int i=compiler->localCount-1;i>=0;i--) {
     Local *local = &(compiler->locals[i]);
     if(identifiersEqual(&local->name, name)) {
       if(local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
+        error(parser, "Can't read local variable in its own initializer.");
       }
       return i;
     }
@@ -544,50 +865,364 @@ static int resloveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index, bool isLocal) {
+  for(int i=0;i<compiler->upvalueCount;i++) {
+    Upvalue *upvalue = &compiler->upvalues[i];
+    if(upvalue->index == index && upvalue->isLocal == isLocal) return i;
+  }
+  if(compiler->upvalueCount == 256) {
+    error(parser, "Too many closure variables in function.");
+    return 0;
+  }
+  if(isLocal) compiler->enclosing->locals[index].captures++;
+  compiler->upvalues[compiler->upvalueCount].isLocal = isLocal;
+  compiler->upvalues[compiler->upvalueCount].index = index;
+  return compiler->upvalueCount++;
+}
+
+// spawn bodies and the script have nothing to capture from, so the search stops there
+static int resolveUpvalue(Parser *parser, Compiler *compiler, Token *name) {
+  if(compiler->type == TYPE_SCRIPT) return -1;
+  int local = resloveLocal(parser, compiler->enclosing, name);
+  if(local != -1) {
+    // a function that's captured can be called from anywhere
+    compiler->enclosing->locals[local].escapes = true;
+    return addUpvalue(parser, compiler, (uint8_t)local, true);
+  }
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
+  if(upvalue != -1) {
+    compiler->enclosing->upvaluesShared = true;
+    return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
+  }
+  return -1;
+}
+
+static void namedVariable(Parser *parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resloveLocal(current, &name);
+  int arg = resloveLocal(parser, parser->compiler, &name);
   if(arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    if(!check(parser, TOKEN_LEFT_PAREN)) parser->compiler->locals[arg].escapes = true;
+  } else if((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
+    getOp = OP_GET_UPVALUE;
+    setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierConstant(parser, &name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
-  if(canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
+  if(canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    if(setOp == OP_SET_UPVALUE) recordUpvalueOp(parser);
+    emitBytes(parser, setOp, (uint8_t)arg);
+  } else {
+    if(getOp == OP_GET_UPVALUE) recordUpvalueOp(parser);
+    emitBytes(parser, getOp, (uint8_t)arg);
+  }
+}
+
+static void variable(Parser *parser, bool canAssign) {
+  namedVariable(parser, parser->prev, canAssign);
+}
+
+// parameters are locals of the function's own compiler, declared in order from slot 1
+static void function(Parser *parser, FunctionType type) {
+  Compiler compiler;
+  initCompiler(parser, &compiler, type);
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if(!check(parser, TOKEN_RIGHT_PAREN)) {
+    do {
+      compiler.function->arity++;
+      if(compiler.function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters.");
+      }
+      uint8_t constant = parseVariable(parser, "Expect parameter name.");
+      defineVariable(parser, constant);
+    } while(match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(parser);
+  ObjFunction *function = endCompiler(parser);
+  uint8_t constant = makeConstant(parser, OBJ_VAL(function));
+  // functions that capture nothing never need a closure object
+  if(compiler.upvalueCount == 0) {
+    emitBytes(parser, OP_CONSTANT, constant);
+    FREE_ARRAY(int, compiler.upvalueOps, compiler.upvalueOpCapacity);
+    return;
+  }
+  function->upvalueCount = compiler.upvalueCount;
+  function->upvalues = ALLOCATE(uint8_t, compiler.upvalueCount * 2);
+  bool candidate = type == TYPE_FUNCTION && parser->compiler->scopeDepth > 0 && !compiler.upvaluesShared;
+  for(int i=0;i<compiler.upvalueCount;i++) {
+    function->upvalues[i*2] = compiler.upvalues[i].isLocal ? 1 : 0;
+    function->upvalues[i*2 + 1] = compiler.upvalues[i].index;
+    if(!compiler.upvalues[i].isLocal) candidate = false;
+  }
+  Local *local = &parser->compiler->locals[parser->compiler->localCount - 1];
+  if(candidate) {
+    local->closureOffset = currentChunk(parser)->count;
+    local->function = function;
+    local->upvalueOps = compiler.upvalueOps;
+    local->upvalueOpCount = compiler.upvalueOpCount;
+    local->upvalueOpCapacity = compiler.upvalueOpCapacity;
+  } else {
+    FREE_ARRAY(int, compiler.upvalueOps, compiler.upvalueOpCapacity);
+  }
+  emitBytes(parser, OP_CLOSURE, constant);
+}
+
+static Token syntheticToken(char *text) {
+  Token token;
+  token.start = text;
+  token.length = (int)strlen(text);
+  token.line = 0;
+  return token;
+}
+
+static void this_(Parser *parser, bool canAssign) {
+  if(parser->currentClass == NULL) {
+    error(parser, "Can't use 'this' outside of a class.");
+    return;
+  }
+  variable(parser, false);
+}
+
+static void super_(Parser *parser, bool canAssign) {
+  if(parser->currentClass == NULL) {
+    error(parser, "Can't use 'super' outside of a class.");
+  } else if(!parser->currentClass->hasSuperclass) {
+    error(parser, "Can't use 'super' in a class with no superclass.");
+  }
+  consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = identifierConstant(parser, &parser->prev);
+  namedVariable(parser, syntheticToken("this"), false);
+  if(match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    namedVariable(parser, syntheticToken("super"), false);
+    emitBytes(parser, OP_SUPER_INVOKE, name);
+    emitByte(parser, argCount);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    namedVariable(parser, syntheticToken("super"), false);
+    emitBytes(parser, OP_GET_SUPER, name);
+  }
+}
+
+static void method(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifierConstant(parser, &parser->prev);
+  FunctionType type = TYPE_METHOD;
+  if(parser->prev.length == 4 && memcmp(parser->prev.start, "init", 4) == 0) type = TYPE_INITIALIZER;
+  function(parser, type);
+  emitBytes(parser, OP_METHOD, constant);
+}
+
+// instances start out on the class's own root shape, fields are added by assignment
+static void classDeclaration(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser->prev;
+  uint8_t nameConstant = identifierConstant(parser, &parser->prev);
+  declareVariable(parser);
+  emitBytes(parser, OP_CLASS, nameConstant);
+  defineVariable(parser, nameConstant);
+
+  ClassCompiler classCompiler;
+  classCompiler.hasSuperclass = false;
+  classCompiler.enclosing = parser->currentClass;
+  parser->currentClass = &classCompiler;
+
+  if(match(parser, TOKEN_LESS)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(parser, false);
+    if(identifiersEqual(&className, &parser->prev)) {
+      error(parser, "A class can't inherit from itself.");
+    }
+    // methods capture the superclass through a local named super
+    beginScope(parser);
+    addLocal(parser, syntheticToken("super"));
+    defineVariable(parser, 0);
+    namedVariable(parser, className, false);
+    emitByte(parser, OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  namedVariable(parser, className, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while(!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(parser);
   }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(parser, OP_POP);
+  if(classCompiler.hasSuperclass) endScope(parser);
+  parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void variable(bool canAssign) {
-  namedVariable(parser.prev, canAssign);
+static void funDeclaration(Parser *parser) {
+  uint8_t global = parseVariable(parser, "Expect function name.");
+  // initialized right away so the body can call itself
+  markInit(parser);
+  function(parser, TYPE_FUNCTION);
+  defineVariable(parser, global);
 }
 
-static void decleration() {
-  if(match(TOKEN_VAR)) {
-    varDecleration();
+static void decleration(Parser *parser) {
+  if(match(parser, TOKEN_CLASS)) {
+    classDeclaration(parser);
+  } else if(match(parser, TOKEN_FUN)) {
+    funDeclaration(parser);
+  } else if(match(parser, TOKEN_VAR)) {
+    varDecleration(parser);
   } else {
-    statement();
+    statement(parser);
   }
-  if(parser.panicMode) sync();
+  if(parser->panicMode) synchronize(parser);
+}
+
+static void initParser(Parser *parser, VM *vm, char *source) {
+  parser->compiler = NULL;
+  parser->currentClass = NULL;
+  parser->lastCall = -1;
+  parser->vm = vm;
+	initScanner(&parser->scanner, source);
+	parser->panicMode = false;
+	parser->hadError = false;
 }
 
-bool compile(Chunk *chunk, char *source) {
+bool compile(VM *vm, Chunk *chunk, char *source) {
+  Parser p;
+  Parser *parser = &p;
+  initParser(parser, vm, source);
   Compiler compiler;
-  initCompiler(&compiler);
-	initScanner(source);
-  compillingChunk = chunk;
-	parser.panicMode = false;
-	parser.hadError = false;
-	advance();
-  while(!match(TOKEN_EOF)) {
-    decleration();
+  initCompiler(parser, &compiler, TYPE_SCRIPT);
+  compiler.chunk = chunk;
+	advance(parser);
+  while(!match(parser, TOKEN_EOF)) {
+    decleration(parser);
   }
-	endCompiler();
-	return !parser.hadError;	
+	endCompiler(parser);
+	return !parser->hadError;	
 }
 
+// top-level code only talks to later statements through globals, so every declaration can
+// be its own little script. nothing runs once an error was reported, parsing goes on for
+// the diagnostics unless sink asked to stop. chunks are heap allocated so fibers can keep
+// pointing at one after sink returns
+bool compileStream(VM *vm, char *source, ChunkSink sink, void *context) {
+  Parser p;
+  Parser *parser = &p;
+  initParser(parser, vm, source);
+  Compiler compiler;
+  initCompiler(parser, &compiler, TYPE_SCRIPT);
+	advance(parser);
+  while(!match(parser, TOKEN_EOF)) {
+    Chunk *chunk = ALLOCATE(Chunk, 1);
+    initChunk(chunk);
+    compiler.chunk = chunk;
+    parser->lastCall = -1;
+    decleration(parser);
+    emitReturn(parser);
+    if(parser->hadError) {
+      freeChunk(chunk);
+      FREE(Chunk, chunk);
+    } else if(!sink(vm, chunk, context)) {
+      break;
+    }
+  }
+  Chunk tail;
+  initChunk(&tail);
+  compiler.chunk = &tail;
+	endCompiler(parser);
+  freeChunk(&tail);
+	return !parser->hadError;
+}
+
+typedef struct {
+  int count;
+  int next;
+  pthread_mutex_t lock;
+  char **sources;
+  Chunk *chunks;
+  bool *results;
+} BatchQueue;
+
+typedef struct {
+  BatchQueue *queue;
+  VM scratch;
+} BatchWorker;
+
+static void *batchWorker(void *arg) {
+  BatchWorker *worker = (BatchWorker *)arg;
+  BatchQueue *queue = worker->queue;
+  while(1) {
+    pthread_mutex_lock(&queue->lock);
+    int i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if(i >= queue->count) break;
+    initChunk(&queue->chunks[i]);
+    queue->results[i] = compile(&worker->scratch, &queue->chunks[i], queue->sources[i]);
+  }
+  return NULL;
+}
+
+// swap the worker-interned strings for ones owned by vm, functions move over with their chunks
+static void adoptChunk(VM *vm, Chunk *chunk) {
+  for(int i=0;i<chunk->varr.count;i++) {
+    Value constant = chunk->varr.values[i];
+    if(IS_STRING(constant)) {
+      ObjString *string = AS_STRING(constant);
+      chunk->varr.values[i] = OBJ_VAL(copyString(vm, string->chars, string->length));
+    } else if(IS_FUNCTION(constant)) {
+      ObjFunction *scratch = AS_FUNCTION(constant);
+      ObjFunction *function = newFunction(vm);
+      function->arity = scratch->arity;
+      function->upvalueCount = scratch->upvalueCount;
+      function->upvalues = scratch->upvalues;
+      function->usesEnclosing = scratch->usesEnclosing;
+      scratch->upvalues = NULL;
+      scratch->upvalueCount = 0;
+      function->name = copyString(vm, scratch->name->chars, scratch->name->length);
+      function->chunk = scratch->chunk;
+      initChunk(&scratch->chunk);
+      adoptChunk(vm, &function->chunk);
+      chunk->varr.values[i] = OBJ_VAL(function);
+    }
+  }
+}
+
+bool compileBatch(VM *vm, int count, char **sources, Chunk *chunks, bool *results, int threads) {
+  if(threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads > count) threads = count;
+  if(threads < 1) threads = 1;
+  BatchQueue queue;
+  queue.count = count;
+  queue.next = 0;
+  queue.sources = sources;
+  queue.chunks = chunks;
+  queue.results = results;
+  pthread_mutex_init(&queue.lock, NULL);
+  BatchWorker *workers = ALLOCATE(BatchWorker, threads);
+  pthread_t *tids = ALLOCATE(pthread_t, threads);
+  for(int i=0;i<threads;i++) {
+    workers[i].queue = &queue;
+    initVM(&workers[i].scratch);
+    pthread_create(&tids[i], NULL, batchWorker, &workers[i]);
+  }
+  for(int i=0;i<threads;i++) {
+    pthread_join(tids[i], NULL);
+  }
+  bool ok = true;
+  for(int i=0;i<count;i++) {
+    adoptChunk(vm, &chunks[i]);
+    if(!results[i]) ok = false;
+  }
+  for(int i=0;i<threads;i++) {
+    freeVM(&workers[i].scratch);
+  }
+  FREE_ARRAY(pthread_t, tids, threads);
+  FREE_ARRAY(BatchWorker, workers, threads);
+  pthread_mutex_destroy(&queue.lock);
+  return ok;
+}
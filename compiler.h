@@ -4,6 +4,13 @@
 #include "chunk.h"
 #include <stdbool.h>
 
-bool compile(Chunk *chunk, char *source);
+bool compile(VM *vm, Chunk *chunk, char *source);
+// hands each top-level declaration to sink as soon as it's compiled, sink owns the allocated
+// chunk from then on. stops at the first sink that returns false
+typedef bool (*ChunkSink)(VM *vm, Chunk *chunk, void *context);
+bool compileStream(VM *vm, char *source, ChunkSink sink, void *context);
+// compiles every source on up to `threads` workers (0 = one per core), each
+// interning into its own table; strings are merged into vm->strings afterwards.
+bool compileBatch(VM *vm, int count, char **sources, Chunk *chunks, bool *results, int threads);
 
 #endif
@@ -1,5 +1,63 @@
 #include "debug.h"
 
+static char *opcodeNames[] = {
+	[OP_CONSTANT] = "OP_CONSTANT",
+	[OP_NEGATE] = "OP_NEGATE",
+	[OP_ADD] = "OP_ADD",
+	[OP_SUBTRACT] = "OP_SUBTRACT",
+	[OP_MULTIPLY] = "OP_MULTIPLY",
+	[OP_DIVIDE] = "OP_DIVIDE",
+	[OP_NIL] = "OP_NIL",
+	[OP_TRUE] = "OP_TRUE",
+	[OP_FALSE] = "OP_FALSE",
+	[OP_NOT] = "OP_NOT",
+	[OP_GREATER] = "OP_GREATER",
+	[OP_EQUAL] = "OP_EQUAL",
+	[OP_LESS] = "OP_LESS",
+	[OP_PRINT] = "OP_PRINT",
+	[OP_POP] = "OP_POP",
+	[OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+	[OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+	[OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+	[OP_GET_LOCAL] = "OP_GET_LOCAL",
+	[OP_SET_LOCAL] = "OP_SET_LOCAL",
+	[OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+	[OP_JUMP] = "OP_JUMP",
+	[OP_LOOP] = "OP_LOOP",
+	[OP_IMPORT] = "OP_IMPORT",
+	[OP_SPAWN] = "OP_SPAWN",
+	[OP_YIELD] = "OP_YIELD",
+	[OP_RESUME] = "OP_RESUME",
+	[OP_END_FIBER] = "OP_END_FIBER",
+	[OP_CALL] = "OP_CALL",
+	[OP_TAIL_CALL] = "OP_TAIL_CALL",
+	[OP_CLOSURE] = "OP_CLOSURE",
+	[OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+	[OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+	[OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+	[OP_GET_ENCLOSING] = "OP_GET_ENCLOSING",
+	[OP_SET_ENCLOSING] = "OP_SET_ENCLOSING",
+	[OP_CLASS] = "OP_CLASS",
+	[OP_INHERIT] = "OP_INHERIT",
+	[OP_METHOD] = "OP_METHOD",
+	[OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+	[OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+	[OP_INVOKE] = "OP_INVOKE",
+	[OP_GET_SUPER] = "OP_GET_SUPER",
+	[OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+	[OP_BUILD_LIST] = "OP_BUILD_LIST",
+	[OP_BUILD_MAP] = "OP_BUILD_MAP",
+	[OP_GET_INDEX] = "OP_GET_INDEX",
+	[OP_SET_INDEX] = "OP_SET_INDEX",
+	[OP_FOR_ITER] = "OP_FOR_ITER",
+	[OP_RETURN] = "OP_RETURN",
+};
+
+char *opcodeName(uint8_t opcode) {
+	if(opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[opcode] == NULL) return "OP_UNKNOWN";
+	return opcodeNames[opcode];
+}
+
 static int simpleInstruction(char *name, int offset) {
 	printf("%s\n", name);
 	return offset+1;
@@ -6,5 +6,6 @@
 
 void disassembleChunk(Chunk *, char *);
 int disassembleInstruction(Chunk *, int);
+char *opcodeName(uint8_t opcode);
 
 #endif
@@ -0,0 +1,290 @@
+#include "dtoa.h"
+#include <math.h>
+#include <string.h>
+
+// grisu2 (loitsch, "printing floating-point numbers quickly and accurately with
+// integers") in the shape of milo yip's and nlohmann's versions. the digits always
+// read back to the same double; they are the shortest such digits for all but a
+// tiny fraction of inputs, where one extra digit can appear
+
+typedef struct {
+	uint64_t f;
+	int e;
+} DiyFp;
+
+typedef struct {
+	uint64_t f;
+	int e;
+	int k;
+} CachedPower;
+
+// 10^k as a normalized DiyFp for k = -348, -340, ..., 340
+static const CachedPower cachedPowers[] = {
+	{0xfa8fd5a0081c0288, -1220, -348},
+	{0xbaaee17fa23ebf76, -1193, -340},
+	{0x8b16fb203055ac76, -1166, -332},
+	{0xcf42894a5dce35ea, -1140, -324},
+	{0x9a6bb0aa55653b2d, -1113, -316},
+	{0xe61acf033d1a45df, -1087, -308},
+	{0xab70fe17c79ac6ca, -1060, -300},
+	{0xff77b1fcbebcdc4f, -1034, -292},
+	{0xbe5691ef416bd60c, -1007, -284},
+	{0x8dd01fad907ffc3c, -980, -276},
+	{0xd3515c2831559a83, -954, -268},
+	{0x9d71ac8fada6c9b5, -927, -260},
+	{0xea9c227723ee8bcb, -901, -252},
+	{0xaecc49914078536d, -874, -244},
+	{0x823c12795db6ce57, -847, -236},
+	{0xc21094364dfb5637, -821, -228},
+	{0x9096ea6f3848984f, -794, -220},
+	{0xd77485cb25823ac7, -768, -212},
+	{0xa086cfcd97bf97f4, -741, -204},
+	{0xef340a98172aace5, -715, -196},
+	{0xb23867fb2a35b28e, -688, -188},
+	{0x84c8d4dfd2c63f3b, -661, -180},
+	{0xc5dd44271ad3cdba, -635, -172},
+	{0x936b9fcebb25c996, -608, -164},
+	{0xdbac6c247d62a584, -582, -156},
+	{0xa3ab66580d5fdaf6, -555, -148},
+	{0xf3e2f893dec3f126, -529, -140},
+	{0xb5b5ada8aaff80b8, -502, -132},
+	{0x87625f056c7c4a8b, -475, -124},
+	{0xc9bcff6034c13053, -449, -116},
+	{0x964e858c91ba2655, -422, -108},
+	{0xdff9772470297ebd, -396, -100},
+	{0xa6dfbd9fb8e5b88f, -369, -92},
+	{0xf8a95fcf88747d94, -343, -84},
+	{0xb94470938fa89bcf, -316, -76},
+	{0x8a08f0f8bf0f156b, -289, -68},
+	{0xcdb02555653131b6, -263, -60},
+	{0x993fe2c6d07b7fac, -236, -52},
+	{0xe45c10c42a2b3b06, -210, -44},
+	{0xaa242499697392d3, -183, -36},
+	{0xfd87b5f28300ca0e, -157, -28},
+	{0xbce5086492111aeb, -130, -20},
+	{0x8cbccc096f5088cc, -103, -12},
+	{0xd1b71758e219652c, -77, -4},
+	{0x9c40000000000000, -50, 4},
+	{0xe8d4a51000000000, -24, 12},
+	{0xad78ebc5ac620000, 3, 20},
+	{0x813f3978f8940984, 30, 28},
+	{0xc097ce7bc90715b3, 56, 36},
+	{0x8f7e32ce7bea5c70, 83, 44},
+	{0xd5d238a4abe98068, 109, 52},
+	{0x9f4f2726179a2245, 136, 60},
+	{0xed63a231d4c4fb27, 162, 68},
+	{0xb0de65388cc8ada8, 189, 76},
+	{0x83c7088e1aab65db, 216, 84},
+	{0xc45d1df942711d9a, 242, 92},
+	{0x924d692ca61be758, 269, 100},
+	{0xda01ee641a708dea, 295, 108},
+	{0xa26da3999aef774a, 322, 116},
+	{0xf209787bb47d6b85, 348, 124},
+	{0xb454e4a179dd1877, 375, 132},
+	{0x865b86925b9bc5c2, 402, 140},
+	{0xc83553c5c8965d3d, 428, 148},
+	{0x952ab45cfa97a0b3, 455, 156},
+	{0xde469fbd99a05fe3, 481, 164},
+	{0xa59bc234db398c25, 508, 172},
+	{0xf6c69a72a3989f5c, 534, 180},
+	{0xb7dcbf5354e9bece, 561, 188},
+	{0x88fcf317f22241e2, 588, 196},
+	{0xcc20ce9bd35c78a5, 614, 204},
+	{0x98165af37b2153df, 641, 212},
+	{0xe2a0b5dc971f303a, 667, 220},
+	{0xa8d9d1535ce3b396, 694, 228},
+	{0xfb9b7cd9a4a7443c, 720, 236},
+	{0xbb764c4ca7a44410, 747, 244},
+	{0x8bab8eefb6409c1a, 774, 252},
+	{0xd01fef10a657842c, 800, 260},
+	{0x9b10a4e5e9913129, 827, 268},
+	{0xe7109bfba19c0c9d, 853, 276},
+	{0xac2820d9623bf429, 880, 284},
+	{0x80444b5e7aa7cf85, 907, 292},
+	{0xbf21e44003acdd2d, 933, 300},
+	{0x8e679c2f5e44ff8f, 960, 308},
+	{0xd433179d9c8cb841, 986, 316},
+	{0x9e19db92b4e31ba9, 1013, 324},
+	{0xeb96bf6ebadf77d9, 1039, 332},
+	{0xaf87023b9bf0ee6b, 1066, 340},
+};
+
+#define CACHED_POWERS_MIN_K -348
+#define CACHED_POWERS_STEP 8
+#define ALPHA -60
+#define GAMMA -32
+
+static DiyFp normalize(DiyFp x) {
+	int shift = __builtin_clzll(x.f);
+	return (DiyFp){x.f << shift, x.e - shift};
+}
+
+// upper half of the 128 bit product, rounded
+static DiyFp multiply(DiyFp x, DiyFp y) {
+	unsigned __int128 product = (unsigned __int128)x.f * y.f;
+	uint64_t high = (uint64_t)(product >> 64);
+	uint64_t low = (uint64_t)product;
+	high += low >> 63;
+	return (DiyFp){high, x.e + y.e + 64};
+}
+
+// a cached power whose product with a DiyFp of binary exponent e lands in [ALPHA, GAMMA]
+static CachedPower cachedPowerFor(int e) {
+	int f = ALPHA - e - 1;
+	int k = (f * 78913) / (1 << 18) + (f > 0);
+	int index = (-CACHED_POWERS_MIN_K + k + (CACHED_POWERS_STEP - 1)) / CACHED_POWERS_STEP;
+	return cachedPowers[index];
+}
+
+static int largestPow10(uint32_t n, uint32_t *pow10) {
+	static const uint32_t powers[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+	int digits = 10;
+	while(digits > 1 && n < powers[digits - 1]) digits--;
+	*pow10 = powers[digits - 1];
+	return digits;
+}
+
+// walks the last digit down while that moves closer to the exact value and stays inside the boundaries
+static void roundDigit(char *buffer, int length, uint64_t distance, uint64_t delta, uint64_t rest, uint64_t tenK) {
+	while(rest < distance && delta - rest >= tenK &&
+			(rest + tenK < distance || distance - rest > rest + tenK - distance)) {
+		buffer[length - 1]--;
+		rest += tenK;
+	}
+}
+
+static int generateDigits(char *buffer, int *exponent, DiyFp low, DiyFp w, DiyFp high) {
+	uint64_t delta = high.f - low.f;
+	uint64_t distance = high.f - w.f;
+	DiyFp one = {(uint64_t)1 << -high.e, high.e};
+	uint32_t integral = (uint32_t)(high.f >> -one.e);
+	uint64_t fraction = high.f & (one.f - 1);
+	int length = 0;
+	uint32_t pow10;
+	int n = largestPow10(integral, &pow10);
+	while(n > 0) {
+		uint32_t digit = integral / pow10;
+		integral %= pow10;
+		buffer[length++] = (char)('0' + digit);
+		n--;
+		uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+		if(rest <= delta) {
+			*exponent += n;
+			roundDigit(buffer, length, distance, delta, rest, (uint64_t)pow10 << -one.e);
+			return length;
+		}
+		pow10 /= 10;
+	}
+	int m = 0;
+	while(1) {
+		fraction *= 10;
+		buffer[length++] = (char)('0' + (fraction >> -one.e));
+		fraction &= one.f - 1;
+		m++;
+		delta *= 10;
+		distance *= 10;
+		if(fraction <= delta) break;
+	}
+	*exponent -= m;
+	roundDigit(buffer, length, distance, delta, fraction, one.f);
+	return length;
+}
+
+// digits of a positive finite value, it equals digits * 10^exponent
+static int grisu2(double value, char *buffer, int *exponent) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint64_t biased = (bits >> 52) & 0x7ff;
+	uint64_t significand = bits & (((uint64_t)1 << 52) - 1);
+	DiyFp v = biased == 0 ? (DiyFp){significand, 1 - 1075} : (DiyFp){significand | ((uint64_t)1 << 52), (int)biased - 1075};
+	// the gap below a power of two is half the gap above it
+	bool lowerCloser = significand == 0 && biased > 1;
+	DiyFp plus = normalize((DiyFp){2 * v.f + 1, v.e - 1});
+	DiyFp minus = lowerCloser ? (DiyFp){4 * v.f - 1, v.e - 2} : (DiyFp){2 * v.f - 1, v.e - 1};
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+	v = normalize(v);
+
+	CachedPower cached = cachedPowerFor(plus.e);
+	DiyFp power = {cached.f, cached.e};
+	DiyFp w = multiply(v, power);
+	DiyFp low = multiply(minus, power);
+	DiyFp high = multiply(plus, power);
+	// shrink the interval by one ulp on each side to cover the rounding of the products
+	low.f++;
+	high.f--;
+	*exponent = -cached.k;
+	return generateDigits(buffer, exponent, low, w, high);
+}
+
+static int writeDigits(char *out, uint64_t n) {
+	char digits[20];
+	int length = 0;
+	do {
+		digits[length++] = (char)('0' + n % 10);
+		n /= 10;
+	} while(n > 0);
+	for(int i=0;i<length;i++) out[i] = digits[length - 1 - i];
+	return length;
+}
+
+// plain notation while the decimal point sits within 21 digits, like javascript
+static int layout(char *out, char *digits, int length, int exponent) {
+	int point = length + exponent;
+	char *start = out;
+	if(exponent >= 0 && point <= 21) {
+		memcpy(out, digits, length);
+		out += length;
+		memset(out, '0', exponent);
+		out += exponent;
+	} else if(point > 0 && point <= 21) {
+		memcpy(out, digits, point);
+		out += point;
+		*out++ = '.';
+		memcpy(out, digits + point, length - point);
+		out += length - point;
+	} else if(point > -6 && point <= 0) {
+		*out++ = '0';
+		*out++ = '.';
+		memset(out, '0', -point);
+		out += -point;
+		memcpy(out, digits, length);
+		out += length;
+	} else {
+		*out++ = digits[0];
+		if(length > 1) {
+			*out++ = '.';
+			memcpy(out, digits + 1, length - 1);
+			out += length - 1;
+		}
+		*out++ = 'e';
+		int e = point - 1;
+		*out++ = e < 0 ? '-' : '+';
+		out += writeDigits(out, (uint64_t)(e < 0 ? -e : e));
+	}
+	return (int)(out - start);
+}
+
+int formatNumber(double value, char *out) {
+	char *start = out;
+	if(isnan(value)) {
+		memcpy(out, "nan", 3);
+		return 3;
+	}
+	if(signbit(value)) {
+		*out++ = '-';
+		value = -value;
+	}
+	if(isinf(value)) {
+		memcpy(out, "inf", 3);
+		return (int)(out - start) + 3;
+	}
+	// most numbers scripts print are integers, those need no search at all
+	if(value < 9007199254740992.0 && value == (double)(uint64_t)value) {
+		return (int)(out - start) + writeDigits(out, (uint64_t)value);
+	}
+	char digits[18];
+	int exponent;
+	int length = grisu2(value, digits, &exponent);
+	return (int)(out - start) + layout(out, digits, length, exponent);
+}
@@ -0,0 +1,12 @@
+#ifndef DTOA_H
+#define DTOA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// longest output is a sign, 17 digits, a point and an exponent
+#define NUMBER_MAX_LENGTH 32
+
+int formatNumber(double value, char *out);
+
+#endif
@@ -0,0 +1,521 @@
+#include "f64.h"
+#include "memory.h"
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// every kernel has one canonical evaluation order and all variants follow it, so
+// results are bit for bit the same whichever one the cpu gets:
+//   reductions keep 4 partial lanes over i % 4, combine them as (l0 op l1) op (l2 op l3)
+//   and then fold in the tail one element at a time
+//   min/max lanes use x < m ? x : m (x > m ? x : m), which is what minpd/maxpd compute
+//   products and sums are separate roundings, never fused
+//   prefix sums are a serial dependency and stay scalar everywhere
+
+// which the compiler would otherwise break by contracting a*b+c into an fma
+// wherever the target has one (gcc does by default, -march=haswell is enough)
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+typedef struct {
+	char *name;
+	double (*sum)(double *a, int n);
+	double (*dot)(double *a, double *b, int n);
+	double (*min)(double *a, int n);
+	double (*max)(double *a, int n);
+	void (*scale)(double *out, double *a, double k, int n);
+	void (*axpy)(double alpha, double *x, double *y, int n);
+	void (*add)(double *out, double *a, double *b, int n);
+	void (*mul)(double *out, double *a, double *b, int n);
+} Kernels;
+
+static double minOf(double x, double m) {
+	return x < m ? x : m;
+}
+
+static double maxOf(double x, double m) {
+	return x > m ? x : m;
+}
+
+static double scalarSum(double *a, int n) {
+	double lanes[4] = {0, 0, 0, 0};
+	int i = 0;
+	for(;i+4<=n;i+=4) {
+		for(int j=0;j<4;j++) lanes[j] += a[i+j];
+	}
+	double total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for(;i<n;i++) total += a[i];
+	return total;
+}
+
+static double scalarDot(double *a, double *b, int n) {
+	double lanes[4] = {0, 0, 0, 0};
+	int i = 0;
+	for(;i+4<=n;i+=4) {
+		for(int j=0;j<4;j++) {
+			double product = a[i+j] * b[i+j];
+			lanes[j] += product;
+		}
+	}
+	double total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for(;i<n;i++) {
+		double product = a[i] * b[i];
+		total += product;
+	}
+	return total;
+}
+
+// n > 0, lanes start on the first four elements
+static double scalarMin(double *a, int n) {
+	if(n < 4) {
+		double m = a[0];
+		for(int i=1;i<n;i++) m = minOf(a[i], m);
+		return m;
+	}
+	double lanes[4] = {a[0], a[1], a[2], a[3]};
+	int i = 4;
+	for(;i+4<=n;i+=4) {
+		for(int j=0;j<4;j++) lanes[j] = minOf(a[i+j], lanes[j]);
+	}
+	double m = minOf(minOf(lanes[0], lanes[1]), minOf(lanes[2], lanes[3]));
+	for(;i<n;i++) m = minOf(a[i], m);
+	return m;
+}
+
+static double scalarMax(double *a, int n) {
+	if(n < 4) {
+		double m = a[0];
+		for(int i=1;i<n;i++) m = maxOf(a[i], m);
+		return m;
+	}
+	double lanes[4] = {a[0], a[1], a[2], a[3]};
+	int i = 4;
+	for(;i+4<=n;i+=4) {
+		for(int j=0;j<4;j++) lanes[j] = maxOf(a[i+j], lanes[j]);
+	}
+	double m = maxOf(maxOf(lanes[0], lanes[1]), maxOf(lanes[2], lanes[3]));
+	for(;i<n;i++) m = maxOf(a[i], m);
+	return m;
+}
+
+static void scalarScale(double *out, double *a, double k, int n) {
+	for(int i=0;i<n;i++) out[i] = a[i] * k;
+}
+
+static void scalarAxpy(double alpha, double *x, double *y, int n) {
+	for(int i=0;i<n;i++) {
+		double product = alpha * x[i];
+		y[i] += product;
+	}
+}
+
+static void scalarAdd(double *out, double *a, double *b, int n) {
+	for(int i=0;i<n;i++) out[i] = a[i] + b[i];
+}
+
+static void scalarMul(double *out, double *a, double *b, int n) {
+	for(int i=0;i<n;i++) out[i] = a[i] * b[i];
+}
+
+static Kernels scalarKernels = {
+	"scalar", scalarSum, scalarDot, scalarMin, scalarMax, scalarScale, scalarAxpy, scalarAdd, scalarMul,
+};
+
+#ifdef HAVE_X86
+
+// sse2 is part of x86-64, two registers stand in for the four lanes
+static double sse2Sum(double *a, int n) {
+	__m128d lo = _mm_setzero_pd();
+	__m128d hi = _mm_setzero_pd();
+	int i = 0;
+	for(;i+4<=n;i+=4) {
+		lo = _mm_add_pd(lo, _mm_loadu_pd(a + i));
+		hi = _mm_add_pd(hi, _mm_loadu_pd(a + i + 2));
+	}
+	double lanes[4];
+	_mm_storeu_pd(lanes, lo);
+	_mm_storeu_pd(lanes + 2, hi);
+	double total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for(;i<n;i++) total += a[i];
+	return total;
+}
+
+static double sse2Dot(double *a, double *b, int n) {
+	__m128d lo = _mm_setzero_pd();
+	__m128d hi = _mm_setzero_pd();
+	int i = 0;
+	for(;i+4<=n;i+=4) {
+		lo = _mm_add_pd(lo, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+		hi = _mm_add_pd(hi, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+	}
+	double lanes[4];
+	_mm_storeu_pd(lanes, lo);
+	_mm_storeu_pd(lanes + 2, hi);
+	double total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for(;i<n;i++) {
+		double product = a[i] * b[i];
+		total += product;
+	}
+	return total;
+}
+
+static double sse2Min(double *a, int n) {
+	if(n < 4) return scalarMin(a, n);
+	__m128d lo = _mm_loadu_pd(a);
+	__m128d hi = _mm_loadu_pd(a + 2);
+	int i = 4;
+	for(;i+4<=n;i+=4) {
+		lo = _mm_min_pd(_mm_loadu_pd(a + i), lo);
+		hi = _mm_min_pd(_mm_loadu_pd(a + i + 2), hi);
+	}
+	double lanes[4];
+	_mm_storeu_pd(lanes, lo);
+	_mm_storeu_pd(lanes + 2, hi);
+	double m = minOf(minOf(lanes[0], lanes[1]), minOf(lanes[2], lanes[3]));
+	for(;i<n;i++) m = minOf(a[i], m);
+	return m;
+}
+
+static double sse2Max(double *a, int n) {
+	if(n < 4) return scalarMax(a, n);
+	__m128d lo = _mm_loadu_pd(a);
+	__m128d hi = _mm_loadu_pd(a + 2);
+	int i = 4;
+	for(;i+4<=n;i+=4) {
+		lo = _mm_max_pd(_mm_loadu_pd(a + i), lo);
+		hi = _mm_max_pd(_mm_loadu_pd(a + i + 2), hi);
+	}
+	double lanes[4];
+	_mm_storeu_pd(lanes, lo);
+	_mm_storeu_pd(lanes + 2, hi);
+	double m = maxOf(maxOf(lanes[0], lanes[1]), maxOf(lanes[2], lanes[3]));
+	for(;i<n;i++) m = maxOf(a[i], m);
+	return m;
+}
+
+static void sse2Scale(double *out, double *a, double k, int n) {
+	__m128d factor = _mm_set1_pd(k);
+	int i = 0;
+	for(;i+2<=n;i+=2) _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+	for(;i<n;i++) out[i] = a[i] * k;
+}
+
+static void sse2Axpy(double alpha, double *x, double *y, int n) {
+	__m128d factor = _mm_set1_pd(alpha);
+	int i = 0;
+	for(;i+2<=n;i+=2) {
+		__m128d product = _mm_mul_pd(factor, _mm_loadu_pd(x + i));
+		_mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), product));
+	}
+	for(;i<n;i++) {
+		double product = alpha * x[i];
+		y[i] += product;
+	}
+}
+
+static void sse2Add(double *out, double *a, double *b, int n) {
+	int i = 0;
+	for(;i+2<=n;i+=2) _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	for(;i<n;i++) out[i] = a[i] + b[i];
+}
+
+static void sse2Mul(double *out, double *a, double *b, int n) {
+	int i = 0;
+	for(;i+2<=n;i+=2) _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	for(;i<n;i++) out[i] = a[i] * b[i];
+}
+
+static Kernels sse2Kernels = {
+	"sse2", sse2Sum, sse2Dot, sse2Min, sse2Max, sse2Scale, sse2Axpy, sse2Add, sse2Mul,
+};
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double avx2Sum(double *a, int n) {
+	__m256d acc = _mm256_setzero_pd();
+	int i = 0;
+	for(;i+4<=n;i+=4) acc = _mm256_add_pd(acc, _mm256_loadu_pd(a + i));
+	double lanes[4];
+	_mm256_storeu_pd(lanes, acc);
+	double total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for(;i<n;i++) total += a[i];
+	return total;
+}
+
+AVX2 static double avx2Dot(double *a, double *b, int n) {
+	__m256d acc = _mm256_setzero_pd();
+	int i = 0;
+	for(;i+4<=n;i+=4) {
+		acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, acc);
+	double total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for(;i<n;i++) {
+		double product = a[i] * b[i];
+		total += product;
+	}
+	return total;
+}
+
+AVX2 static double avx2Min(double *a, int n) {
+	if(n < 4) return scalarMin(a, n);
+	__m256d acc = _mm256_loadu_pd(a);
+	int i = 4;
+	for(;i+4<=n;i+=4) acc = _mm256_min_pd(_mm256_loadu_pd(a + i), acc);
+	double lanes[4];
+	_mm256_storeu_pd(lanes, acc);
+	double m = minOf(minOf(lanes[0], lanes[1]), minOf(lanes[2], lanes[3]));
+	for(;i<n;i++) m = minOf(a[i], m);
+	return m;
+}
+
+AVX2 static double avx2Max(double *a, int n) {
+	if(n < 4) return scalarMax(a, n);
+	__m256d acc = _mm256_loadu_pd(a);
+	int i = 4;
+	for(;i+4<=n;i+=4) acc = _mm256_max_pd(_mm256_loadu_pd(a + i), acc);
+	double lanes[4];
+	_mm256_storeu_pd(lanes, acc);
+	double m = maxOf(maxOf(lanes[0], lanes[1]), maxOf(lanes[2], lanes[3]));
+	for(;i<n;i++) m = maxOf(a[i], m);
+	return m;
+}
+
+AVX2 static void avx2Scale(double *out, double *a, double k, int n) {
+	__m256d factor = _mm256_set1_pd(k);
+	int i = 0;
+	for(;i+4<=n;i+=4) _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+	for(;i<n;i++) out[i] = a[i] * k;
+}
+
+AVX2 static void avx2Axpy(double alpha, double *x, double *y, int n) {
+	__m256d factor = _mm256_set1_pd(alpha);
+	int i = 0;
+	for(;i+4<=n;i+=4) {
+		__m256d product = _mm256_mul_pd(factor, _mm256_loadu_pd(x + i));
+		_mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), product));
+	}
+	for(;i<n;i++) {
+		double product = alpha * x[i];
+		y[i] += product;
+	}
+}
+
+AVX2 static void avx2Add(double *out, double *a, double *b, int n) {
+	int i = 0;
+	for(;i+4<=n;i+=4) _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+	for(;i<n;i++) out[i] = a[i] + b[i];
+}
+
+AVX2 static void avx2Mul(double *out, double *a, double *b, int n) {
+	int i = 0;
+	for(;i+4<=n;i+=4) _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+	for(;i<n;i++) out[i] = a[i] * b[i];
+}
+
+static Kernels avx2Kernels = {
+	"avx2", avx2Sum, avx2Dot, avx2Min, avx2Max, avx2Scale, avx2Axpy, avx2Add, avx2Mul,
+};
+
+#endif
+
+static Kernels *kernels = NULL;
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+
+// the best the cpu has, CLOX_SIMD=scalar|sse2|avx2 can only ask for less.
+// every initVM defines the natives, only the first one picks
+static void selectKernels() {
+	char *forced = getenv("CLOX_SIMD");
+	if(forced != NULL && !strcmp(forced, "scalar")) {
+		kernels = &scalarKernels;
+		return;
+	}
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	bool avx2 = __builtin_cpu_supports("avx2");
+	if(forced != NULL && !strcmp(forced, "sse2")) avx2 = false;
+	kernels = avx2 ? &avx2Kernels : &sse2Kernels;
+#else
+	kernels = &scalarKernels;
+#endif
+}
+
+ObjF64Array *newF64Array(VM *vm, int count) {
+	double *values = ALLOCATE(double, (size_t)count);
+	if(count > 0) memset(values, 0, sizeof(double) * count);
+	ObjF64Array *array = ALLOCATE_OBJ(vm, ObjF64Array, OBJ_F64_ARRAY);
+	array->values = values;
+	array->count = count;
+	return array;
+}
+
+static bool arrayArg(VM *vm, char *name, Value value, ObjF64Array **out) {
+	if(!IS_F64_ARRAY(value)) {
+		runtimeError(vm, "%s() expects a float64 array.", name);
+		return false;
+	}
+	*out = AS_F64_ARRAY(value);
+	return true;
+}
+
+static bool sameLength(VM *vm, char *name, ObjF64Array *a, ObjF64Array *b) {
+	if(a->count != b->count) {
+		runtimeError(vm, "%s() expects arrays of the same length, got %d and %d.", name, a->count, b->count);
+		return false;
+	}
+	return true;
+}
+
+static bool numberArg(VM *vm, char *name, Value value, double *out) {
+	if(!IS_NUMBER(value)) {
+		runtimeError(vm, "%s() expects a number.", name);
+		return false;
+	}
+	*out = AS_NUMBER(value);
+	return true;
+}
+
+// float64(n) is n zeros, float64(list) copies a list of numbers
+static NativeResult f64New(VM *vm, int argCount, Value *args, Value *result) {
+	if(IS_NUMBER(args[0])) {
+		double count = AS_NUMBER(args[0]);
+		// range first, casting a double int can't hold (or NaN) is undefined
+		if(!(count >= 0 && count <= INT_MAX) || count != (int)count) {
+			runtimeError(vm, "float64() expects a non-negative integer length.");
+			return NATIVE_ERROR;
+		}
+		*result = OBJ_VAL(newF64Array(vm, (int)count));
+		return NATIVE_OK;
+	}
+	if(!IS_LIST(args[0])) {
+		runtimeError(vm, "float64() expects a length or a list of numbers.");
+		return NATIVE_ERROR;
+	}
+	ValueArray *items = &AS_LIST(args[0])->items;
+	ObjF64Array *array = newF64Array(vm, items->count);
+	for(int i=0;i<items->count;i++) {
+		if(!IS_NUMBER(items->values[i])) {
+			runtimeError(vm, "float64() expects a list of numbers.");
+			return NATIVE_ERROR;
+		}
+		array->values[i] = AS_NUMBER(items->values[i]);
+	}
+	*result = OBJ_VAL(array);
+	return NATIVE_OK;
+}
+
+static NativeResult f64Sum(VM *vm, int argCount, Value *args, Value *result) {
+	ObjF64Array *a;
+	if(!arrayArg(vm, "sum", args[0], &a)) return NATIVE_ERROR;
+	*result = NUMBER_VAL(kernels->sum(a->values, a->count));
+	return NATIVE_OK;
+}
+
+static NativeResult f64Dot(VM *vm, int argCount, Value *args, Value *result) {
+	ObjF64Array *a, *b;
+	if(!arrayArg(vm, "dot", args[0], &a) ||
+			!arrayArg(vm, "dot", args[1], &b) || !sameLength(vm, "dot", a, b)) return NATIVE_ERROR;
+	*result = NUMBER_VAL(kernels->dot(a->values, b->values, a->count));
+	return NATIVE_OK;
+}
+
+// nil for an empty array
+static NativeResult f64Min(VM *vm, int argCount, Value *args, Value *result) {
+	ObjF64Array *a;
+	if(!arrayArg(vm, "min", args[0], &a)) return NATIVE_ERROR;
+	*result = a->count > 0 ? NUMBER_VAL(kernels->min(a->values, a->count)) : NIL_VAL;
+	return NATIVE_OK;
+}
+
+static NativeResult f64Max(VM *vm, int argCount, Value *args, Value *result) {
+	ObjF64Array *a;
+	if(!arrayArg(vm, "max", args[0], &a)) return NATIVE_ERROR;
+	*result = a->count > 0 ? NUMBER_VAL(kernels->max(a->values, a->count)) : NIL_VAL;
+	return NATIVE_OK;
+}
+
+static NativeResult f64Scale(VM *vm, int argCount, Value *args, Value *result) {
+	ObjF64Array *a;
+	double k;
+	if(!arrayArg(vm, "scale", args[0], &a) ||
+			!numberArg(vm, "scale", args[1], &k)) return NATIVE_ERROR;
+	ObjF64Array *out = newF64Array(vm, a->count);
+	kernels->scale(out->values, a->values, k, a->count);
+	*result = OBJ_VAL(out);
+	return NATIVE_OK;
+}
+
+// y = alpha * x + y in place, like blas, and returns y
+static NativeResult f64Axpy(VM *vm, int argCount, Value *args, Value *result) {
+	double alpha;
+	ObjF64Array *x, *y;
+	if(!numberArg(vm, "axpy", args[0], &alpha) ||
+			!arrayArg(vm, "axpy", args[1], &x) || !arrayArg(vm, "axpy", args[2], &y) ||
+			!sameLength(vm, "axpy", x, y)) return NATIVE_ERROR;
+	kernels->axpy(alpha, x->values, y->values, x->count);
+	*result = args[2];
+	return NATIVE_OK;
+}
+
+static NativeResult f64Add(VM *vm, int argCount, Value *args, Value *result) {
+	ObjF64Array *a, *b;
+	if(!arrayArg(vm, "add", args[0], &a) ||
+			!arrayArg(vm, "add", args[1], &b) || !sameLength(vm, "add", a, b)) return NATIVE_ERROR;
+	ObjF64Array *out = newF64Array(vm, a->count);
+	kernels->add(out->values, a->values, b->values, a->count);
+	*result = OBJ_VAL(out);
+	return NATIVE_OK;
+}
+
+static NativeResult f64Mul(VM *vm, int argCount, Value *args, Value *result) {
+	ObjF64Array *a, *b;
+	if(!arrayArg(vm, "mul", args[0], &a) ||
+			!arrayArg(vm, "mul", args[1], &b) || !sameLength(vm, "mul", a, b)) return NATIVE_ERROR;
+	ObjF64Array *out = newF64Array(vm, a->count);
+	kernels->mul(out->values, a->values, b->values, a->count);
+	*result = OBJ_VAL(out);
+	return NATIVE_OK;
+}
+
+static NativeResult f64PrefixSum(VM *vm, int argCount, Value *args, Value *result) {
+	ObjF64Array *a;
+	if(!arrayArg(vm, "prefixSum", args[0], &a)) return NATIVE_ERROR;
+	ObjF64Array *out = newF64Array(vm, a->count);
+	double total = 0;
+	for(int i=0;i<a->count;i++) {
+		total += a->values[i];
+		out->values[i] = total;
+	}
+	*result = OBJ_VAL(out);
+	return NATIVE_OK;
+}
+
+static NativeResult f64Kernels(VM *vm, int argCount, Value *args, Value *result) {
+	*result = OBJ_VAL(copyString(vm, kernels->name, (int)strlen(kernels->name)));
+	return NATIVE_OK;
+}
+
+void defineF64Natives(VM *vm) {
+	pthread_once(&kernelsOnce, selectKernels);
+	defineNative(vm, "float64", f64New, 1);
+	defineNative(vm, "sum", f64Sum, 1);
+	defineNative(vm, "dot", f64Dot, 2);
+	defineNative(vm, "min", f64Min, 1);
+	defineNative(vm, "max", f64Max, 1);
+	defineNative(vm, "scale", f64Scale, 2);
+	defineNative(vm, "axpy", f64Axpy, 3);
+	defineNative(vm, "add", f64Add, 2);
+	defineNative(vm, "mul", f64Mul, 2);
+	defineNative(vm, "prefixSum", f64PrefixSum, 1);
+	defineNative(vm, "simd", f64Kernels, 0);
+}
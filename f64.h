@@ -0,0 +1,9 @@
+#ifndef F64_H
+#define F64_H
+
+#include "vm.h"
+
+ObjF64Array *newF64Array(VM *vm, int count);
+void defineF64Natives(VM *vm);
+
+#endif
@@ -0,0 +1,229 @@
+#include "heapprof.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REPORT_TOP 25
+
+bool allocationProfiling = false;
+
+// a site is one source line of one chunk
+typedef struct {
+	Chunk *chunk;
+	int line;
+	char *function;
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t liveCount; // as of the last census
+	uint64_t liveBytes;
+} Site;
+
+static Site *sites = NULL;
+static int siteCount = 0;
+static int siteCapacity = 0;
+static int32_t *siteIndex = NULL; // open addressing on (chunk, line), -1 is empty
+static int indexSize = 0;
+static uint32_t lastSite = SITE_UNKNOWN; // allocations come in runs from the same line
+static VM *profiledVM = NULL;
+static long censusEvery = 0;
+static long untilCensus = 0;
+static int censusCount = 0;
+static bool finished = false;
+
+static uint32_t hashSite(Chunk *chunk, int line) {
+	uint64_t bits = (uint64_t)(uintptr_t)chunk ^ ((uint64_t)line * 0x9e3779b97f4a7c15ull);
+	bits ^= bits >> 31;
+	bits *= 0xbf58476d1ce4e5b9ull;
+	bits ^= bits >> 32;
+	return (uint32_t)bits;
+}
+
+static uint32_t addSite(Chunk *chunk, int line, char *function) {
+	if(siteCount == siteCapacity) {
+		siteCapacity = siteCapacity < 64 ? 64 : siteCapacity * 2;
+		sites = (Site *)realloc(sites, sizeof(Site) * siteCapacity);
+	}
+	sites[siteCount] = (Site){chunk, line, function, 0, 0, 0, 0};
+	return (uint32_t)siteCount++;
+}
+
+static void growIndex() {
+	int size = indexSize < 128 ? 128 : indexSize * 2;
+	int32_t *index = (int32_t *)malloc(sizeof(int32_t) * size);
+	for(int i=0;i<size;i++) index[i] = -1;
+	for(int s=SITE_COMPILER+1;s<siteCount;s++) {
+		uint32_t i = hashSite(sites[s].chunk, sites[s].line) & (size - 1);
+		while(index[i] != -1) i = (i + 1) & (size - 1);
+		index[i] = s;
+	}
+	free(siteIndex);
+	siteIndex = index;
+	indexSize = size;
+}
+
+static uint32_t findSite(Chunk *chunk, int line, char *function) {
+	if(sites[lastSite].chunk == chunk && sites[lastSite].line == line) return lastSite;
+	if((siteCount + 1) * 2 > indexSize) growIndex();
+	uint32_t mask = indexSize - 1;
+	uint32_t i = hashSite(chunk, line) & mask;
+	while(siteIndex[i] != -1) {
+		Site *site = &sites[siteIndex[i]];
+		if(site->chunk == chunk && site->line == line) return lastSite = siteIndex[i];
+		i = (i + 1) & mask;
+	}
+	siteIndex[i] = (int32_t)addSite(chunk, line, function);
+	return lastSite = siteIndex[i];
+}
+
+// the object and everything it owns outright
+static size_t objectSize(Obj *obj) {
+	switch(obj->type) {
+		case OBJ_STRING: return sizeof(ObjString) + ((ObjString *)obj)->length + 1;
+		case OBJ_MODULE: return sizeof(ObjModule);
+		case OBJ_FIBER: {
+			ObjFiber *fiber = (ObjFiber *)obj;
+			return sizeof(ObjFiber) + sizeof(Value) * fiber->stackCapacity +
+				sizeof(CallFrame) * fiber->frameCapacity;
+		}
+		case OBJ_NATIVE: return sizeof(ObjNative);
+		case OBJ_FUNCTION: return sizeof(ObjFunction);
+		case OBJ_CLOSURE:
+			return sizeof(ObjClosure) + sizeof(ObjUpvalue *) * ((ObjClosure *)obj)->upvalueCount;
+		case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+		case OBJ_SHAPE: return sizeof(ObjShape) + tableBytes(&((ObjShape *)obj)->transitions);
+		case OBJ_CLASS: return sizeof(ObjClass) + tableBytes(&((ObjClass *)obj)->methods);
+		case OBJ_INSTANCE:
+			return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance *)obj)->fieldCapacity;
+		case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+		case OBJ_LIST: return sizeof(ObjList) + sizeof(Value) * ((ObjList *)obj)->items.capacity;
+		case OBJ_MAP: return sizeof(ObjMap) + tableBytes(&((ObjMap *)obj)->table);
+		case OBJ_F64_ARRAY:
+			return sizeof(ObjF64Array) + sizeof(double) * ((ObjF64Array *)obj)->count;
+	}
+	return sizeof(Obj);
+}
+
+// there is no collector, so live is everything still on vm->objects
+static void census(VM *vm, uint64_t *objects, uint64_t *bytes) {
+	*objects = 0;
+	*bytes = 0;
+	for(int i=0;i<siteCount;i++) {
+		sites[i].liveCount = 0;
+		sites[i].liveBytes = 0;
+	}
+	for(Obj *obj = vm->objects; obj != NULL; obj = obj->next) {
+		size_t size = objectSize(obj);
+		sites[obj->site].liveCount++;
+		sites[obj->site].liveBytes += size;
+		(*objects)++;
+		*bytes += size;
+	}
+}
+
+static void printSite(Site *site) {
+	if(site == &sites[SITE_UNKNOWN]) fprintf(stderr, "(before profiling)");
+	else if(site == &sites[SITE_COMPILER]) fprintf(stderr, "(compiler)");
+	else fprintf(stderr, "%s:%d", site->function, site->line);
+}
+
+static int compareLive(const void *a, const void *b) {
+	uint64_t x = sites[*(int *)a].liveBytes, y = sites[*(int *)b].liveBytes;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compareAllocated(const void *a, const void *b) {
+	uint64_t x = sites[*(int *)a].bytes, y = sites[*(int *)b].bytes;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int *sortedSites(int (*compare)(const void *, const void *)) {
+	int *order = (int *)malloc(sizeof(int) * siteCount);
+	for(int i=0;i<siteCount;i++) order[i] = i;
+	qsort(order, siteCount, sizeof(int), compare);
+	return order;
+}
+
+// one line per census: the heap's size and the three sites holding most of it
+static void printCensus(VM *vm) {
+	uint64_t objects, bytes;
+	census(vm, &objects, &bytes);
+	fprintf(stderr, "census %d: %llu objects, %llu bytes live;", ++censusCount,
+		(unsigned long long)objects, (unsigned long long)bytes);
+	int *order = sortedSites(compareLive);
+	for(int i=0;i<3 && i<siteCount && sites[order[i]].liveBytes > 0;i++) {
+		fprintf(stderr, " ");
+		printSite(&sites[order[i]]);
+		fprintf(stderr, " %llu", (unsigned long long)sites[order[i]].liveBytes);
+	}
+	fprintf(stderr, "\n");
+	free(order);
+}
+
+static void printReport(VM *vm) {
+	uint64_t objects, bytes;
+	census(vm, &objects, &bytes);
+	fprintf(stderr, "allocations: %llu objects, %llu bytes live at exit\n",
+		(unsigned long long)objects, (unsigned long long)bytes);
+	fprintf(stderr, "%12s %14s %12s %14s  %s\n", "allocated", "bytes", "live", "live bytes", "site");
+	int *order = sortedSites(compareAllocated);
+	for(int i=0;i<siteCount && i<REPORT_TOP;i++) {
+		Site *site = &sites[order[i]];
+		if(site->count == 0 && site->liveCount == 0) break;
+		fprintf(stderr, "%12llu %14llu %12llu %14llu  ", (unsigned long long)site->count,
+			(unsigned long long)site->bytes, (unsigned long long)site->liveCount,
+			(unsigned long long)site->liveBytes);
+		printSite(site);
+		fprintf(stderr, "\n");
+	}
+	free(order);
+}
+
+// the line being run in the top frame: the profiled loop keeps frame->ip just
+// past the current opcode, or past its operands once the instruction saved it.
+// compileBatch's scratch vms allocate on their own threads and aren't counted
+uint32_t recordAllocation(VM *vm, size_t size) {
+	if(vm != profiledVM) return SITE_UNKNOWN;
+	uint32_t site = SITE_COMPILER;
+	ObjFiber *fiber = vm->fiber;
+	if(fiber != NULL && fiber->frameCount > 0) {
+		CallFrame *frame = &fiber->frames[fiber->frameCount - 1];
+		size_t index = frame->ip > frame->chunk->code ? frame->ip - frame->chunk->code - 1 : 0;
+		char *function = frame->function == NULL ? "script" : frame->function->name->chars;
+		site = findSite(frame->chunk, frame->chunk->lines[index], function);
+	}
+	sites[site].count++;
+	sites[site].bytes += size;
+	if(censusEvery > 0 && --untilCensus == 0) {
+		untilCensus = censusEvery;
+		printCensus(vm);
+	}
+	return site;
+}
+
+// memory an object owns that was allocated before the object itself, a string's chars
+void recordAllocationBytes(Obj *obj, size_t size) {
+	if(obj->site != SITE_UNKNOWN) sites[obj->site].bytes += size;
+}
+
+// the report needs the objects, so it runs from freeVM or, when the run ended
+// in exit(), from the atexit handler while they are all still there
+void finishAllocationProfiler(VM *vm) {
+	if(!allocationProfiling || finished || vm != profiledVM) return;
+	finished = true;
+	printReport(vm);
+	allocationProfiling = false;
+}
+
+static void finishAtExit() {
+	finishAllocationProfiler(profiledVM);
+}
+
+void startAllocationProfiler(VM *vm, long every) {
+	addSite(NULL, 0, NULL);
+	addSite(NULL, 0, NULL);
+	profiledVM = vm;
+	censusEvery = every;
+	untilCensus = every;
+	allocationProfiling = true;
+	atexit(finishAtExit);
+}
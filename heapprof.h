@@ -0,0 +1,20 @@
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "vm.h"
+
+#define SITE_UNKNOWN 0  // allocated before profiling started
+#define SITE_COMPILER 1 // no frame was running, the compiler's constants and names
+
+// with --allocs every object records the function and line that allocated it in
+// obj->site, which sits in padding the header already had
+extern bool allocationProfiling;
+
+void startAllocationProfiler(VM *, long censusEvery);
+uint32_t recordAllocation(VM *, size_t size);
+void recordAllocationBytes(Obj *, size_t size);
+void finishAllocationProfiler(VM *);
+
+#endif
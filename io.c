@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+#include "io.h"
+#include "vm.h"
+#include "memory.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// every fd handed to a script is non-blocking. a native that would block parks
+// the running fiber on the epoll set or the timer heap and returns NATIVE_RETRY
+// or NATIVE_SUSPEND, the vm then switches to another fiber and only blocks in
+// pollIO once nothing is ready to run. several fibers can wait on one fd, the
+// epoll registration is per fd and a ready fd wakes the waiters it concerns.
+
+#define READ_SIZE 4096
+#define EVENTS_MAX 64
+
+void initIO(IOState *io) {
+	io->epollFd = -1;
+	io->waiting = 0;
+	io->timers = NULL;
+	io->timerCount = 0;
+	io->timerCapacity = 0;
+	io->peers = NULL;
+	io->peerCapacity = 0;
+	io->fds = NULL;
+	io->fdCapacity = 0;
+}
+
+void freeIO(IOState *io) {
+	if(io->epollFd >= 0) close(io->epollFd);
+	FREE_ARRAY(Timer, io->timers, io->timerCapacity);
+	FREE_ARRAY(int, io->peers, io->peerCapacity);
+	FREE_ARRAY(FdWaiters, io->fds, io->fdCapacity);
+	initIO(io);
+}
+
+// forget every parked fiber, used when a run is abandoned
+void cancelIO(IOState *io) {
+	if(io->epollFd >= 0) close(io->epollFd);
+	io->epollFd = -1;
+	io->timerCount = 0;
+	io->waiting = 0;
+	for(int i=0;i<io->fdCapacity;i++) io->fds[i] = (FdWaiters){NULL, NULL, 0};
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pushTimer(IOState *io, double deadline, ObjFiber *fiber) {
+	if(io->timerCapacity <= io->timerCount) {
+		int oldCapacity = io->timerCapacity;
+		io->timerCapacity = GROW_CAPACITY(oldCapacity);
+		io->timers = GROW_ARRAY(Timer, io->timers, oldCapacity, io->timerCapacity);
+	}
+	int i = io->timerCount++;
+	while(i > 0 && io->timers[(i-1)/2].deadline > deadline) {
+		io->timers[i] = io->timers[(i-1)/2];
+		i = (i-1)/2;
+	}
+	io->timers[i].deadline = deadline;
+	io->timers[i].fiber = fiber;
+}
+
+static ObjFiber *popTimer(IOState *io) {
+	ObjFiber *fiber = io->timers[0].fiber;
+	Timer last = io->timers[--io->timerCount];
+	int i = 0;
+	while(1) {
+		int child = 2*i + 1;
+		if(child >= io->timerCount) break;
+		if(child+1 < io->timerCount && io->timers[child+1].deadline < io->timers[child].deadline) child++;
+		if(io->timers[child].deadline >= last.deadline) break;
+		io->timers[i] = io->timers[child];
+		i = child;
+	}
+	io->timers[i] = last;
+	return fiber;
+}
+
+static void park(VM *vm) {
+	vm->fiber->waiting = true;
+	vm->io.waiting++;
+}
+
+static void wake(VM *vm, ObjFiber *fiber) {
+	fiber->waiting = false;
+	vm->io.waiting--;
+	scheduleFiber(vm, fiber);
+}
+
+static bool registerFd(IOState *io, int fd, uint32_t events) {
+	FdWaiters *waiters = &io->fds[fd];
+	if(events == waiters->events) return true;
+	struct epoll_event event;
+	event.events = events;
+	event.data.fd = fd;
+	int op = events == 0 ? EPOLL_CTL_DEL : waiters->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if(epoll_ctl(io->epollFd, op, fd, &event) != 0 && op != EPOLL_CTL_DEL) return false;
+	waiters->events = events;
+	return true;
+}
+
+static NativeResult waitFor(VM *vm, int fd, uint32_t events, NativeResult mode) {
+	IOState *io = &vm->io;
+	if(io->epollFd < 0) io->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if(fd >= io->fdCapacity) {
+		int oldCapacity = io->fdCapacity;
+		io->fdCapacity = GROW_CAPACITY(fd + 1);
+		io->fds = GROW_ARRAY(FdWaiters, io->fds, oldCapacity, io->fdCapacity);
+		for(int i=oldCapacity;i<io->fdCapacity;i++) io->fds[i] = (FdWaiters){NULL, NULL, 0};
+	}
+	FdWaiters *waiters = &io->fds[fd];
+	if(!registerFd(io, fd, waiters->events | events)) {
+		runtimeError(vm, "Can't wait on fd %d: %s", fd, strerror(errno));
+		return NATIVE_ERROR;
+	}
+	// first come first woken
+	ObjFiber *fiber = vm->fiber;
+	fiber->waitFd = fd;
+	fiber->waitEvents = events;
+	fiber->nextWaiter = NULL;
+	if(waiters->tail != NULL) waiters->tail->nextWaiter = fiber;
+	else waiters->head = fiber;
+	waiters->tail = fiber;
+	park(vm);
+	return mode;
+}
+
+// wakes the fibers waiting for any of ready, errors and hangups wake all of them.
+// they run their call again and find out for themselves
+static void wakeWaiters(VM *vm, int fd, uint32_t ready) {
+	IOState *io = &vm->io;
+	FdWaiters *waiters = &io->fds[fd];
+	if(ready & (EPOLLERR | EPOLLHUP)) ready |= EPOLLIN | EPOLLOUT;
+	ObjFiber *fiber = waiters->head;
+	ObjFiber *previous = NULL;
+	uint32_t remaining = 0;
+	while(fiber != NULL) {
+		ObjFiber *next = fiber->nextWaiter;
+		if(fiber->waitEvents & ready) {
+			if(previous != NULL) previous->nextWaiter = next;
+			else waiters->head = next;
+			if(waiters->tail == fiber) waiters->tail = previous;
+			fiber->nextWaiter = NULL;
+			fiber->waitFd = -1;
+			wake(vm, fiber);
+		} else {
+			remaining |= fiber->waitEvents;
+			previous = fiber;
+		}
+		fiber = next;
+	}
+	registerFd(io, fd, remaining);
+}
+
+bool ioPending(VM *vm) {
+	return vm->io.waiting > 0;
+}
+
+void pollIO(VM *vm, bool block) {
+	IOState *io = &vm->io;
+	int timeout = 0;
+	if(block) {
+		timeout = -1;
+		if(io->timerCount > 0) {
+			double wait = io->timers[0].deadline - now();
+			timeout = wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+		}
+	}
+	if(io->epollFd >= 0) {
+		struct epoll_event events[EVENTS_MAX];
+		int count = epoll_wait(io->epollFd, events, EVENTS_MAX, timeout);
+		for(int i=0;i<count;i++) wakeWaiters(vm, events[i].data.fd, events[i].events);
+	} else if(timeout > 0) {
+		struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000L};
+		nanosleep(&ts, NULL);
+	}
+	double current = now();
+	while(io->timerCount > 0 && io->timers[0].deadline <= current) {
+		wake(vm, popTimer(io));
+	}
+}
+
+static bool numberArg(VM *vm, char *name, Value value, int *out) {
+	if(!IS_NUMBER(value)) {
+		runtimeError(vm, "%s() expects a number.", name);
+		return false;
+	}
+	*out = (int)AS_NUMBER(value);
+	return true;
+}
+
+static bool stringArg(VM *vm, char *name, Value value, ObjString **out) {
+	if(!IS_STRING(value)) {
+		runtimeError(vm, "%s() expects a string.", name);
+		return false;
+	}
+	*out = AS_STRING(value);
+	return true;
+}
+
+static NativeResult ioError(VM *vm, char *name) {
+	runtimeError(vm, "%s() failed: %s", name, strerror(errno));
+	return NATIVE_ERROR;
+}
+
+static bool wouldBlock() {
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static NativeResult ioRead(VM *vm, int argCount, Value *args, Value *result) {
+	int fd;
+	if(!numberArg(vm, "read", args[0], &fd)) return NATIVE_ERROR;
+	char buffer[READ_SIZE];
+	ssize_t bytesRead = read(fd, buffer, sizeof(buffer));
+	if(bytesRead < 0 && wouldBlock()) return waitFor(vm, fd, EPOLLIN, NATIVE_RETRY);
+	if(bytesRead < 0) return ioError(vm, "read");
+	*result = bytesRead == 0 ? NIL_VAL : OBJ_VAL(copyString(vm, buffer, (int)bytesRead));
+	return NATIVE_OK;
+}
+
+static NativeResult ioWrite(VM *vm, int argCount, Value *args, Value *result) {
+	int fd;
+	ObjString *data;
+	if(!numberArg(vm, "write", args[0], &fd) ||
+			!stringArg(vm, "write", args[1], &data)) return NATIVE_ERROR;
+	// keep the order with print, which still sits in the vm's buffer
+	if(fd == STDOUT_FILENO) flushOutput(&vm->out);
+	ssize_t written = write(fd, data->chars, data->length);
+	if(written < 0 && wouldBlock()) return waitFor(vm, fd, EPOLLOUT, NATIVE_RETRY);
+	if(written < 0) return ioError(vm, "write");
+	*result = NUMBER_VAL((double)written);
+	return NATIVE_OK;
+}
+
+static NativeResult ioClose(VM *vm, int argCount, Value *args, Value *result) {
+	int fd;
+	if(!numberArg(vm, "close", args[0], &fd)) return NATIVE_ERROR;
+	// fibers parked on it would otherwise wait forever, woken they fail on the closed fd
+	if(fd >= 0 && fd < vm->io.fdCapacity && vm->io.fds[fd].events != 0) {
+		wakeWaiters(vm, fd, EPOLLIN | EPOLLOUT);
+	}
+	if(close(fd) != 0) return ioError(vm, "close");
+	// the number gets reused by the next fd opened, which has no peer
+	if(fd >= 0 && fd < vm->io.peerCapacity) vm->io.peers[fd] = -1;
+	*result = NIL_VAL;
+	return NATIVE_OK;
+}
+
+static NativeResult ioOpen(VM *vm, int argCount, Value *args, Value *result) {
+	ObjString *path;
+	ObjString *mode;
+	if(!stringArg(vm, "open", args[0], &path) ||
+			!stringArg(vm, "open", args[1], &mode)) return NATIVE_ERROR;
+	int flags;
+	if(!strcmp(mode->chars, "r")) flags = O_RDONLY;
+	else if(!strcmp(mode->chars, "w")) flags = O_WRONLY | O_CREAT | O_TRUNC;
+	else if(!strcmp(mode->chars, "a")) flags = O_WRONLY | O_CREAT | O_APPEND;
+	else {
+		runtimeError(vm, "open() mode must be \"r\", \"w\" or \"a\".");
+		return NATIVE_ERROR;
+	}
+	int fd = open(path->chars, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+	if(fd < 0) return ioError(vm, "open");
+	*result = NUMBER_VAL(fd);
+	return NATIVE_OK;
+}
+
+static void setPeer(IOState *io, int fd, int peer) {
+	if(fd >= io->peerCapacity) {
+		int oldCapacity = io->peerCapacity;
+		io->peerCapacity = GROW_CAPACITY(fd + 1);
+		io->peers = GROW_ARRAY(int, io->peers, oldCapacity, io->peerCapacity);
+		for(int i=oldCapacity;i<io->peerCapacity;i++) io->peers[i] = -1;
+	}
+	io->peers[fd] = peer;
+}
+
+// returns the read end, peer() gives the write end
+static NativeResult ioPipe(VM *vm, int argCount, Value *args, Value *result) {
+	int fds[2];
+	if(pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) return ioError(vm, "pipe");
+	setPeer(&vm->io, fds[0], fds[1]);
+	setPeer(&vm->io, fds[1], fds[0]);
+	*result = NUMBER_VAL(fds[0]);
+	return NATIVE_OK;
+}
+
+static NativeResult ioPeer(VM *vm, int argCount, Value *args, Value *result) {
+	int fd;
+	if(!numberArg(vm, "peer", args[0], &fd)) return NATIVE_ERROR;
+	*result = fd >= 0 && fd < vm->io.peerCapacity && vm->io.peers[fd] >= 0 ? NUMBER_VAL(vm->io.peers[fd]) : NIL_VAL;
+	return NATIVE_OK;
+}
+
+static NativeResult ioListen(VM *vm, int argCount, Value *args, Value *result) {
+	int port;
+	if(!numberArg(vm, "listen", args[0], &port)) return NATIVE_ERROR;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) return ioError(vm, "listen");
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	if(bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 128) != 0) {
+		close(fd);
+		return ioError(vm, "listen");
+	}
+	*result = NUMBER_VAL(fd);
+	return NATIVE_OK;
+}
+
+static NativeResult ioLocalPort(VM *vm, int argCount, Value *args, Value *result) {
+	int fd;
+	if(!numberArg(vm, "localPort", args[0], &fd)) return NATIVE_ERROR;
+	struct sockaddr_in address;
+	socklen_t length = sizeof(address);
+	if(getsockname(fd, (struct sockaddr *)&address, &length) != 0) return ioError(vm, "localPort");
+	*result = NUMBER_VAL(ntohs(address.sin_port));
+	return NATIVE_OK;
+}
+
+static NativeResult ioAccept(VM *vm, int argCount, Value *args, Value *result) {
+	int fd;
+	if(!numberArg(vm, "accept", args[0], &fd)) return NATIVE_ERROR;
+	int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(client < 0 && wouldBlock()) return waitFor(vm, fd, EPOLLIN, NATIVE_RETRY);
+	if(client < 0) return ioError(vm, "accept");
+	*result = NUMBER_VAL(client);
+	return NATIVE_OK;
+}
+
+// the second run of a connect() that had to wait: writable means it finished,
+// SO_ERROR says whether it worked
+static NativeResult finishConnect(VM *vm, Value *result) {
+	int fd = vm->fiber->connectFd;
+	vm->fiber->connectFd = -1;
+	int error = 0;
+	socklen_t length = sizeof(error);
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) return ioError(vm, "connect");
+	if(error != 0) {
+		close(fd);
+		errno = error;
+		return ioError(vm, "connect");
+	}
+	*result = NUMBER_VAL(fd);
+	return NATIVE_OK;
+}
+
+// the fiber sleeps until the connection is writable, then the call runs again to finish it
+static NativeResult ioConnect(VM *vm, int argCount, Value *args, Value *result) {
+	ObjString *host;
+	int port;
+	if(vm->fiber->connectFd >= 0) return finishConnect(vm, result);
+	if(!stringArg(vm, "connect", args[0], &host) ||
+			!numberArg(vm, "connect", args[1], &port)) return NATIVE_ERROR;
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	if(inet_pton(AF_INET, host->chars, &address.sin_addr) != 1) {
+		runtimeError(vm, "connect() expects an IPv4 address.");
+		return NATIVE_ERROR;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) return ioError(vm, "connect");
+	if(connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+		*result = NUMBER_VAL(fd);
+		return NATIVE_OK;
+	}
+	if(errno != EINPROGRESS) {
+		close(fd);
+		return ioError(vm, "connect");
+	}
+	NativeResult status = waitFor(vm, fd, EPOLLOUT, NATIVE_RETRY);
+	if(status == NATIVE_ERROR) close(fd);
+	else vm->fiber->connectFd = fd;
+	return status;
+}
+
+static NativeResult ioSleep(VM *vm, int argCount, Value *args, Value *result) {
+	if(!IS_NUMBER(args[0])) {
+		runtimeError(vm, "sleep() expects a number.");
+		return NATIVE_ERROR;
+	}
+	*result = NIL_VAL;
+	pushTimer(&vm->io, now() + AS_NUMBER(args[0]) / 1000.0, vm->fiber);
+	park(vm);
+	return NATIVE_SUSPEND;
+}
+
+void defineIONatives(VM *vm) {
+	defineNative(vm, "read", ioRead, 1);
+	defineNative(vm, "write", ioWrite, 2);
+	defineNative(vm, "close", ioClose, 1);
+	defineNative(vm, "open", ioOpen, 2);
+	defineNative(vm, "pipe", ioPipe, 0);
+	defineNative(vm, "peer", ioPeer, 1);
+	defineNative(vm, "listen", ioListen, 1);
+	defineNative(vm, "localPort", ioLocalPort, 1);
+	defineNative(vm, "accept", ioAccept, 1);
+	defineNative(vm, "connect", ioConnect, 2);
+	defineNative(vm, "sleep", ioSleep, 1);
+}
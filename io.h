@@ -0,0 +1,38 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdbool.h>
+#include "obj.h"
+
+typedef struct {
+	double deadline;
+	ObjFiber *fiber;
+} Timer;
+
+// every fiber parked on one fd, the fd is registered for the union of their events
+typedef struct {
+	ObjFiber *head;
+	ObjFiber *tail;
+	uint32_t events;
+} FdWaiters;
+
+typedef struct {
+	int epollFd; // created on first use
+	int waiting; // fibers parked on an fd or a timer
+	Timer *timers; // min heap on deadline
+	int timerCount;
+	int timerCapacity;
+	int *peers; // other end of each pipe(), indexed by fd
+	int peerCapacity;
+	FdWaiters *fds; // indexed by fd
+	int fdCapacity;
+} IOState;
+
+void initIO(IOState *io);
+void freeIO(IOState *io);
+void cancelIO(IOState *io);
+void defineIONatives(VM *vm);
+bool ioPending(VM *vm);
+void pollIO(VM *vm, bool block);
+
+#endif
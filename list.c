@@ -0,0 +1,50 @@
+#include "list.h"
+#include "memory.h"
+
+static bool listArg(VM *vm, char *name, Value value, ObjList **out) {
+	if(!IS_LIST(value)) {
+		runtimeError(vm, "%s() expects a list.", name);
+		return false;
+	}
+	*out = AS_LIST(value);
+	return true;
+}
+
+// amortized O(1), the buffer grows through writeValueArray
+static NativeResult listAppend(VM *vm, int argCount, Value *args, Value *result) {
+	ObjList *list;
+	if(!listArg(vm, "append", args[0], &list)) return NATIVE_ERROR;
+	writeValueArray(&list->items, args[1]);
+	*result = NIL_VAL;
+	return NATIVE_OK;
+}
+
+// the buffer keeps its capacity, a later append reuses it
+static NativeResult listPop(VM *vm, int argCount, Value *args, Value *result) {
+	ObjList *list;
+	if(!listArg(vm, "pop", args[0], &list)) return NATIVE_ERROR;
+	if(list->items.count == 0) {
+		runtimeError(vm, "Can't pop from an empty list.");
+		return NATIVE_ERROR;
+	}
+	*result = list->items.values[--list->items.count];
+	return NATIVE_OK;
+}
+
+static NativeResult listLen(VM *vm, int argCount, Value *args, Value *result) {
+	if(IS_LIST(args[0])) *result = NUMBER_VAL(AS_LIST(args[0])->items.count);
+	else if(IS_MAP(args[0])) *result = NUMBER_VAL(AS_MAP(args[0])->table.count);
+	else if(IS_F64_ARRAY(args[0])) *result = NUMBER_VAL(AS_F64_ARRAY(args[0])->count);
+	else if(IS_STRING(args[0])) *result = NUMBER_VAL(AS_STRING(args[0])->length);
+	else {
+		runtimeError(vm, "len() expects a list, a map, a float64 array or a string.");
+		return NATIVE_ERROR;
+	}
+	return NATIVE_OK;
+}
+
+void defineListNatives(VM *vm) {
+	defineNative(vm, "append", listAppend, 2);
+	defineNative(vm, "pop", listPop, 1);
+	defineNative(vm, "len", listLen, 1);
+}
@@ -0,0 +1,8 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include "vm.h"
+
+void defineListNatives(VM *vm);
+
+#endif
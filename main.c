@@ -3,40 +3,92 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "compiler.h"
+#include "cache.h"
+#include "snapshot.h"
+#include "bundle.h"
+#include "server.h"
+#include "batch.h"
+#include "obj.h"
+#include "profile.h"
+#include "stats.h"
+#include "heapprof.h"
+#include <string.h>
 
-char *readFile(char *filename) {
-	FILE *file = fopen(filename, "rb");
-	if(file == NULL) {
+// a script that can't be read ends the run, unlike a missing module
+static char *openSource(char *filename, Mapping *mapping) {
+	char *source = loadSource(filename, mapping);
+	if(source == NULL) {
 		printf("Could not open file %s\n", filename);
 		exit(74);
 	}
-	fseek(file, 0L, SEEK_END);
-	size_t filesize = ftell(file);
-	rewind(file);
-	char *buffer = (char *)malloc(filesize + 1);
-	if(buffer == NULL) {
-		printf("Could not allocate enough memory\n");
-	}
-	size_t bytesRead = fread(buffer, sizeof(char), filesize, file);
-	if(bytesRead < filesize) {
-		printf("Could not read file %s\n", filename);
-	}
+	return source;
+}
 
-	buffer[filesize] = '\0';
-	fclose(file);
-	return buffer;
+// functions the script defined keep running out of its .loxc after runFile returns,
+// a snapshot writes them out, so the mapping goes only once the vm has been freed
+static Mapping scriptCache = {NULL, 0};
+
+static void runFile(VM *vm, char *filename) {
+	Mapping sourceMapping = {NULL, 0};
+	char *source = openSource(filename, &sourceMapping);
+	SourceKey key = sourceKey(source);
+	char *cache = cachePath(filename);
+	Chunk chunk;
+	InterpretResult result = INTERPRET_OK;
+	if(!loadCache(vm, cache, key, &chunk, &scriptCache)) {
+		initChunk(&chunk);
+		if(compile(vm, &chunk, source)) {
+			writeCache(cache, key, &chunk);
+		} else {
+			result = INTERPRET_COMPILE_ERROR;
+		}
+	}
+	if(result == INTERPRET_OK) result = interpretChunk(vm, &chunk);
+	freeChunk(&chunk);
+	free(cache);
+	releaseSource(source, &sourceMapping);
+	if(result == INTERPRET_COMPILE_ERROR) exit(65);
+	if(result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
-static void runFile(char *filename) {
-	char *source = readFile(filename);
-	InterpretResult result = interpret(source);
-	free(source);
+static void runFiles(VM *vm, int count, char **filenames) {
+	char **sources = (char **)malloc(sizeof(char *) * count);
+	Mapping *mappings = (Mapping *)calloc(count, sizeof(Mapping));
+	Chunk *chunks = (Chunk *)malloc(sizeof(Chunk) * count);
+	bool *results = (bool *)malloc(sizeof(bool) * count);
+	for(int i=0;i<count;i++) {
+		sources[i] = openSource(filenames[i], &mappings[i]);
+	}
+	bool ok = compileBatch(vm, count, sources, chunks, results, 0);
+	InterpretResult result = ok ? INTERPRET_OK : INTERPRET_COMPILE_ERROR;
+	for(int i=0;i<count && result == INTERPRET_OK;i++) {
+		result = interpretChunk(vm, &chunks[i]);
+	}
+	for(int i=0;i<count;i++) {
+		freeChunk(&chunks[i]);
+		releaseSource(sources[i], &mappings[i]);
+	}
+	free(results);
+	free(chunks);
+	free(mappings);
+	free(sources);
 	if(result == INTERPRET_COMPILE_ERROR) exit(65);
 	if(result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// for huge generated inputs: no cache and no whole-file chunk, each top-level
+// declaration is compiled, run and freed before the next one is read
+static void streamFile(VM *vm, char *filename) {
+	Mapping mapping = {NULL, 0};
+	char *source = openSource(filename, &mapping);
+	InterpretResult result = interpretStream(vm, source);
+	releaseSource(source, &mapping);
+	if(result == INTERPRET_COMPILE_ERROR) exit(65);
+	if(result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
 
-static void repl() {
+static void repl(VM *vm) {
 	char line[1024];
 	while(1) {
 		printf("> ");
@@ -44,20 +96,141 @@ static void repl() {
 			printf("\n");
 			break;
 		}
-		interpret(line);
+		interpret(vm, line);
 	}
 }
 
-int main(int argc, char **argv) {
-	initVM();
-	if(argc==1) {
-		repl();
-	} else if(argc == 2) {
-		runFile(argv[1]);
+static void runPaths(VM *vm, int count, char **paths) {
+	if(count == 0) {
+		repl(vm);
+	} else if(count == 1) {
+		runFile(vm, paths[0]);
 	} else {
-		printf("Usage: clox [path]\n");
+		runFiles(vm, count, paths);
+	}
+}
+
+static void runBundle(VM *vm, Chunk *chunk, Mapping *bundle) {
+	InterpretResult result = interpretChunk(vm, chunk);
+	freeChunk(chunk);
+	freeVM(vm);
+	unloadCache(bundle);
+	if(result == INTERPRET_RUNTIME_ERROR) exit(70);
+	exit(0);
+}
+
+int main(int argc, char **argv) {
+	VM vm;
+	initVM(&vm);
+	Mapping snapshot = {NULL, 0};
+	Mapping bundle = {NULL, 0};
+	Chunk bundled;
+	if(loadBundle(&vm, &bundled, &bundle)) {
+		runBundle(&vm, &bundled, &bundle);
+	} else if(bundle.start != NULL) {
+		printf("Corrupt bundle payload\n");
+		exit(74);
+	}
+	if(argc > 1 && !strcmp(argv[1], "--batch")) {
+		int jobs = 0;
+		char *prelude = NULL;
+		int i = 2;
+		for(;i+1<argc;i+=2) {
+			if(!strcmp(argv[i], "-j")) jobs = atoi(argv[i+1]);
+			else if(!strcmp(argv[i], "--prelude")) prelude = argv[i+1];
+			else break;
+		}
+		if(i >= argc) {
+			printf("Usage: clox --batch [-j N] [--prelude path] path...\n");
+			exit(64);
+		}
+		int status = runBatch(&vm, jobs, prelude, argc-i, argv+i);
+		freeVM(&vm);
+		return status;
+	} else if(argc > 1 && !strcmp(argv[1], "--serve")) {
+		if(argc != 3) {
+			printf("Usage: clox --serve socket\n");
+			exit(64);
+		}
+		if(!serve(&vm, argv[2])) exit(74);
+	} else if(argc > 1 && !strcmp(argv[1], "--bundle")) {
+		if(argc != 5 || strcmp(argv[3], "-o")) {
+			printf("Usage: clox --bundle path -o output\n");
+			exit(64);
+		}
+		if(!writeBundle(&vm, argv[2], argv[4])) exit(65);
+	} else if(argc > 1 && !strcmp(argv[1], "--stream")) {
+		if(argc != 3) {
+			printf("Usage: clox --stream path\n");
+			exit(64);
+		}
+		streamFile(&vm, argv[2]);
+	} else if(argc > 1 && !strcmp(argv[1], "--profile")) {
+		if(argc < 4) {
+			printf("Usage: clox --profile out.folded path...\n");
+			exit(64);
+		}
+		if(!startProfiler(argv[2])) {
+			printf("Could not start the profiler\n");
+			exit(74);
+		}
+		runPaths(&vm, argc-3, argv+3);
+	} else if(argc > 1 && !strcmp(argv[1], "--allocs")) {
+		int first = 2;
+		long census = 0;
+		if(argc > 3 && !strcmp(argv[2], "--census")) {
+			census = atol(argv[3]);
+			first = 4;
+		}
+		if(first >= argc || census < 0) {
+			printf("Usage: clox --allocs [--census N] path...\n");
+			exit(64);
+		}
+		startAllocationProfiler(&vm, census);
+		runPaths(&vm, argc-first, argv+first);
+	} else if(argc > 1 && !strcmp(argv[1], "--stats")) {
+#ifdef CLOX_STATS
+		int first = 2;
+		char *json = NULL;
+		if(argc > 3 && !strcmp(argv[2], "-o")) {
+			json = argv[3];
+			first = 4;
+		}
+		if(first >= argc) {
+			printf("Usage: clox --stats [-o out.json] path...\n");
+			exit(64);
+		}
+		startStats(json);
+		runPaths(&vm, argc-first, argv+first);
+#else
+		printf("This clox was built without stats, build it with make stats\n");
 		exit(64);
+#endif
+	} else if(argc > 1 && !strcmp(argv[1], "--snapshot")) {
+		if(argc < 4) {
+			printf("Usage: clox --snapshot out.img path...\n");
+			exit(64);
+		}
+		runPaths(&vm, argc-3, argv+3);
+		if(!writeSnapshot(&vm, argv[2])) {
+			printf("Could not write snapshot %s\n", argv[2]);
+			exit(74);
+		}
+	} else if(argc > 1 && !strcmp(argv[1], "--from-snapshot")) {
+		if(argc < 3) {
+			printf("Usage: clox --from-snapshot image [path...]\n");
+			exit(64);
+		}
+		if(!loadSnapshot(&vm, argv[2], &snapshot)) {
+			printf("Could not load snapshot %s\n", argv[2]);
+			exit(74);
+		}
+		runPaths(&vm, argc-3, argv+3);
+	} else {
+		runPaths(&vm, argc-1, argv+1);
 	}
-	freeVM();
+	freeVM(&vm);
+	unloadCache(&snapshot);
+	unloadCache(&scriptCache);
 	return 0;
 }
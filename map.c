@@ -0,0 +1,72 @@
+#include "map.h"
+#include "memory.h"
+
+// nan never equals itself, a nan key could be stored but never found again
+bool checkMapKey(VM *vm, Value key) {
+	if(IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)) {
+		runtimeError(vm, "Map key can't be NaN.");
+		return false;
+	}
+	return true;
+}
+
+static bool mapArg(VM *vm, char *name, Value value, ObjMap **out) {
+	if(!IS_MAP(value)) {
+		runtimeError(vm, "%s() expects a map.", name);
+		return false;
+	}
+	*out = AS_MAP(value);
+	return true;
+}
+
+static NativeResult mapHas(VM *vm, int argCount, Value *args, Value *result) {
+	ObjMap *map;
+	if(!mapArg(vm, "has", args[0], &map)) return NATIVE_ERROR;
+	Value value;
+	*result = BOOL_VAL(tableGetValue(&map->table, args[1], &value));
+	return NATIVE_OK;
+}
+
+// nil for a missing key, m[key] reports it instead
+static NativeResult mapGet(VM *vm, int argCount, Value *args, Value *result) {
+	ObjMap *map;
+	if(!mapArg(vm, "get", args[0], &map)) return NATIVE_ERROR;
+	if(!tableGetValue(&map->table, args[1], result)) *result = NIL_VAL;
+	return NATIVE_OK;
+}
+
+static NativeResult mapSet(VM *vm, int argCount, Value *args, Value *result) {
+	ObjMap *map;
+	if(!mapArg(vm, "set", args[0], &map) || !checkMapKey(vm, args[1])) return NATIVE_ERROR;
+	tableSetValue(&map->table, args[1], args[2]);
+	*result = args[2];
+	return NATIVE_OK;
+}
+
+// true if the key was there
+static NativeResult mapDelete(VM *vm, int argCount, Value *args, Value *result) {
+	ObjMap *map;
+	if(!mapArg(vm, "delete", args[0], &map)) return NATIVE_ERROR;
+	*result = BOOL_VAL(tableDeleteValue(&map->table, args[1]));
+	return NATIVE_OK;
+}
+
+static NativeResult mapKeys(VM *vm, int argCount, Value *args, Value *result) {
+	ObjMap *map;
+	if(!mapArg(vm, "keys", args[0], &map)) return NATIVE_ERROR;
+	ObjList *list = newList(vm);
+	Table *table = &map->table;
+	for(int i=0;i<table->used;i++) {
+		if(!IS_EMPTY_KEY(table->entries[i].key)) writeValueArray(&list->items, table->entries[i].key);
+	}
+	*result = OBJ_VAL(list);
+	return NATIVE_OK;
+}
+
+void defineMapNatives(VM *vm) {
+	defineNative(vm, "has", mapHas, 2);
+	defineNative(vm, "get", mapGet, 2);
+	defineNative(vm, "set", mapSet, 3);
+	defineNative(vm, "delete", mapDelete, 2);
+	defineNative(vm, "keys", mapKeys, 1);
+}
@@ -0,0 +1,9 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include "vm.h"
+
+bool checkMapKey(VM *vm, Value key);
+void defineMapNatives(VM *vm);
+
+#endif
@@ -0,0 +1,26 @@
+#include "mathlib.h"
+#include <math.h>
+
+// libm is called straight from OP_CALL, only pow needs the general native signature
+static NativeResult mathPow(VM *vm, int argCount, Value *args, Value *result) {
+	if(!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+		runtimeError(vm, "pow() expects two numbers.");
+		return NATIVE_ERROR;
+	}
+	*result = NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+	return NATIVE_OK;
+}
+
+void defineMathNatives(VM *vm) {
+	defineUnaryNative(vm, "sqrt", sqrt);
+	defineUnaryNative(vm, "abs", fabs);
+	defineUnaryNative(vm, "floor", floor);
+	defineUnaryNative(vm, "ceil", ceil);
+	defineUnaryNative(vm, "round", round);
+	defineUnaryNative(vm, "sin", sin);
+	defineUnaryNative(vm, "cos", cos);
+	defineUnaryNative(vm, "tan", tan);
+	defineUnaryNative(vm, "exp", exp);
+	defineUnaryNative(vm, "log", log);
+	defineNative(vm, "pow", mathPow, 2);
+}
@@ -0,0 +1,8 @@
+#ifndef MATHLIB_H
+#define MATHLIB_H
+
+#include "vm.h"
+
+void defineMathNatives(VM *vm);
+
+#endif
@@ -1,7 +1,11 @@
+#include <string.h>
+
 #include "memory.h"
+#include "stats.h"
 
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+	STAT_ALLOC(oldSize, newSize);
 	if(newSize == 0) {
 		free(pointer);
 		return NULL;
@@ -17,18 +21,149 @@ static void freeObject(Obj *obj) {
 	switch(obj->type) {
 		case OBJ_STRING: {
 			ObjString *string = (ObjString *)obj;
-			FREE_ARRAY(char, string->chars, string->length);
+			FREE_ARRAY(char, string->chars, string->length+1);
 			FREE(ObjString, obj);
 			break;
 		}
+		case OBJ_MODULE: {
+			ObjModule *module = (ObjModule *)obj;
+			freeChunk(module->chunk);
+			FREE(Chunk, module->chunk);
+			for(int i=0;i<module->retiredCount;i++) {
+				freeChunk(module->retired[i]);
+				FREE(Chunk, module->retired[i]);
+			}
+			FREE_ARRAY(Chunk *, module->retired, module->retiredCapacity);
+			FREE(ObjModule, obj);
+			break;
+		}
+		case OBJ_FIBER: {
+			ObjFiber *fiber = (ObjFiber *)obj;
+			FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+			FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+			FREE(ObjFiber, obj);
+			break;
+		}
+		case OBJ_NATIVE:
+			FREE(ObjNative, obj);
+			break;
+		case OBJ_FUNCTION: {
+			ObjFunction *function = (ObjFunction *)obj;
+			freeChunk(&function->chunk);
+			FREE_ARRAY(uint8_t, function->upvalues, function->upvalueCount * 2);
+			FREE(ObjFunction, obj);
+			break;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure *closure = (ObjClosure *)obj;
+			FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+			FREE(ObjClosure, obj);
+			break;
+		}
+		case OBJ_UPVALUE:
+			FREE(ObjUpvalue, obj);
+			break;
+		case OBJ_SHAPE:
+			freeTable(&((ObjShape *)obj)->transitions);
+			FREE(ObjShape, obj);
+			break;
+		case OBJ_CLASS:
+			freeTable(&((ObjClass *)obj)->methods);
+			FREE(ObjClass, obj);
+			break;
+		case OBJ_INSTANCE: {
+			ObjInstance *instance = (ObjInstance *)obj;
+			FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+			FREE(ObjInstance, obj);
+			break;
+		}
+		case OBJ_BOUND_METHOD:
+			FREE(ObjBoundMethod, obj);
+			break;
+		case OBJ_LIST:
+			freeValueArray(&((ObjList *)obj)->items);
+			FREE(ObjList, obj);
+			break;
+		case OBJ_MAP:
+			freeTable(&((ObjMap *)obj)->table);
+			FREE(ObjMap, obj);
+			break;
+		case OBJ_F64_ARRAY: {
+			ObjF64Array *array = (ObjF64Array *)obj;
+			FREE_ARRAY(double, array->values, array->count);
+			FREE(ObjF64Array, obj);
+			break;
+		}
 	}
 }
 
-void freeObjects() {
-	Obj *object = vm.objects;
+void freeObjects(VM *vm) {
+	Obj *object = vm->objects;
 	while(object != NULL) {
 		Obj *toFree = object;
 		object = object->next;
 		freeObject(toFree);
 	}
 }
+
+static void keepValue(Table *kept, Value value);
+
+// caches are emptied too, they point at shapes and closures the request made
+static void keepChunk(Table *kept, Chunk *chunk) {
+	if(chunk->cacheCount > 0) memset(chunk->caches, 0, sizeof(InlineCache) * chunk->cacheCount);
+	for(int i=0;i<chunk->varr.count;i++) keepValue(kept, chunk->varr.values[i]);
+}
+
+static void keepValue(Table *kept, Value value) {
+	Value seen;
+	if(!IS_OBJ(value) || tableGetValue(kept, value, &seen)) return;
+	tableSetValue(kept, value, BOOL_VAL(true));
+	Obj *obj = AS_OBJ(value);
+	switch(obj->type) {
+		case OBJ_MODULE: {
+			ObjModule *module = (ObjModule *)obj;
+			keepValue(kept, OBJ_VAL(module->path));
+			keepChunk(kept, module->chunk);
+			for(int i=0;i<module->retiredCount;i++) keepChunk(kept, module->retired[i]);
+			break;
+		}
+		case OBJ_FUNCTION: {
+			ObjFunction *function = (ObjFunction *)obj;
+			if(function->name != NULL) keepValue(kept, OBJ_VAL(function->name));
+			keepChunk(kept, &function->chunk);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+// frees what was allocated after mark, except the modules in roots and vm->modules
+// and what their chunks reference. strings that go are dropped from the intern table
+void freeObjectsSince(VM *vm, Obj *mark, Table *roots) {
+	Table kept;
+	initTable(&kept);
+	Table *tables[] = {&vm->modules, roots};
+	for(int t=0;t<2;t++) {
+		if(tables[t] == NULL) continue;
+		for(int i=0;i<tables[t]->used;i++) {
+			Entry *entry = &tables[t]->entries[i];
+			if(IS_EMPTY_KEY(entry->key)) continue;
+			keepValue(&kept, entry->key);
+			keepValue(&kept, entry->value);
+		}
+	}
+	Obj **link = &vm->objects;
+	while(*link != mark) {
+		Obj *object = *link;
+		Value seen;
+		if(tableGetValue(&kept, OBJ_VAL(object), &seen)) {
+			link = &object->next;
+			continue;
+		}
+		*link = object->next;
+		if(object->type == OBJ_STRING) tableDelete(&vm->strings, (ObjString *)object);
+		freeObject(object);
+	}
+	freeTable(&kept);
+}
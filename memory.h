@@ -7,7 +7,7 @@
 #include "obj.h"
 
 #define ALLOCATE(type, size) (type*)reallocate(NULL, 0, size*sizeof(type))
-#define ALLOCATE_OBJ(type, objType) (type *)allocateObject(sizeof(type), objType)
+#define ALLOCATE_OBJ(vm, type, objType) (type *)allocateObject(vm, sizeof(type), objType)
 
 #define GROW_CAPACITY(c) ((c) < 8 ? 8 : 2*(c))
 #define GROW_ARRAY(type, pointer, oldCapacity, newCapacity)\
@@ -20,6 +20,7 @@
 
 void *reallocate(void *, size_t, size_t);
 
-void freeObjects();
+void freeObjects(VM *);
+void freeObjectsSince(VM *, Obj *mark, Table *roots);
 
 #endif
@@ -1,32 +1,109 @@
 #include "obj.h"
 #include "memory.h"
+#include "stats.h"
+#include "heapprof.h"
 #include <string.h>
 
-void printObj(Value value) {
+#define WRITE_LITERAL(out, text) writeOutput(out, text, sizeof(text) - 1)
+
+static void writeCString(OutputBuffer *out, char *chars) {
+	writeOutput(out, chars, (int)strlen(chars));
+}
+
+static void writeFunction(OutputBuffer *out, ObjFunction *function) {
+	if(function->name == NULL) {
+		WRITE_LITERAL(out, "<script>");
+		return;
+	}
+	WRITE_LITERAL(out, "<fn ");
+	writeOutput(out, function->name->chars, function->name->length);
+	writeOutputChar(out, '>');
+}
+
+void writeObj(OutputBuffer *out, Value value) {
 	switch(OBJ_TYPE(value)) {
-		case OBJ_STRING: printf("%s", AS_CSTRING(value)); break;
+		case OBJ_STRING: writeOutput(out, AS_CSTRING(value), AS_STRING(value)->length); break;
+		case OBJ_MODULE:
+			WRITE_LITERAL(out, "<module ");
+			writeCString(out, AS_MODULE(value)->path->chars);
+			writeOutputChar(out, '>');
+			break;
+		case OBJ_FIBER: WRITE_LITERAL(out, "<fiber>"); break;
+		case OBJ_NATIVE:
+			WRITE_LITERAL(out, "<native fn ");
+			writeCString(out, AS_NATIVE(value)->name->chars);
+			writeOutputChar(out, '>');
+			break;
+		case OBJ_FUNCTION: writeFunction(out, AS_FUNCTION(value)); break;
+		case OBJ_CLOSURE: writeFunction(out, AS_CLOSURE(value)->function); break;
+		case OBJ_UPVALUE: WRITE_LITERAL(out, "upvalue"); break;
+		case OBJ_SHAPE: WRITE_LITERAL(out, "shape"); break;
+		case OBJ_CLASS: writeCString(out, AS_CLASS(value)->name->chars); break;
+		case OBJ_INSTANCE:
+			writeCString(out, AS_INSTANCE(value)->klass->name->chars);
+			WRITE_LITERAL(out, " instance");
+			break;
+		case OBJ_BOUND_METHOD: writeValue(out, AS_BOUND_METHOD(value)->method); break;
+		case OBJ_LIST: {
+			ValueArray *items = &AS_LIST(value)->items;
+			writeOutputChar(out, '[');
+			for(int i=0;i<items->count;i++) {
+				if(i > 0) WRITE_LITERAL(out, ", ");
+				writeValue(out, items->values[i]);
+			}
+			writeOutputChar(out, ']');
+			break;
+		}
+		case OBJ_MAP: {
+			Table *table = &AS_MAP(value)->table;
+			writeOutputChar(out, '{');
+			bool first = true;
+			for(int i=0;i<table->used;i++) {
+				Entry *entry = &table->entries[i];
+				if(IS_EMPTY_KEY(entry->key)) continue;
+				if(!first) WRITE_LITERAL(out, ", ");
+				first = false;
+				writeValue(out, entry->key);
+				WRITE_LITERAL(out, ": ");
+				writeValue(out, entry->value);
+			}
+			writeOutputChar(out, '}');
+			break;
+		}
+		case OBJ_F64_ARRAY: {
+			ObjF64Array *array = AS_F64_ARRAY(value);
+			WRITE_LITERAL(out, "float64[");
+			for(int i=0;i<array->count;i++) {
+				if(i > 0) WRITE_LITERAL(out, ", ");
+				writeNumber(out, array->values[i]);
+			}
+			writeOutputChar(out, ']');
+			break;
+		}
 	}
 }
 
-Obj *allocateObject(size_t size, ObjType type) {
+Obj *allocateObject(VM *vm, size_t size, ObjType type) {
 	Obj *obj = (Obj *)reallocate(NULL, 0, size);
 	obj->type = type;
-	obj->next = vm.objects;
-	vm.objects = obj;
+	obj->site = allocationProfiling ? recordAllocation(vm, size) : SITE_UNKNOWN;
+	obj->next = vm->objects;
+	vm->objects = obj;
 	return obj;
 }
 
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-	ObjString *ret = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString *allocateString(VM *vm, char *chars, int length, uint32_t hash) {
+	ObjString *ret = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
 	ret->length = length;
 	ret->chars = chars;
 	ret->hash = hash;
-	tableSet(&vm.strings, ret, NIL_VAL);
+	if(allocationProfiling) recordAllocationBytes(&ret->obj, (size_t)length + 1);
+	tableSet(&vm->strings, ret, NIL_VAL);
 	return ret;
 }
 
-static uint32_t hashString(char *start, int length) {
+uint32_t hashString(char *start, int length) {
 	uint32_t result = 0x811c9dc5; // some magic
 	for(int i=0;i<length;i++) {
 		result ^= start[i];
@@ -35,22 +112,169 @@ static uint32_t hashString(char *start, int length) {
 	return result;
 }
 
-ObjString *takeString(char *start, int length) {
+ObjString *takeString(VM *vm, char *start, int length) {
 	uint32_t hash = hashString(start, length);
-	ObjString *interned = tableFindString(&vm.strings, start, length, hash);
+	ObjString *interned = tableFindString(&vm->strings, start, length, hash);
+	STAT_INTERN(interned != NULL);
 	if(interned != NULL) {
 		FREE_ARRAY(char, start, length+1);
 		return interned;
 	}
-	return allocateString(start, length, hash);
+	return allocateString(vm, start, length, hash);
 }
 
-ObjString *copyString(char *start, int length) {
+ObjString *copyString(VM *vm, char *start, int length) {
 	uint32_t hash = hashString(start, length);
-	ObjString *interned = tableFindString(&vm.strings, start, length, hash);
+	ObjString *interned = tableFindString(&vm->strings, start, length, hash);
+	STAT_INTERN(interned != NULL);
 	if(interned != NULL) return interned;
 	char *heapChars = ALLOCATE(char, length+1);
 	memcpy(heapChars, start, length);
 	heapChars[length] = '\0';
-	return allocateString(heapChars, length, hash);
+	return allocateString(vm, heapChars, length, hash);
+}
+
+ObjModule *newModule(VM *vm, ObjString *path) {
+	ObjModule *module = ALLOCATE_OBJ(vm, ObjModule, OBJ_MODULE);
+	module->path = path;
+	module->sourceHash = 0;
+	module->embedded = false;
+	module->executed = false;
+	module->chunk = ALLOCATE(Chunk, 1);
+	initChunk(module->chunk);
+	module->retired = NULL;
+	module->retiredCount = 0;
+	module->retiredCapacity = 0;
+	return module;
+}
+
+// a NULL chunk leaves the fiber without frames, the root fiber gets one per interpretChunk
+ObjFiber *newFiber(VM *vm, ObjFunction *function, Chunk *chunk, uint8_t *ip, int stackCapacity) {
+	ObjFiber *fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+	fiber->frames = NULL;
+	fiber->frameCount = 0;
+	fiber->frameCapacity = 0;
+	fiber->stack = ALLOCATE(Value, stackCapacity);
+	fiber->stackTop = fiber->stack;
+	fiber->stackCapacity = stackCapacity;
+	fiber->openUpvalues = NULL;
+	fiber->done = false;
+	fiber->waiting = false;
+	fiber->waitFd = -1;
+	fiber->waitEvents = 0;
+	fiber->nextWaiter = NULL;
+	fiber->connectFd = -1;
+	fiber->prevReady = NULL;
+	fiber->nextReady = NULL;
+	if(chunk != NULL) {
+		fiber->frameCapacity = 1;
+		fiber->frames = ALLOCATE(CallFrame, 1);
+		fiber->frames[0].function = function;
+		fiber->frames[0].closure = NULL;
+		fiber->frames[0].chunk = chunk;
+		fiber->frames[0].ip = ip;
+		fiber->frames[0].slots = fiber->stack;
+		fiber->frameCount = 1;
+	}
+	return fiber;
+}
+
+ObjFunction *newFunction(VM *vm) {
+	ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
+	function->arity = 0;
+	function->upvalueCount = 0;
+	function->upvalues = NULL;
+	function->usesEnclosing = false;
+	function->name = NULL;
+	initChunk(&function->chunk);
+	return function;
+}
+
+ObjClosure *newClosure(VM *vm, ObjFunction *function) {
+	ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+	ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
+	closure->function = function;
+	closure->upvalues = upvalues;
+	closure->upvalueCount = function->upvalueCount;
+	return closure;
+}
+
+ObjUpvalue *newUpvalue(VM *vm, Value *slot) {
+	ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
+	upvalue->location = slot;
+	upvalue->closed = NIL_VAL;
+	upvalue->next = NULL;
+	return upvalue;
+}
+
+ObjNative *newNative(VM *vm, ObjString *name, NativeFn function, NativeUnaryFn unary, int arity) {
+	ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+	native->function = function;
+	native->unary = unary;
+	native->name = name;
+	native->arity = arity;
+	return native;
+}
+
+ObjShape *newShape(VM *vm, ObjShape *parent, ObjString *name) {
+	ObjShape *shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+	shape->parent = parent;
+	shape->name = name;
+	shape->fieldCount = parent != NULL ? parent->fieldCount + 1 : 0;
+	initTable(&shape->transitions);
+	return shape;
+}
+
+// instances adding the same field to the same shape end up sharing the next one
+ObjShape *shapeTransition(VM *vm, ObjShape *shape, ObjString *name) {
+	Value next;
+	if(tableGet(&shape->transitions, name, &next)) return (ObjShape *)AS_OBJ(next);
+	ObjShape *created = newShape(vm, shape, name);
+	tableSet(&shape->transitions, name, OBJ_VAL(created));
+	return created;
+}
+
+// the field's slot, or -1. only cache misses walk the chain
+int shapeFind(ObjShape *shape, ObjString *name) {
+	for(; shape->parent != NULL; shape = shape->parent) {
+		if(shape->name == name) return shape->fieldCount - 1;
+	}
+	return -1;
+}
+
+ObjClass *newClass(VM *vm, ObjString *name) {
+	ObjClass *klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
+	klass->name = name;
+	klass->shape = newShape(vm, NULL, NULL);
+	initTable(&klass->methods);
+	klass->initializer = NIL_VAL;
+	return klass;
+}
+
+ObjInstance *newInstance(VM *vm, ObjClass *klass) {
+	ObjInstance *instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
+	instance->klass = klass;
+	instance->shape = klass->shape;
+	instance->fields = NULL;
+	instance->fieldCapacity = 0;
+	return instance;
+}
+
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, Value method) {
+	ObjBoundMethod *bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
+	bound->receiver = receiver;
+	bound->method = method;
+	return bound;
+}
+
+ObjList *newList(VM *vm) {
+	ObjList *list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+	initValueArray(&list->items);
+	return list;
+}
+
+ObjMap *newMap(VM *vm) {
+	ObjMap *map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+	initTable(&map->table);
+	return map;
 }
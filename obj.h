@@ -2,6 +2,8 @@
 #define OBJ_H
 
 #include "value.h"
+#include "chunk.h"
+#include "table.h"
 #include <stdint.h>
 
 
@@ -12,27 +14,231 @@
 #define AS_STRING(v) ((ObjString*)AS_OBJ(v))
 #define AS_CSTRING(v) (((ObjString*)AS_OBJ(v))->chars)
 
-ObjString *copyString(char *chars, int length);
-ObjString *takeString(char*, int);
-void printObj(Value value);
+#define IS_MODULE(v) isObjType(v, OBJ_MODULE)
+#define AS_MODULE(v) ((ObjModule*)AS_OBJ(v))
+
+#define IS_FIBER(v) isObjType(v, OBJ_FIBER)
+#define AS_FIBER(v) ((ObjFiber*)AS_OBJ(v))
+
+#define IS_FUNCTION(v) isObjType(v, OBJ_FUNCTION)
+#define AS_FUNCTION(v) ((ObjFunction*)AS_OBJ(v))
+
+#define IS_CLOSURE(v) isObjType(v, OBJ_CLOSURE)
+#define AS_CLOSURE(v) ((ObjClosure*)AS_OBJ(v))
+
+#define IS_CLASS(v) isObjType(v, OBJ_CLASS)
+#define AS_CLASS(v) ((ObjClass*)AS_OBJ(v))
+
+#define IS_INSTANCE(v) isObjType(v, OBJ_INSTANCE)
+#define AS_INSTANCE(v) ((ObjInstance*)AS_OBJ(v))
+
+#define IS_BOUND_METHOD(v) isObjType(v, OBJ_BOUND_METHOD)
+#define AS_BOUND_METHOD(v) ((ObjBoundMethod*)AS_OBJ(v))
+
+#define IS_LIST(v) isObjType(v, OBJ_LIST)
+#define AS_LIST(v) ((ObjList*)AS_OBJ(v))
+
+#define IS_MAP(v) isObjType(v, OBJ_MAP)
+#define AS_MAP(v) ((ObjMap*)AS_OBJ(v))
+
+#define IS_F64_ARRAY(v) isObjType(v, OBJ_F64_ARRAY)
+#define AS_F64_ARRAY(v) ((ObjF64Array*)AS_OBJ(v))
+
+#define IS_NATIVE(v) isObjType(v, OBJ_NATIVE)
+#define AS_NATIVE(v) ((ObjNative*)AS_OBJ(v))
+
+ObjString *copyString(VM *vm, char *chars, int length);
+ObjString *takeString(VM *vm, char*, int);
+void writeObj(OutputBuffer *out, Value value);
+uint32_t hashString(char *start, int length);
 
 typedef enum {
 	OBJ_STRING,
+	OBJ_MODULE,
+	OBJ_FIBER,
+	OBJ_NATIVE,
+	OBJ_FUNCTION,
+	OBJ_CLOSURE,
+	OBJ_UPVALUE,
+	OBJ_SHAPE,
+	OBJ_CLASS,
+	OBJ_INSTANCE,
+	OBJ_BOUND_METHOD,
+	OBJ_LIST,
+	OBJ_MAP,
+	OBJ_F64_ARRAY,
 } ObjType;
 
 struct Obj {
 	ObjType type;
+	uint32_t site; // allocating line under --allocs, see heapprof.h
 	struct Obj *next;
 };
 
 struct ObjString {
-	Obj *obj;
+	Obj obj;
 	int length;
 	char *chars;
 	uint32_t hash;
 };
 
-Obj *allocateObject(size_t, ObjType);
+typedef struct {
+	Obj obj;
+	ObjString *path;
+	uint32_t sourceHash;
+	bool embedded; // loaded from a bundle, never reloaded from disk
+	bool executed;
+	// frames and spawned fibers point at the chunk itself, so a recompile swaps in
+	// a new one and keeps the old at its address until the module is freed
+	Chunk *chunk;
+	Chunk **retired;
+	int retiredCount;
+	int retiredCapacity;
+} ObjModule;
+
+// upvalues holds an (isLocal, index) byte pair per captured variable for OP_CLOSURE
+typedef struct {
+	Obj obj;
+	int arity;
+	int upvalueCount;
+	uint8_t *upvalues;
+	// non-escaping, reads its captures straight out of the caller's frame
+	bool usesEnclosing;
+	Chunk chunk;
+	ObjString *name;
+} ObjFunction;
+
+// points into a fiber stack while open, at closed once its frame is gone
+typedef struct ObjUpvalue {
+	Obj obj;
+	Value *location;
+	Value closed;
+	struct ObjUpvalue *next;
+} ObjUpvalue;
+
+typedef struct {
+	Obj obj;
+	ObjFunction *function;
+	ObjUpvalue **upvalues;
+	int upvalueCount;
+} ObjClosure;
+
+// function is NULL for script and module frames, closure is NULL unless the callee captured something
+typedef struct {
+	ObjFunction *function;
+	ObjClosure *closure;
+	Chunk *chunk;
+	uint8_t *ip;
+	Value *slots;
+} CallFrame;
+
+// a cooperatively scheduled task with its own growable stack and frames, the vm
+// swaps its cached stack pointers with the running fiber's on every switch
+typedef struct ObjFiber {
+	Obj obj;
+	CallFrame *frames;
+	int frameCount;
+	int frameCapacity;
+	Value *stack;
+	Value *stackTop;
+	int stackCapacity;
+	ObjUpvalue *openUpvalues; // sorted by stack slot, highest first
+	bool done;
+	bool waiting; // parked in the event loop, woken by io.c
+	int waitFd;
+	uint32_t waitEvents;
+	struct ObjFiber *nextWaiter; // the next fiber parked on the same fd
+	int connectFd; // a connect() in progress, finished when the call runs again
+	struct ObjFiber *prevReady;
+	struct ObjFiber *nextReady;
+} ObjFiber;
+
+// a hidden class: the field layout shared by every instance that added the same
+// names in the same order. each class has its own root, so a shape also pins the class
+struct ObjShape {
+	Obj obj;
+	ObjShape *parent;
+	ObjString *name; // the field this shape added, at slot fieldCount - 1
+	int fieldCount;
+	Table transitions; // field name -> the shape that adds it next
+};
+
+typedef struct {
+	Obj obj;
+	ObjString *name;
+	ObjShape *shape;
+	Table methods;
+	Value initializer;
+} ObjClass;
+
+typedef struct {
+	Obj obj;
+	ObjClass *klass;
+	ObjShape *shape;
+	Value *fields;
+	int fieldCapacity;
+} ObjInstance;
+
+typedef struct {
+	Obj obj;
+	Value receiver;
+	Value method;
+} ObjBoundMethod;
+
+// elements sit contiguously in items, indexing never hashes
+typedef struct {
+	Obj obj;
+	ValueArray items;
+} ObjList;
+
+// any value but nan can be a key, for-in walks the keys in insertion order
+typedef struct {
+	Obj obj;
+	Table table;
+} ObjMap;
+
+// unboxed doubles, the numeric kernels in f64.c run straight over values
+typedef struct {
+	Obj obj;
+	double *values;
+	int count;
+} ObjF64Array;
+
+typedef enum {
+	NATIVE_OK,
+	NATIVE_ERROR,
+	NATIVE_RETRY,   // the fiber was parked, the call runs again once it's woken
+	NATIVE_SUSPEND, // the fiber was parked after the call produced its result
+} NativeResult;
+
+// args point at the arguments in place on the vm stack, the vm has already checked argCount
+typedef NativeResult (*NativeFn)(VM *vm, int argCount, Value *args, Value *result);
+// number in, number out, OP_CALL applies these to the stack slot directly
+typedef double (*NativeUnaryFn)(double);
+
+typedef struct {
+	Obj obj;
+	NativeFn function;
+	NativeUnaryFn unary; // set instead of function
+	ObjString *name;
+	int arity; // -1 takes any count
+} ObjNative;
+
+Obj *allocateObject(VM *, size_t, ObjType);
+ObjModule *newModule(VM *, ObjString *path);
+ObjFiber *newFiber(VM *, ObjFunction *function, Chunk *chunk, uint8_t *ip, int stackCapacity);
+ObjFunction *newFunction(VM *);
+ObjClosure *newClosure(VM *, ObjFunction *function);
+ObjUpvalue *newUpvalue(VM *, Value *slot);
+ObjShape *newShape(VM *, ObjShape *parent, ObjString *name);
+ObjShape *shapeTransition(VM *, ObjShape *shape, ObjString *name);
+int shapeFind(ObjShape *shape, ObjString *name);
+ObjClass *newClass(VM *, ObjString *name);
+ObjInstance *newInstance(VM *, ObjClass *klass);
+ObjBoundMethod *newBoundMethod(VM *, Value receiver, Value method);
+ObjList *newList(VM *);
+ObjMap *newMap(VM *);
+ObjNative *newNative(VM *, ObjString *name, NativeFn function, NativeUnaryFn unary, int arity);
 
 static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && (OBJ_TYPE(value)) == type;
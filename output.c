@@ -0,0 +1,51 @@
+#include "output.h"
+#include "dtoa.h"
+#include "memory.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void initOutput(OutputBuffer *out) {
+	out->data = NULL;
+	out->count = 0;
+	out->lineBuffered = isatty(STDOUT_FILENO);
+}
+
+void freeOutput(OutputBuffer *out) {
+	flushOutput(out);
+	FREE_ARRAY(char, out->data, OUTPUT_CAPACITY);
+	out->data = NULL;
+}
+
+// stdio gets the block in one fwrite, which it passes straight to write() when its own buffer is empty
+static void drainOutput(OutputBuffer *out) {
+	if(out->count > 0) fwrite(out->data, 1, out->count, stdout);
+	out->count = 0;
+}
+
+void flushOutput(OutputBuffer *out) {
+	drainOutput(out);
+	fflush(stdout);
+}
+
+void writeOutput(OutputBuffer *out, char *chars, int length) {
+	if(out->count + length > OUTPUT_CAPACITY) {
+		drainOutput(out);
+		if(length > OUTPUT_CAPACITY) {
+			fwrite(chars, 1, length, stdout);
+			return;
+		}
+	}
+	if(out->data == NULL) out->data = ALLOCATE(char, OUTPUT_CAPACITY);
+	memcpy(out->data + out->count, chars, length);
+	out->count += length;
+}
+
+void writeNumber(OutputBuffer *out, double number) {
+	if(out->data != NULL && out->count + NUMBER_MAX_LENGTH <= OUTPUT_CAPACITY) {
+		out->count += formatNumber(number, out->data + out->count);
+		return;
+	}
+	char buffer[NUMBER_MAX_LENGTH];
+	writeOutput(out, buffer, formatNumber(number, buffer));
+}
@@ -0,0 +1,28 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define OUTPUT_CAPACITY (64 * 1024)
+
+// script output collects here and reaches stdio in large blocks. it is flushed when it
+// fills up, when a run ends, by flush(), and before anything else writes to stdout
+typedef struct {
+	char *data;
+	int count;
+	bool lineBuffered; // a terminal sees every line as it's printed
+} OutputBuffer;
+
+void initOutput(OutputBuffer *);
+void freeOutput(OutputBuffer *);
+void flushOutput(OutputBuffer *);
+void writeOutput(OutputBuffer *, char *chars, int length);
+void writeNumber(OutputBuffer *, double number);
+
+static inline void writeOutputChar(OutputBuffer *out, char c) {
+	if(out->data != NULL && out->count < OUTPUT_CAPACITY) out->data[out->count++] = c;
+	else writeOutput(out, &c, 1);
+}
+
+#endif
@@ -0,0 +1,150 @@
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+volatile sig_atomic_t profileSampleDue = 0;
+bool profiling = false;
+
+// every sample is one folded stack, "script:3;fib:7;fib:5", outermost frame first
+static char **samples = NULL;
+static int sampleCount = 0;
+static int sampleCapacity = 0;
+static char *foldedPath = NULL;
+
+typedef struct {
+	char *name; // points into a sample, runs up to the next ';' or the end
+	int length;
+	int count;
+} Tally;
+
+static void onSignal(int signal) {
+	profileSampleDue = 1;
+}
+
+static void appendFrame(char **buffer, size_t *length, size_t *capacity, CallFrame *frame, size_t index) {
+	char *name = frame->function == NULL ? "script" : frame->function->name->chars;
+	int line = frame->chunk->lines[index];
+	size_t needed = *length + strlen(name) + 16;
+	if(needed > *capacity) {
+		while(needed > *capacity) *capacity *= 2;
+		*buffer = (char *)realloc(*buffer, *capacity);
+	}
+	*length += sprintf(*buffer + *length, "%s%s:%d", *length > 0 ? ";" : "", name, line);
+}
+
+// the profiled loop saves the top frame's ip just past the opcode it's about to
+// run, callers' ips sit just past their call, so every frame's line is at ip - 1
+void recordSample(VM *vm) {
+	profileSampleDue = 0;
+	ObjFiber *fiber = vm->fiber;
+	size_t capacity = 128;
+	size_t length = 0;
+	char *stack = (char *)malloc(capacity);
+	int first = fiber->frameCount > PROFILE_DEPTH_MAX ? fiber->frameCount - PROFILE_DEPTH_MAX : 0;
+	if(first > 0) length = (size_t)sprintf(stack, "...");
+	for(int i=first;i<fiber->frameCount;i++) {
+		CallFrame *frame = &fiber->frames[i];
+		size_t index = frame->ip - frame->chunk->code - 1;
+		appendFrame(&stack, &length, &capacity, frame, index);
+	}
+	if(sampleCount == sampleCapacity) {
+		sampleCapacity = sampleCapacity < 1024 ? 1024 : sampleCapacity * 2;
+		samples = (char **)realloc(samples, sizeof(char *) * sampleCapacity);
+	}
+	samples[sampleCount++] = stack;
+}
+
+static int compareSamples(const void *a, const void *b) {
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+static int compareNames(const void *a, const void *b) {
+	Tally *x = (Tally *)a, *y = (Tally *)b;
+	int length = x->length < y->length ? x->length : y->length;
+	int order = memcmp(x->name, y->name, length);
+	return order != 0 ? order : x->length - y->length;
+}
+
+static int compareCounts(const void *a, const void *b) {
+	Tally *x = (Tally *)a, *y = (Tally *)b;
+	if(x->count != y->count) return y->count - x->count;
+	return compareNames(a, b);
+}
+
+// identical stacks are next to each other once sorted, each run is one folded line
+static int writeFolded(FILE *file, Tally *leaves) {
+	if(sampleCount == 0) return 0;
+	qsort(samples, sampleCount, sizeof(char *), compareSamples);
+	int leafCount = 0;
+	for(int i=0;i<sampleCount;) {
+		int j = i;
+		while(j < sampleCount && !strcmp(samples[i], samples[j])) j++;
+		if(file != NULL) fprintf(file, "%s %d\n", samples[i], j - i);
+		char *leaf = strrchr(samples[i], ';');
+		leaf = leaf == NULL ? samples[i] : leaf + 1;
+		leaves[leafCount++] = (Tally){leaf, (int)strlen(leaf), j - i};
+		i = j;
+	}
+	return leafCount;
+}
+
+// self samples per function and line, merged across the stacks they came from
+static int mergeLeaves(Tally *leaves, int count) {
+	if(count == 0) return 0;
+	qsort(leaves, count, sizeof(Tally), compareNames);
+	int merged = 0;
+	for(int i=0;i<count;i++) {
+		if(merged > 0 && compareNames(&leaves[merged-1], &leaves[i]) == 0) {
+			leaves[merged-1].count += leaves[i].count;
+		} else {
+			leaves[merged++] = leaves[i];
+		}
+	}
+	qsort(leaves, merged, sizeof(Tally), compareCounts);
+	return merged;
+}
+
+static void printHotSpots(Tally *leaves, int count) {
+	fprintf(stderr, "profile: %d samples every %d us, folded stacks in %s\n",
+		sampleCount, PROFILE_INTERVAL_US, foldedPath);
+	if(count == 0) return;
+	fprintf(stderr, "%8s %7s  %s\n", "samples", "self", "function:line");
+	for(int i=0;i<count && i<20;i++) {
+		fprintf(stderr, "%8d %6.1f%%  %.*s\n", leaves[i].count,
+			100.0 * leaves[i].count / sampleCount, leaves[i].length, leaves[i].name);
+	}
+}
+
+static void stopProfiler() {
+	struct itimerval off = {{0, 0}, {0, 0}};
+	setitimer(ITIMER_PROF, &off, NULL);
+	profiling = false;
+	FILE *file = fopen(foldedPath, "w");
+	if(file == NULL) fprintf(stderr, "Could not write profile %s\n", foldedPath);
+	Tally *leaves = (Tally *)malloc(sizeof(Tally) * (sampleCount > 0 ? sampleCount : 1));
+	int leafCount = writeFolded(file, leaves);
+	if(file != NULL) fclose(file);
+	printHotSpots(leaves, mergeLeaves(leaves, leafCount));
+	free(leaves);
+	for(int i=0;i<sampleCount;i++) free(samples[i]);
+	free(samples);
+}
+
+// samples cpu time, so a script parked in the event loop isn't sampled while it waits.
+// the report is written at exit, whichever way the run ends
+bool startProfiler(char *path) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if(sigaction(SIGPROF, &action, NULL) != 0) return false;
+	struct itimerval interval = {{0, PROFILE_INTERVAL_US}, {0, PROFILE_INTERVAL_US}};
+	if(setitimer(ITIMER_PROF, &interval, NULL) != 0) return false;
+	foldedPath = path;
+	profiling = true;
+	atexit(stopProfiler);
+	return true;
+}
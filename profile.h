@@ -0,0 +1,19 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include "vm.h"
+
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_DEPTH_MAX 256 // deeper stacks keep their innermost frames
+
+// the SIGPROF handler only raises profileSampleDue, the profiled copy of the
+// dispatch loop sees it before its next instruction and takes the sample there
+extern volatile sig_atomic_t profileSampleDue;
+extern bool profiling;
+
+bool startProfiler(char *path);
+void recordSample(VM *);
+
+#endif
@@ -1,150 +1,377 @@
 #include "scanner.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define CLASS_SPACE 1 // ' ' '\t' '\r' '\n'
+#define CLASS_DIGIT 2
+#define CLASS_ALPHA 4 // letters and '_'
+
+static const uint8_t charClass[256] = {
+	['\t'] = CLASS_SPACE, ['\n'] = CLASS_SPACE, ['\r'] = CLASS_SPACE, [' '] = CLASS_SPACE,
+	['0' ... '9'] = CLASS_DIGIT,
+	['A' ... 'Z'] = CLASS_ALPHA, ['a' ... 'z'] = CLASS_ALPHA, ['_'] = CLASS_ALPHA,
+};
+
+#define CLASS(c) charClass[(uint8_t)(c)]
+
+// the runs the scanner spends its time in: whitespace, comment bodies and
+// string bodies. each returns the first byte that ends the run (or end) and
+// adds the newlines it stepped over to *line
 typedef struct {
-	char *start;
-	char *current;
-	int line;
-} Scanner;
+	char *name;
+	char *(*spaces)(char *p, char *end, int *line);
+	char *(*lineEnd)(char *p, char *end);
+	char *(*quote)(char *p, char *end, int *line);
+} ScanKernels;
+
+static char *scalarSpaces(char *p, char *end, int *line) {
+	while(p < end && (CLASS(*p) & CLASS_SPACE)) {
+		if(*p == '\n') (*line)++;
+		p++;
+	}
+	return p;
+}
+
+static char *scalarLineEnd(char *p, char *end) {
+	while(p < end && *p != '\n') p++;
+	return p;
+}
+
+static char *scalarQuote(char *p, char *end, int *line) {
+	while(p < end && *p != '"') {
+		if(*p == '\n') (*line)++;
+		p++;
+	}
+	return p;
+}
 
-Scanner scanner;
+static ScanKernels scalarScan = {
+	"scalar", scalarSpaces, scalarLineEnd, scalarQuote
+};
 
-void initScanner(char *source) {
-	scanner.start = source;
-	scanner.current = source;
-	scanner.line = 1;
+#ifdef HAVE_X86
+
+// unaligned loads only while a whole block is left before end, the tail goes scalar
+
+static char *sse2Spaces(char *p, char *end, int *line) {
+	__m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+	__m128i cr = _mm_set1_epi8('\r'), nl = _mm_set1_epi8('\n');
+	while(end - p >= 16) {
+		__m128i b = _mm_loadu_si128((__m128i *)p);
+		unsigned newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(b, nl));
+		__m128i blank = _mm_or_si128(_mm_cmpeq_epi8(b, space),
+			_mm_or_si128(_mm_cmpeq_epi8(b, tab), _mm_cmpeq_epi8(b, cr)));
+		unsigned spaces = (unsigned)_mm_movemask_epi8(blank) | newlines;
+		if(spaces != 0xffff) {
+			int n = __builtin_ctz(~spaces);
+			*line += __builtin_popcount(newlines & ((1u << n) - 1));
+			return p + n;
+		}
+		*line += __builtin_popcount(newlines);
+		p += 16;
+	}
+	return scalarSpaces(p, end, line);
 }
 
-static Token makeToken(TokenType type) {
+static char *sse2LineEnd(char *p, char *end) {
+	__m128i nl = _mm_set1_epi8('\n');
+	while(end - p >= 16) {
+		__m128i b = _mm_loadu_si128((__m128i *)p);
+		unsigned hit = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(b, nl));
+		if(hit) return p + __builtin_ctz(hit);
+		p += 16;
+	}
+	return scalarLineEnd(p, end);
+}
+
+static char *sse2Quote(char *p, char *end, int *line) {
+	__m128i quote = _mm_set1_epi8('"'), nl = _mm_set1_epi8('\n');
+	while(end - p >= 16) {
+		__m128i b = _mm_loadu_si128((__m128i *)p);
+		unsigned newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(b, nl));
+		unsigned hit = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(b, quote));
+		if(hit) {
+			int n = __builtin_ctz(hit);
+			*line += __builtin_popcount(newlines & ((1u << n) - 1));
+			return p + n;
+		}
+		*line += __builtin_popcount(newlines);
+		p += 16;
+	}
+	return scalarQuote(p, end, line);
+}
+
+static ScanKernels sse2Scan = {
+	"sse2", sse2Spaces, sse2LineEnd, sse2Quote
+};
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static char *avx2Spaces(char *p, char *end, int *line) {
+	__m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+	__m256i cr = _mm256_set1_epi8('\r'), nl = _mm256_set1_epi8('\n');
+	while(end - p >= 32) {
+		__m256i b = _mm256_loadu_si256((__m256i *)p);
+		uint32_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl));
+		__m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(b, space),
+			_mm256_or_si256(_mm256_cmpeq_epi8(b, tab), _mm256_cmpeq_epi8(b, cr)));
+		uint32_t spaces = (uint32_t)_mm256_movemask_epi8(blank) | newlines;
+		if(spaces != 0xffffffffu) {
+			int n = __builtin_ctz(~spaces);
+			*line += __builtin_popcount(newlines & ((1u << n) - 1));
+			return p + n;
+		}
+		*line += __builtin_popcount(newlines);
+		p += 32;
+	}
+	return sse2Spaces(p, end, line);
+}
+
+AVX2 static char *avx2LineEnd(char *p, char *end) {
+	__m256i nl = _mm256_set1_epi8('\n');
+	while(end - p >= 32) {
+		__m256i b = _mm256_loadu_si256((__m256i *)p);
+		uint32_t hit = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl));
+		if(hit) return p + __builtin_ctz(hit);
+		p += 32;
+	}
+	return sse2LineEnd(p, end);
+}
+
+AVX2 static char *avx2Quote(char *p, char *end, int *line) {
+	__m256i quote = _mm256_set1_epi8('"'), nl = _mm256_set1_epi8('\n');
+	while(end - p >= 32) {
+		__m256i b = _mm256_loadu_si256((__m256i *)p);
+		uint32_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl));
+		uint32_t hit = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, quote));
+		if(hit) {
+			int n = __builtin_ctz(hit);
+			*line += __builtin_popcount(newlines & ((1u << n) - 1));
+			return p + n;
+		}
+		*line += __builtin_popcount(newlines);
+		p += 32;
+	}
+	return sse2Quote(p, end, line);
+}
+
+static ScanKernels avx2Scan = {
+	"avx2", avx2Spaces, avx2LineEnd, avx2Quote
+};
+
+#endif
+
+static ScanKernels *scan = NULL;
+static pthread_once_t scanOnce = PTHREAD_ONCE_INIT;
+
+// same choice as the f64 kernels, CLOX_SIMD can only ask for less. compileBatch
+// threads can be the first to scan, so it's made exactly once
+static void selectScan() {
+	char *forced = getenv("CLOX_SIMD");
+	if(forced != NULL && !strcmp(forced, "scalar")) {
+		scan = &scalarScan;
+		return;
+	}
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	bool avx2 = __builtin_cpu_supports("avx2");
+	if(forced != NULL && !strcmp(forced, "sse2")) avx2 = false;
+	scan = avx2 ? &avx2Scan : &sse2Scan;
+#else
+	scan = &scalarScan;
+#endif
+}
+
+void initScanner(Scanner *scanner, char *source) {
+	pthread_once(&scanOnce, selectScan);
+	scanner->start = source;
+	scanner->current = source;
+	// the first NUL ends the source, same as before, but the kernels need a bound
+	scanner->end = source + strlen(source);
+	scanner->line = 1;
+}
+
+static Token makeToken(Scanner *scanner, TokenType type) {
 	Token token;
 	token.type = type;
-	token.start = scanner.start;
-	token.length = (int)(scanner.current-scanner.start);
-	token.line = scanner.line;
+	token.start = scanner->start;
+	token.length = (int)(scanner->current-scanner->start);
+	token.line = scanner->line;
 	return token;
 }
 
-static Token errorToken(char *msg) {
+static Token errorToken(Scanner *scanner, char *msg) {
 	Token token;
 	token.type = TOKEN_ERROR;
 	token.start = msg;
 	token.length = (int)strlen(msg);
-	token.line = scanner.line;
+	token.line = scanner->line;
 	return token;
 }
 
-static bool isAtEnd() {
-	return (*scanner.current == '\0');
+static bool isAtEnd(Scanner *scanner) {
+	return (*scanner->current == '\0');
 }
 
-static char advance() {
-	return *(scanner.current++);
+static char advance(Scanner *scanner) {
+	return *(scanner->current++);
 }
 
-static char peek() {
-	return *scanner.current;
+static char peek(Scanner *scanner) {
+	return *scanner->current;
 }
 
-static char peekNext() {
-	if(isAtEnd()) return '\0';
-	return *(scanner.current+1);
+static char peekNext(Scanner *scanner) {
+	if(isAtEnd(scanner)) return '\0';
+	return *(scanner->current+1);
 }
 
-static bool match(char c) {
-	if(isAtEnd()) return false;
+static bool match(Scanner *scanner, char c) {
+	if(isAtEnd(scanner)) return false;
 
-	if(*scanner.current == c) {
-		scanner.current++;
+	if(*scanner->current == c) {
+		scanner->current++;
 		return true;
 	}
 	return false;
 }
 
 static bool isDigit(char c) {
-	return (c >= '0' && c <= '9');
+	return CLASS(c) & CLASS_DIGIT;
 }
 
 static bool isAlpha(char c) {
-	return (c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'));
+	return CLASS(c) & CLASS_ALPHA;
 }
 
-static void skipWhiteSpaces() {
+static void skipWhiteSpaces(Scanner *scanner) {
 	while(1) {
-		char c = peek();
-		switch(c) {
-			case ' ':
-			case '\r':
-			case '\t':
-				advance();
-				break;
-			case '\n':
-				scanner.line++;
-				advance();
-				break;
-			case '/':
-				if(peekNext() == '/') {
-					while(peek() != '\n' && !isAtEnd()) advance();
-				} else {
-					return;
-				}
-				break;
-			default:
-				return;
+		char c = peek(scanner);
+		if(c == ' ' && !(CLASS(scanner->current[1]) & CLASS_SPACE)) {
+			// the single space between tokens isn't worth a kernel call
+			scanner->current++;
+		} else if(CLASS(c) & CLASS_SPACE) {
+			scanner->current = scan->spaces(scanner->current, scanner->end, &scanner->line);
+		} else if(c == '/' && peekNext(scanner) == '/') {
+			scanner->current = scan->lineEnd(scanner->current, scanner->end);
+		} else {
+			return;
 		}
 	}
 }
 
-static Token string() {
-	while(peek() != '"') {
-		if(isAtEnd()) return errorToken("unterminated string");
-		if(peek() == '\n') scanner.line++;
-		advance();
-	}
-	advance();
-	return makeToken(TOKEN_STRING);
+static Token string(Scanner *scanner) {
+	scanner->current = scan->quote(scanner->current, scanner->end, &scanner->line);
+	if(isAtEnd(scanner)) return errorToken(scanner, "unterminated string");
+	advance(scanner);
+	return makeToken(scanner, TOKEN_STRING);
 }
 
-static Token number() {
-	while(isDigit(peek()) && !isAtEnd()) advance();
-	if(peek() == '.' && isDigit(peekNext())) {
-		advance();
-		while(isDigit(peek())) advance();
+// powers of ten a double holds exactly
+static const double exactPowers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// digits go into a 64 bit mantissa as they are scanned. when the mantissa fits
+// in 53 bits and there are at most 22 fraction digits, one division of two exact
+// doubles is correctly rounded; anything longer goes to strtod
+static Token number(Scanner *scanner) {
+	uint64_t mantissa = 0;
+	int digits = 0, fraction = 0;
+	char *p = scanner->start;
+	while(isDigit(*p)) {
+		if(mantissa != 0 || *p != '0') {
+			if(digits < 19) mantissa = mantissa*10 + (uint64_t)(*p - '0');
+			digits++;
+		}
+		p++;
+	}
+	if(*p == '.' && isDigit(p[1])) {
+		p++;
+		while(isDigit(*p)) {
+			if(mantissa != 0 || *p != '0') {
+				if(digits < 19) mantissa = mantissa*10 + (uint64_t)(*p - '0');
+				digits++;
+			}
+			fraction++;
+			p++;
+		}
 	}
-	return makeToken(TOKEN_NUMBER);
+	scanner->current = p;
+	Token token = makeToken(scanner, TOKEN_NUMBER);
+	if(digits <= 19 && fraction == 0) {
+		token.number = (double)mantissa;
+	} else if(digits <= 19 && fraction <= 22 && mantissa <= (1ull << 53)) {
+		token.number = (double)mantissa / exactPowers[fraction];
+	} else {
+		token.number = strtod(scanner->start, NULL);
+	}
+	return token;
 }
 
-static TokenType checkKeyword(int s, int len, char *cmp, TokenType ret) {
-	if((scanner.current - scanner.start == len+s) && memcmp(scanner.start+s, cmp, len) == 0) return ret;
+static TokenType checkKeyword(Scanner *scanner, int s, int len, char *cmp, TokenType ret) {
+	if((scanner->current - scanner->start == len+s) && memcmp(scanner->start+s, cmp, len) == 0) return ret;
 	return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-	switch(*scanner.start) {
-		case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+static TokenType identifierType(Scanner *scanner) {
+	switch(*scanner->start) {
+		case 'a': return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
+    case 'c': return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+    case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
+    case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+    case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+    case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+    case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+    case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+    case 'y': return checkKeyword(scanner, 1, 4, "ield", TOKEN_YIELD);
+		case 'r':
+			if(scanner->current - scanner->start > 2 && scanner->start[1] == 'e') {
+				switch (scanner->start[2]) {
+          case 's': return checkKeyword(scanner, 3, 3, "ume", TOKEN_RESUME);
+          case 't': return checkKeyword(scanner, 3, 3, "urn", TOKEN_RETURN);
+        }
+			}
+			break;
+		case 's':
+			if(scanner->current - scanner->start > 1) {
+				switch (scanner->start[1]) {
+          case 'p': return checkKeyword(scanner, 2, 3, "awn", TOKEN_SPAWN);
+          case 'u': return checkKeyword(scanner, 2, 3, "per", TOKEN_SUPER);
+        }
+			}
+			break;
 		case 'f':
-			if(scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
-          case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+			if(scanner->current - scanner->start > 1) {
+				switch (scanner->start[1]) {
+          case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+          case 'o': return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+          case 'u': return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
+        }
+			}
+			break;
+		case 'i':
+			if(scanner->current - scanner->start > 1) {
+				switch (scanner->start[1]) {
+          case 'f': return checkKeyword(scanner, 2, 0, "", TOKEN_IF);
+          case 'm': return checkKeyword(scanner, 2, 4, "port", TOKEN_IMPORT);
+          case 'n': return checkKeyword(scanner, 2, 0, "", TOKEN_IN);
         }
 			}
 			break;
 		case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+      if (scanner->current - scanner->start > 1) {
+        switch (scanner->start[1]) {
+          case 'h': return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+          case 'r': return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
         }
       }
       break;
@@ -152,40 +379,43 @@ static TokenType identifierType() {
 	return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-	while(isAlpha(peek()) || isDigit(peek())) advance();
-	return makeToken(identifierType());
+static Token identifier(Scanner *scanner) {
+	while(CLASS(peek(scanner)) & (CLASS_ALPHA | CLASS_DIGIT)) advance(scanner);
+	return makeToken(scanner, identifierType(scanner));
 }
 
-Token scanToken() {
-	skipWhiteSpaces();
-	scanner.start = scanner.current;
-	if(isAtEnd()) return makeToken(TOKEN_EOF);
-	char c = advance();
-	if(isDigit(c)) return number();
-	if(isAlpha(c)) return identifier();
+Token scanToken(Scanner *scanner) {
+	skipWhiteSpaces(scanner);
+	scanner->start = scanner->current;
+	if(isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
+	char c = advance(scanner);
+	if(isDigit(c)) return number(scanner);
+	if(isAlpha(c)) return identifier(scanner);
   switch(c) {
-    case '(': return makeToken(TOKEN_LEFT_PAREN);
-    case ')': return makeToken(TOKEN_RIGHT_PAREN);
-    case '{': return makeToken(TOKEN_LEFT_BRACE);
-    case '}': return makeToken(TOKEN_RIGHT_BRACE);
-    case ';': return makeToken(TOKEN_SEMICOLON);
-    case ',': return makeToken(TOKEN_COMMA);
-    case '.': return makeToken(TOKEN_DOT);
-    case '-': return makeToken(TOKEN_MINUS);
-    case '+': return makeToken(TOKEN_PLUS);
-    case '/': return makeToken(TOKEN_SLASH);
-    case '*': return makeToken(TOKEN_STAR);
+    case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+    case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+    case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+    case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+    case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+    case ':': return makeToken(scanner, TOKEN_COLON);
+    case ',': return makeToken(scanner, TOKEN_COMMA);
+    case '.': return makeToken(scanner, TOKEN_DOT);
+    case '-': return makeToken(scanner, TOKEN_MINUS);
+    case '+': return makeToken(scanner, TOKEN_PLUS);
+    case '/': return makeToken(scanner, TOKEN_SLASH);
+    case '*': return makeToken(scanner, TOKEN_STAR);
 		case '!':
-      return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+      return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-      return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+      return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-      return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+      return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-      return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-		case '"': return string();
+      return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+		case '"': return string(scanner);
 
   }
-	return errorToken("Unexpected character.");
+	return errorToken(scanner, "Unexpected character.");
 }
@@ -7,7 +7,8 @@ typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   // One or two character tokens.
   TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -18,9 +19,9 @@ typedef enum {
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
   // Keywords.
   TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-  TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-  TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
-  TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+  TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_IMPORT, TOKEN_IN, TOKEN_NIL, TOKEN_OR,
+  TOKEN_PRINT, TOKEN_RESUME, TOKEN_RETURN, TOKEN_SPAWN, TOKEN_SUPER,
+  TOKEN_THIS, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_YIELD,
 
   TOKEN_ERROR, TOKEN_EOF
 } TokenType;
@@ -31,10 +32,18 @@ typedef struct {
 	char *start;
 	int length;
 	int line;
+	double number; // value of a TOKEN_NUMBER, parsed while scanning
 } Token;
 
-void initScanner(char *source);
-Token scanToken();
+typedef struct {
+	char *start;
+	char *current;
+	char *end;
+	int line;
+} Scanner;
+
+void initScanner(Scanner *, char *source);
+Token scanToken(Scanner *);
 
 
 #endif
@@ -0,0 +1,151 @@
+#include "server.h"
+#include "compiler.h"
+#include "memory.h"
+#include "cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// one request per connection. the client sends either
+//   run <path>\n           run a script file, its chunk is cached by path and source hash
+//   eval\n<source>         run the source sent until the client shuts down its write side
+// and reads back the script's stdout followed by a final line "exit <status>",
+// status being the same code the command line interpreter exits with.
+
+#define REQUEST_LINE_MAX 4096
+
+static bool readLine(int fd, char *line, int size) {
+	int length = 0;
+	char c;
+	while(read(fd, &c, 1) == 1) {
+		if(c == '\n') {
+			line[length] = '\0';
+			return true;
+		}
+		if(length == size - 1) return false;
+		line[length++] = c;
+	}
+	return false;
+}
+
+static char *readRest(int fd) {
+	int capacity = 0;
+	int length = 0;
+	char *buffer = NULL;
+	while(1) {
+		if(capacity - length < 4096) {
+			int oldCapacity = capacity;
+			capacity = GROW_CAPACITY(capacity + 4096);
+			buffer = GROW_ARRAY(char, buffer, oldCapacity, capacity);
+		}
+		ssize_t bytesRead = read(fd, buffer + length, capacity - length - 1);
+		if(bytesRead <= 0) break;
+		length += bytesRead;
+	}
+	buffer[length] = '\0';
+	return buffer;
+}
+
+static int exitStatus(InterpretResult result) {
+	switch(result) {
+		case INTERPRET_COMPILE_ERROR: return 65;
+		case INTERPRET_RUNTIME_ERROR: return 70;
+		default: return 0;
+	}
+}
+
+static int runPath(VM *vm, Table *scripts, char *path) {
+	Mapping mapping = {NULL, 0};
+	char *source = loadSource(path, &mapping);
+	if(source == NULL) {
+		printf("Could not open file %s\n", path);
+		return 74;
+	}
+	int length = (int)strlen(source);
+	uint32_t hash = hashString(source, length);
+	ObjString *key = copyString(vm, path, (int)strlen(path));
+	ObjModule *script;
+	Value cached;
+	if(tableGet(scripts, key, &cached)) {
+		script = AS_MODULE(cached);
+	} else {
+		script = newModule(vm, key);
+		tableSet(scripts, key, OBJ_VAL(script));
+	}
+	InterpretResult result = INTERPRET_OK;
+	if(script->sourceHash != hash || script->chunk->count == 0) {
+		freeChunk(script->chunk);
+		script->sourceHash = hash;
+		if(!compile(vm, script->chunk, source)) {
+			freeChunk(script->chunk);
+			script->sourceHash = 0;
+			result = INTERPRET_COMPILE_ERROR;
+		}
+	}
+	releaseSource(source, &mapping);
+	if(result == INTERPRET_OK) result = interpretChunk(vm, script->chunk);
+	return exitStatus(result);
+}
+
+static void handle(VM *vm, Table *scripts, int client) {
+	char line[REQUEST_LINE_MAX];
+	if(!readLine(client, line, sizeof(line))) return;
+	Obj *mark = vm->objects;
+
+	// the script writes through stdio, point stdout at the client while it runs
+	fflush(stdout);
+	int savedStdout = dup(STDOUT_FILENO);
+	dup2(client, STDOUT_FILENO);
+	int status;
+	if(!strncmp(line, "run ", 4)) {
+		status = runPath(vm, scripts, line + 4);
+	} else if(!strcmp(line, "eval")) {
+		char *source = readRest(client);
+		status = exitStatus(interpret(vm, source));
+		FREE_ARRAY(char, source, strlen(source)+1);
+	} else {
+		printf("Unknown request '%s'\n", line);
+		status = 64;
+	}
+	printf("exit %d\n", status);
+	fflush(stdout);
+	dup2(savedStdout, STDOUT_FILENO);
+	close(savedStdout);
+	resetVM(vm);
+	freeObjectsSince(vm, mark, scripts);
+}
+
+bool serve(VM *vm, char *socketPath) {
+	struct sockaddr_un address;
+	if(strlen(socketPath) >= sizeof(address.sun_path)) {
+		printf("Socket path too long %s\n", socketPath);
+		return false;
+	}
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(server < 0) return false;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+	unlink(socketPath);
+	if(bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, 64) != 0) {
+		printf("Could not listen on %s\n", socketPath);
+		close(server);
+		return false;
+	}
+	// a client hanging up mid response must not take the daemon down
+	signal(SIGPIPE, SIG_IGN);
+	Table scripts;
+	initTable(&scripts);
+	while(1) {
+		int client = accept(server, NULL, NULL);
+		if(client < 0) continue;
+		handle(vm, &scripts, client);
+		close(client);
+	}
+	freeTable(&scripts);
+	close(server);
+	return true;
+}
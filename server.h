@@ -0,0 +1,8 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "vm.h"
+
+bool serve(VM *vm, char *socketPath);
+
+#endif
@@ -0,0 +1,551 @@
+#include "snapshot.h"
+#include "memory.h"
+#include "f64.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// image layout, using the value and chunk encodings from cache.c:
+//   header   "LOXS", version, string, object, global and module counts
+//   strings  every interned string
+//   objects  type and what it takes to allocate each object, then each one's contents
+//   globals  name, value
+//   modules  path, source hash, code, constants
+// strings are reinterned on load, which relocates every reference to them. every
+// other object reachable from a global or a module's constants gets a number and is
+// written once, a value pointing at one is TAG_OBJECT and that number, so sharing
+// and cycles survive. that includes functions: a function's code goes with its
+// allocation and its constants with its contents, so a closure in a global and the
+// chunk constant it was made from stay one function. allocation only ever needs an
+// object numbered before it, contents can point anywhere. bytecode is used in place
+// from the mapping.
+
+#define TAG_OBJECT 0x100 // past every tag cache.c writes
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t stringCount;
+	uint32_t objectCount;
+	uint32_t globalCount;
+	uint32_t moduleCount;
+} SnapshotHeader;
+
+// every object going into the image in number order, and each one's number
+typedef struct {
+	ValueArray objects;
+	Table numbers;
+} Graph;
+
+// natives are defined again by initVM, only a global that no longer holds the
+// native it started with goes into the image
+static bool isSnapshotEntry(VM *vm, Entry *entry) {
+	if(IS_EMPTY_KEY(entry->key)) return false;
+	Value native;
+	if(!tableGetValue(&vm->natives, entry->key, &native)) return true;
+	return !IS_OBJ(entry->value) || AS_OBJ(entry->value) != AS_OBJ(native);
+}
+
+static uint32_t liveEntries(VM *vm, Table *table) {
+	uint32_t count = 0;
+	for(int i=0;i<table->used;i++) {
+		if(isSnapshotEntry(vm, &table->entries[i])) count++;
+	}
+	return count;
+}
+
+static bool numbered(Value value) {
+	return IS_OBJ(value) && !IS_STRING(value);
+}
+
+static bool addObject(Graph *graph, Value value) {
+	Value number;
+	if(!numbered(value) || tableGetValue(&graph->numbers, value, &number)) return true;
+	Obj *obj = AS_OBJ(value);
+	switch(obj->type) {
+		case OBJ_FIBER:
+			if(((ObjFiber *)obj)->done) break;
+			printf("A snapshot can't hold a fiber that hasn't finished.\n");
+			return false;
+		case OBJ_UPVALUE:
+			if(((ObjUpvalue *)obj)->location == &((ObjUpvalue *)obj)->closed) break;
+			printf("A snapshot can't hold a variable captured from a running frame.\n");
+			return false;
+		case OBJ_MODULE:
+		case OBJ_SHAPE:
+			printf("A snapshot can't hold a module or a shape.\n");
+			return false;
+		// the object an allocation needs goes first
+		case OBJ_INSTANCE: addObject(graph, OBJ_VAL(((ObjInstance *)obj)->klass)); break;
+		case OBJ_CLOSURE: addObject(graph, OBJ_VAL(((ObjClosure *)obj)->function)); break;
+		default: break;
+	}
+	tableSetValue(&graph->numbers, value, NUMBER_VAL(graph->objects.count));
+	writeValueArray(&graph->objects, value);
+	return true;
+}
+
+static bool addTable(Graph *graph, Table *table) {
+	for(int i=0;i<table->used;i++) {
+		Entry *entry = &table->entries[i];
+		if(IS_EMPTY_KEY(entry->key)) continue;
+		if(!addObject(graph, entry->key) || !addObject(graph, entry->value)) return false;
+	}
+	return true;
+}
+
+static bool addConstants(Graph *graph, Chunk *chunk) {
+	for(int i=0;i<chunk->varr.count;i++) {
+		if(!addObject(graph, chunk->varr.values[i])) return false;
+	}
+	return true;
+}
+
+static bool addChildren(Graph *graph, Obj *obj) {
+	switch(obj->type) {
+		case OBJ_LIST: {
+			ValueArray *items = &((ObjList *)obj)->items;
+			for(int i=0;i<items->count;i++) {
+				if(!addObject(graph, items->values[i])) return false;
+			}
+			return true;
+		}
+		case OBJ_MAP: return addTable(graph, &((ObjMap *)obj)->table);
+		case OBJ_CLASS:
+			return addTable(graph, &((ObjClass *)obj)->methods) && addObject(graph, ((ObjClass *)obj)->initializer);
+		case OBJ_INSTANCE: {
+			ObjInstance *instance = (ObjInstance *)obj;
+			for(int i=0;i<instance->shape->fieldCount;i++) {
+				if(!addObject(graph, instance->fields[i])) return false;
+			}
+			return true;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure *closure = (ObjClosure *)obj;
+			for(int i=0;i<closure->upvalueCount;i++) {
+				if(!addObject(graph, OBJ_VAL(closure->upvalues[i]))) return false;
+			}
+			return true;
+		}
+		case OBJ_UPVALUE: return addObject(graph, ((ObjUpvalue *)obj)->closed);
+		case OBJ_BOUND_METHOD:
+			return addObject(graph, ((ObjBoundMethod *)obj)->receiver) && addObject(graph, ((ObjBoundMethod *)obj)->method);
+		case OBJ_FUNCTION: return addConstants(graph, &((ObjFunction *)obj)->chunk);
+		default: return true;
+	}
+}
+
+// breadth first from the globals and module constants, objects found along the way
+// are appended to the walk
+static bool collectGraph(VM *vm, Graph *graph) {
+	for(int i=0;i<vm->globals.used;i++) {
+		Entry *entry = &vm->globals.entries[i];
+		if(isSnapshotEntry(vm, entry) && !addObject(graph, entry->value)) return false;
+	}
+	for(int i=0;i<vm->modules.used;i++) {
+		Entry *entry = &vm->modules.entries[i];
+		if(!IS_EMPTY_KEY(entry->key) && !addConstants(graph, AS_MODULE(entry->value)->chunk)) return false;
+	}
+	for(int i=0;i<graph->objects.count;i++) {
+		if(!addChildren(graph, AS_OBJ(graph->objects.values[i]))) return false;
+	}
+	return true;
+}
+
+static void writeU32(FILE *file, uint32_t value) {
+	fwrite(&value, sizeof(value), 1, file);
+}
+
+static uint32_t numberOf(Graph *graph, Value value) {
+	Value number;
+	tableGetValue(&graph->numbers, value, &number);
+	return (uint32_t)AS_NUMBER(number);
+}
+
+static bool writeGraphValue(FILE *file, Graph *graph, Value value) {
+	if(!numbered(value)) return serializeValue(file, value);
+	writeU32(file, TAG_OBJECT);
+	writeU32(file, numberOf(graph, value));
+	return true;
+}
+
+static bool writeTable(FILE *file, Graph *graph, Table *table) {
+	writeU32(file, (uint32_t)table->count);
+	bool ok = true;
+	for(int i=0;i<table->used && ok;i++) {
+		Entry *entry = &table->entries[i];
+		if(IS_EMPTY_KEY(entry->key)) continue;
+		ok = writeGraphValue(file, graph, entry->key) && writeGraphValue(file, graph, entry->value);
+	}
+	return ok;
+}
+
+static bool writeConstants(FILE *file, Graph *graph, Chunk *chunk) {
+	bool ok = true;
+	for(int i=0;i<chunk->varr.count && ok;i++) ok = writeGraphValue(file, graph, chunk->varr.values[i]);
+	return ok;
+}
+
+static bool writeAllocation(FILE *file, Graph *graph, Obj *obj) {
+	writeU32(file, obj->type);
+	switch(obj->type) {
+		case OBJ_FUNCTION: return serializeFunctionCode(file, (ObjFunction *)obj);
+		case OBJ_NATIVE: return serializeValue(file, OBJ_VAL(((ObjNative *)obj)->name));
+		case OBJ_CLASS: return serializeValue(file, OBJ_VAL(((ObjClass *)obj)->name));
+		case OBJ_INSTANCE: writeU32(file, numberOf(graph, OBJ_VAL(((ObjInstance *)obj)->klass))); return true;
+		case OBJ_CLOSURE: writeU32(file, numberOf(graph, OBJ_VAL(((ObjClosure *)obj)->function))); return true;
+		case OBJ_F64_ARRAY: {
+			ObjF64Array *array = (ObjF64Array *)obj;
+			writeU32(file, (uint32_t)array->count);
+			fwrite(array->values, sizeof(double), array->count, file);
+			return true;
+		}
+		default: return true;
+	}
+}
+
+static bool writeContents(FILE *file, Graph *graph, Obj *obj) {
+	switch(obj->type) {
+		case OBJ_LIST: {
+			ValueArray *items = &((ObjList *)obj)->items;
+			writeU32(file, (uint32_t)items->count);
+			bool ok = true;
+			for(int i=0;i<items->count && ok;i++) ok = writeGraphValue(file, graph, items->values[i]);
+			return ok;
+		}
+		case OBJ_MAP: return writeTable(file, graph, &((ObjMap *)obj)->table);
+		case OBJ_CLASS:
+			return writeTable(file, graph, &((ObjClass *)obj)->methods) &&
+				writeGraphValue(file, graph, ((ObjClass *)obj)->initializer);
+		case OBJ_INSTANCE: {
+			// names in slot order, the loader rebuilds the shape chain from the class's root
+			ObjInstance *instance = (ObjInstance *)obj;
+			int count = instance->shape->fieldCount;
+			writeU32(file, (uint32_t)count);
+			ObjShape **chain = ALLOCATE(ObjShape *, count);
+			for(ObjShape *shape = instance->shape; shape->parent != NULL; shape = shape->parent) {
+				chain[shape->fieldCount - 1] = shape;
+			}
+			bool ok = true;
+			for(int i=0;i<count && ok;i++) {
+				ok = serializeValue(file, OBJ_VAL(chain[i]->name)) && writeGraphValue(file, graph, instance->fields[i]);
+			}
+			FREE_ARRAY(ObjShape *, chain, count);
+			return ok;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure *closure = (ObjClosure *)obj;
+			for(int i=0;i<closure->upvalueCount;i++) writeU32(file, numberOf(graph, OBJ_VAL(closure->upvalues[i])));
+			return true;
+		}
+		case OBJ_UPVALUE: return writeGraphValue(file, graph, ((ObjUpvalue *)obj)->closed);
+		case OBJ_BOUND_METHOD:
+			return writeGraphValue(file, graph, ((ObjBoundMethod *)obj)->receiver) &&
+				writeGraphValue(file, graph, ((ObjBoundMethod *)obj)->method);
+		case OBJ_FUNCTION: return writeConstants(file, graph, &((ObjFunction *)obj)->chunk);
+		default: return true;
+	}
+}
+
+bool writeSnapshot(VM *vm, char *path) {
+	Graph graph;
+	initValueArray(&graph.objects);
+	initTable(&graph.numbers);
+	if(!collectGraph(vm, &graph)) {
+		freeValueArray(&graph.objects);
+		freeTable(&graph.numbers);
+		return false;
+	}
+	FILE *file = fopen(path, "wb");
+	bool ok = file != NULL;
+	if(ok) {
+		SnapshotHeader header;
+		memcpy(header.magic, "LOXS", 4);
+		header.version = SNAPSHOT_VERSION;
+		header.stringCount = (uint32_t)vm->strings.count;
+		header.objectCount = (uint32_t)graph.objects.count;
+		header.globalCount = liveEntries(vm, &vm->globals);
+		header.moduleCount = (uint32_t)vm->modules.count;
+		fwrite(&header, sizeof(header), 1, file);
+	}
+	for(int i=0;i<vm->strings.used && ok;i++) {
+		Entry *entry = &vm->strings.entries[i];
+		if(!IS_EMPTY_KEY(entry->key)) ok = serializeValue(file, entry->key);
+	}
+	for(int i=0;i<graph.objects.count && ok;i++) {
+		ok = writeAllocation(file, &graph, AS_OBJ(graph.objects.values[i]));
+	}
+	for(int i=0;i<graph.objects.count && ok;i++) {
+		ok = writeContents(file, &graph, AS_OBJ(graph.objects.values[i]));
+	}
+	for(int i=0;i<vm->globals.used && ok;i++) {
+		Entry *entry = &vm->globals.entries[i];
+		if(!isSnapshotEntry(vm, entry)) continue;
+		ok = serializeValue(file, entry->key) && writeGraphValue(file, &graph, entry->value);
+	}
+	for(int i=0;i<vm->modules.used && ok;i++) {
+		Entry *entry = &vm->modules.entries[i];
+		if(IS_EMPTY_KEY(entry->key)) continue;
+		ObjModule *module = AS_MODULE(entry->value);
+		ok = serializeValue(file, OBJ_VAL(module->path)) &&
+			fwrite(&module->sourceHash, sizeof(module->sourceHash), 1, file) == 1;
+		if(ok) serializeCode(file, module->chunk);
+		ok = ok && writeConstants(file, &graph, module->chunk);
+	}
+	if(file != NULL && fclose(file) != 0) ok = false;
+	if(!ok && file != NULL) remove(path);
+	freeValueArray(&graph.objects);
+	freeTable(&graph.numbers);
+	return ok;
+}
+
+static bool readString(VM *vm, uint8_t **cursor, uint8_t *end, ObjString **string) {
+	Value value;
+	if(!deserializeValue(vm, cursor, end, &value) || !IS_STRING(value)) return false;
+	*string = AS_STRING(value);
+	return true;
+}
+
+static bool readU32(uint8_t **cursor, uint8_t *end, uint32_t *out) {
+	if((size_t)(end - *cursor) < sizeof(*out)) return false;
+	memcpy(out, *cursor, sizeof(*out));
+	*cursor += sizeof(*out);
+	return true;
+}
+
+// the objects allocated so far, a value may point at any of them
+typedef struct {
+	Value *values;
+	uint32_t *constantCounts; // a function's, from its code header, read with its contents
+	uint32_t count;
+} Loaded;
+
+static bool readObject(uint8_t **cursor, uint8_t *end, Loaded *loaded, ObjType type, Value *value) {
+	uint32_t number;
+	if(!readU32(cursor, end, &number) || number >= loaded->count) return false;
+	*value = loaded->values[number];
+	return OBJ_TYPE((*value)) == type;
+}
+
+static bool readGraphValue(VM *vm, uint8_t **cursor, uint8_t *end, Loaded *loaded, Value *value) {
+	uint32_t tag;
+	if((size_t)(end - *cursor) < sizeof(tag)) return false;
+	memcpy(&tag, *cursor, sizeof(tag));
+	if(tag != TAG_OBJECT) return deserializeValue(vm, cursor, end, value);
+	*cursor += sizeof(tag);
+	uint32_t number;
+	if(!readU32(cursor, end, &number) || number >= loaded->count) return false;
+	*value = loaded->values[number];
+	return true;
+}
+
+// what a chunk constant can be: what the cache format writes, with functions numbered
+static bool readConstants(VM *vm, uint8_t **cursor, uint8_t *end, Loaded *loaded, Chunk *chunk, uint32_t count, ObjFunction *owner) {
+	for(uint32_t i=0;i<count;i++) {
+		Value value;
+		if(!readGraphValue(vm, cursor, end, loaded, &value) || (IS_OBJ(value) && !IS_STRING(value) && !IS_FUNCTION(value))) return false;
+		writeValueArray(&chunk->varr, value);
+	}
+	return validateChunk(chunk, owner);
+}
+
+static bool readTable(VM *vm, uint8_t **cursor, uint8_t *end, Loaded *loaded, Table *table, bool namesOnly) {
+	uint32_t count;
+	if(!readU32(cursor, end, &count)) return false;
+	for(uint32_t i=0;i<count;i++) {
+		Value key, value;
+		if(!readGraphValue(vm, cursor, end, loaded, &key) || !readGraphValue(vm, cursor, end, loaded, &value)) return false;
+		if(namesOnly && !IS_STRING(key)) return false;
+		tableSetValue(table, key, value);
+	}
+	return true;
+}
+
+static bool readAllocation(VM *vm, uint8_t **cursor, uint8_t *end, Loaded *loaded, Value *value) {
+	uint32_t type;
+	if(!readU32(cursor, end, &type)) return false;
+	switch(type) {
+		case OBJ_FUNCTION: {
+			ObjFunction *function = deserializeFunctionCode(vm, cursor, end, &loaded->constantCounts[loaded->count]);
+			if(function == NULL) return false;
+			*value = OBJ_VAL(function);
+			return true;
+		}
+		case OBJ_NATIVE: {
+			// the same native initVM defined in this run
+			ObjString *name;
+			if(!readString(vm, cursor, end, &name) || !tableGet(&vm->natives, name, value)) return false;
+			return IS_NATIVE(*value);
+		}
+		case OBJ_CLASS: {
+			ObjString *name;
+			if(!readString(vm, cursor, end, &name)) return false;
+			*value = OBJ_VAL(newClass(vm, name));
+			return true;
+		}
+		case OBJ_INSTANCE: {
+			Value klass;
+			if(!readObject(cursor, end, loaded, OBJ_CLASS, &klass)) return false;
+			*value = OBJ_VAL(newInstance(vm, AS_CLASS(klass)));
+			return true;
+		}
+		case OBJ_CLOSURE: {
+			Value function;
+			if(!readObject(cursor, end, loaded, OBJ_FUNCTION, &function)) return false;
+			ObjClosure *closure = newClosure(vm, AS_FUNCTION(function));
+			for(int i=0;i<closure->upvalueCount;i++) closure->upvalues[i] = NULL;
+			*value = OBJ_VAL(closure);
+			return true;
+		}
+		case OBJ_UPVALUE: {
+			ObjUpvalue *upvalue = newUpvalue(vm, NULL);
+			upvalue->location = &upvalue->closed;
+			*value = OBJ_VAL(upvalue);
+			return true;
+		}
+		case OBJ_F64_ARRAY: {
+			uint32_t count;
+			if(!readU32(cursor, end, &count) || (size_t)(end - *cursor) / sizeof(double) < count) return false;
+			ObjF64Array *array = newF64Array(vm, (int)count);
+			if(count > 0) memcpy(array->values, *cursor, sizeof(double) * count);
+			*cursor += sizeof(double) * count;
+			*value = OBJ_VAL(array);
+			return true;
+		}
+		case OBJ_FIBER: {
+			ObjFiber *fiber = newFiber(vm, NULL, NULL, NULL, FIBER_STACK_INITIAL);
+			fiber->done = true;
+			*value = OBJ_VAL(fiber);
+			return true;
+		}
+		case OBJ_LIST: *value = OBJ_VAL(newList(vm)); return true;
+		case OBJ_MAP: *value = OBJ_VAL(newMap(vm)); return true;
+		case OBJ_BOUND_METHOD: *value = OBJ_VAL(newBoundMethod(vm, NIL_VAL, NIL_VAL)); return true;
+		default: return false;
+	}
+}
+
+static bool readContents(VM *vm, uint8_t **cursor, uint8_t *end, Loaded *loaded, uint32_t number) {
+	Obj *obj = AS_OBJ(loaded->values[number]);
+	switch(obj->type) {
+		case OBJ_LIST: {
+			uint32_t count;
+			if(!readU32(cursor, end, &count)) return false;
+			for(uint32_t i=0;i<count;i++) {
+				Value item;
+				if(!readGraphValue(vm, cursor, end, loaded, &item)) return false;
+				writeValueArray(&((ObjList *)obj)->items, item);
+			}
+			return true;
+		}
+		case OBJ_MAP: return readTable(vm, cursor, end, loaded, &((ObjMap *)obj)->table, false);
+		case OBJ_CLASS: {
+			ObjClass *klass = (ObjClass *)obj;
+			return readTable(vm, cursor, end, loaded, &klass->methods, true) &&
+				readGraphValue(vm, cursor, end, loaded, &klass->initializer);
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance *instance = (ObjInstance *)obj;
+			uint32_t count;
+			if(!readU32(cursor, end, &count) || count > (size_t)(end - *cursor)) return false;
+			instance->fields = ALLOCATE(Value, count);
+			instance->fieldCapacity = (int)count;
+			for(uint32_t i=0;i<count;i++) {
+				ObjString *name;
+				if(!readString(vm, cursor, end, &name) || shapeFind(instance->shape, name) != -1) return false;
+				instance->shape = shapeTransition(vm, instance->shape, name);
+				if(!readGraphValue(vm, cursor, end, loaded, &instance->fields[i])) return false;
+			}
+			return true;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure *closure = (ObjClosure *)obj;
+			for(int i=0;i<closure->upvalueCount;i++) {
+				Value upvalue;
+				if(!readObject(cursor, end, loaded, OBJ_UPVALUE, &upvalue)) return false;
+				closure->upvalues[i] = (ObjUpvalue *)AS_OBJ(upvalue);
+			}
+			return true;
+		}
+		case OBJ_UPVALUE: return readGraphValue(vm, cursor, end, loaded, &((ObjUpvalue *)obj)->closed);
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+			return readGraphValue(vm, cursor, end, loaded, &bound->receiver) &&
+				readGraphValue(vm, cursor, end, loaded, &bound->method);
+		}
+		case OBJ_FUNCTION: {
+			ObjFunction *function = (ObjFunction *)obj;
+			return readConstants(vm, cursor, end, loaded, &function->chunk, loaded->constantCounts[number], function);
+		}
+		default: return true;
+	}
+}
+
+// every object is allocated before any contents are read, so contents can point forward
+static bool readObjects(VM *vm, uint8_t **cursor, uint8_t *end, Loaded *loaded, uint32_t count) {
+	for(uint32_t i=0;i<count;i++) {
+		if(!readAllocation(vm, cursor, end, loaded, &loaded->values[i])) return false;
+		loaded->count++;
+	}
+	for(uint32_t i=0;i<count;i++) {
+		if(!readContents(vm, cursor, end, loaded, i)) return false;
+	}
+	return true;
+}
+
+bool loadSnapshot(VM *vm, char *path, Mapping *mapping) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+		close(fd);
+		return false;
+	}
+	uint8_t *start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(start == MAP_FAILED) return false;
+	mapping->start = start;
+	mapping->size = st.st_size;
+	uint8_t *end = start + st.st_size;
+
+	SnapshotHeader header;
+	memcpy(&header, start, sizeof(header));
+	if(memcmp(header.magic, "LOXS", 4) != 0 || header.version != SNAPSHOT_VERSION) return false;
+	uint8_t *cursor = start + sizeof(header);
+	for(uint32_t i=0;i<header.stringCount;i++) {
+		ObjString *string;
+		if(!readString(vm, &cursor, end, &string)) return false;
+	}
+	// at least a type per object, so a bad count can't ask for a huge array
+	if(header.objectCount > (size_t)(end - cursor) / sizeof(uint32_t)) return false;
+	Loaded loaded = {ALLOCATE(Value, header.objectCount), ALLOCATE(uint32_t, header.objectCount), 0};
+	bool ok = readObjects(vm, &cursor, end, &loaded, header.objectCount);
+	for(uint32_t i=0;i<header.globalCount && ok;i++) {
+		ObjString *name;
+		Value value;
+		ok = readString(vm, &cursor, end, &name) && readGraphValue(vm, &cursor, end, &loaded, &value);
+		if(ok) tableSet(&vm->globals, name, value);
+	}
+	for(uint32_t i=0;i<header.moduleCount && ok;i++) {
+		ObjString *path;
+		uint32_t sourceHash;
+		if(!readString(vm, &cursor, end, &path) || (size_t)(end - cursor) < sizeof(sourceHash)) {
+			ok = false;
+			break;
+		}
+		memcpy(&sourceHash, cursor, sizeof(sourceHash));
+		cursor += sizeof(sourceHash);
+		ObjModule *module = newModule(vm, path);
+		tableSet(&vm->modules, path, OBJ_VAL(module));
+		uint32_t constantCount;
+		ok = deserializeCode(&cursor, end, module->chunk, &constantCount) &&
+			readConstants(vm, &cursor, end, &loaded, module->chunk, constantCount, NULL);
+		module->sourceHash = sourceHash;
+		module->executed = true;
+	}
+	FREE_ARRAY(Value, loaded.values, header.objectCount);
+	FREE_ARRAY(uint32_t, loaded.constantCounts, header.objectCount);
+	return ok;
+}
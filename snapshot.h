@@ -0,0 +1,12 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "cache.h"
+#include "vm.h"
+
+#define SNAPSHOT_VERSION 8
+
+bool writeSnapshot(VM *vm, char *path);
+bool loadSnapshot(VM *vm, char *path, Mapping *mapping);
+
+#endif
@@ -0,0 +1,129 @@
+#include "stats.h"
+
+#ifdef CLOX_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "debug.h"
+
+#define STATS_TOP 30
+
+Stats stats = {.lastOpcode = -1};
+static char *statsPath = NULL;
+
+typedef struct {
+	int previous; // -1 for a single opcode
+	int next;
+	uint64_t count;
+} Count;
+
+static int compareCounts(const void *a, const void *b) {
+	uint64_t x = ((Count *)a)->count, y = ((Count *)b)->count;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// every non-zero counter, most frequent first
+static int collectOpcodes(Count *out) {
+	int count = 0;
+	for(int i=0;i<256;i++) {
+		if(stats.opcodes[i] > 0) out[count++] = (Count){-1, i, stats.opcodes[i]};
+	}
+	qsort(out, count, sizeof(Count), compareCounts);
+	return count;
+}
+
+static int collectPairs(Count *out) {
+	int count = 0;
+	for(int i=0;i<256;i++) {
+		for(int j=0;j<256;j++) {
+			if(stats.pairs[i][j] > 0) out[count++] = (Count){i, j, stats.pairs[i][j]};
+		}
+	}
+	qsort(out, count, sizeof(Count), compareCounts);
+	return count;
+}
+
+static uint64_t totalOpcodes() {
+	uint64_t total = 0;
+	for(int i=0;i<256;i++) total += stats.opcodes[i];
+	return total;
+}
+
+static double averageProbe() {
+	return stats.lookups > 0 ? (double)stats.probes / stats.lookups : 0;
+}
+
+static void printStats(Count *opcodes, int opcodeCount, Count *pairs, int pairCount) {
+	uint64_t total = totalOpcodes();
+	double scale = total > 0 ? 100.0 / total : 0;
+	fprintf(stderr, "stats: %llu instructions\n", (unsigned long long)total);
+	for(int i=0;i<opcodeCount && i<STATS_TOP;i++) {
+		fprintf(stderr, "%14llu %6.2f%%  %s\n", (unsigned long long)opcodes[i].count,
+			opcodes[i].count * scale, opcodeName(opcodes[i].next));
+	}
+	fprintf(stderr, "stats: top opcode pairs\n");
+	for(int i=0;i<pairCount && i<STATS_TOP;i++) {
+		fprintf(stderr, "%14llu %6.2f%%  %s %s\n", (unsigned long long)pairs[i].count,
+			pairs[i].count * scale, opcodeName(pairs[i].previous), opcodeName(pairs[i].next));
+	}
+	fprintf(stderr, "stats: %llu table lookups, %.2f slots on average, %llu at most\n",
+		(unsigned long long)stats.lookups, averageProbe(), (unsigned long long)stats.maxProbe);
+	fprintf(stderr, "stats: %llu interning hits, %llu misses\n",
+		(unsigned long long)stats.internHits, (unsigned long long)stats.internMisses);
+	fprintf(stderr, "stats: %llu bytes in %llu allocations\n",
+		(unsigned long long)stats.bytesAllocated, (unsigned long long)stats.allocations);
+	fprintf(stderr, "stats: peak stack %llu values, %llu frames\n",
+		(unsigned long long)stats.peakStack, (unsigned long long)stats.peakFrames);
+}
+
+static void writeCounts(FILE *file, Count *counts, int count) {
+	for(int i=0;i<count;i++) {
+		fprintf(file, "%s\n    {", i > 0 ? "," : "");
+		if(counts[i].previous >= 0) fprintf(file, "\"first\": \"%s\", \"second\"", opcodeName(counts[i].previous));
+		else fprintf(file, "\"opcode\"");
+		fprintf(file, ": \"%s\", \"count\": %llu}", opcodeName(counts[i].next),
+			(unsigned long long)counts[i].count);
+	}
+}
+
+// every opcode and every pair that ran, so runs can be merged and diffed offline
+static bool writeJson(char *path, Count *opcodes, int opcodeCount, Count *pairs, int pairCount) {
+	FILE *file = fopen(path, "w");
+	if(file == NULL) return false;
+	fprintf(file, "{\n  \"instructions\": %llu,\n  \"opcodes\": [", (unsigned long long)totalOpcodes());
+	writeCounts(file, opcodes, opcodeCount);
+	fprintf(file, "\n  ],\n  \"pairs\": [");
+	writeCounts(file, pairs, pairCount);
+	fprintf(file, "\n  ],\n");
+	fprintf(file, "  \"tableLookups\": %llu,\n  \"averageProbe\": %.4f,\n  \"maxProbe\": %llu,\n",
+		(unsigned long long)stats.lookups, averageProbe(), (unsigned long long)stats.maxProbe);
+	fprintf(file, "  \"internHits\": %llu,\n  \"internMisses\": %llu,\n",
+		(unsigned long long)stats.internHits, (unsigned long long)stats.internMisses);
+	fprintf(file, "  \"bytesAllocated\": %llu,\n  \"allocations\": %llu,\n",
+		(unsigned long long)stats.bytesAllocated, (unsigned long long)stats.allocations);
+	fprintf(file, "  \"peakStack\": %llu,\n  \"peakFrames\": %llu\n}\n",
+		(unsigned long long)stats.peakStack, (unsigned long long)stats.peakFrames);
+	return fclose(file) == 0;
+}
+
+static void reportStats() {
+	Count *opcodes = (Count *)malloc(sizeof(Count) * 256);
+	Count *pairs = (Count *)malloc(sizeof(Count) * 256 * 256);
+	int opcodeCount = collectOpcodes(opcodes);
+	int pairCount = collectPairs(pairs);
+	if(statsPath == NULL) {
+		printStats(opcodes, opcodeCount, pairs, pairCount);
+	} else if(!writeJson(statsPath, opcodes, opcodeCount, pairs, pairCount)) {
+		fprintf(stderr, "Could not write stats %s\n", statsPath);
+	}
+	free(pairs);
+	free(opcodes);
+}
+
+// counting runs from startup either way, --stats only asks for the report at exit
+void startStats(char *jsonPath) {
+	statsPath = jsonPath;
+	atexit(reportStats);
+}
+
+#endif
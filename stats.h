@@ -0,0 +1,69 @@
+#ifndef STATS_H
+#define STATS_H
+
+// counters for tuning the vm, compiled in only by make stats (-DCLOX_STATS).
+// in a normal build every STAT_ macro is empty and stats.c compiles to nothing
+#ifdef CLOX_STATS
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+	uint64_t opcodes[256];
+	uint64_t pairs[256][256]; // [previous][next], candidates for superinstructions
+	int lastOpcode;           // -1 until the first instruction
+	uint64_t lookups;         // findSlot and tableFindString calls
+	uint64_t probes;          // index slots those calls looked at
+	uint64_t maxProbe;
+	uint64_t internHits;
+	uint64_t internMisses;
+	uint64_t allocations;     // reallocate() calls that grew or created a block
+	uint64_t bytesAllocated;  // what those calls added
+	uint64_t peakStack;       // values on one fiber's stack
+	uint64_t peakFrames;
+} Stats;
+
+// plain increments, not atomic. --batch forks, so its workers each count in their
+// own copy; the threads compileBatch starts for several files do share these, so
+// probe, interning and allocation counts from a multi-file compile are approximate
+extern Stats stats;
+
+#define STAT_OPCODE(op) do {\
+	if(stats.lastOpcode >= 0) stats.pairs[stats.lastOpcode][op]++;\
+	stats.opcodes[op]++;\
+	stats.lastOpcode = (op);\
+} while(0)
+#define STAT_PROBE(length) do {\
+	uint64_t probeLength = (length);\
+	stats.lookups++;\
+	stats.probes += probeLength;\
+	if(probeLength > stats.maxProbe) stats.maxProbe = probeLength;\
+} while(0)
+#define STAT_INTERN(hit) do {\
+	if(hit) stats.internHits++;\
+	else stats.internMisses++;\
+} while(0)
+#define STAT_ALLOC(oldSize, newSize) do {\
+	if((newSize) > (oldSize)) {\
+		stats.allocations++;\
+		stats.bytesAllocated += (newSize) - (oldSize);\
+	}\
+} while(0)
+#define STAT_PEAK(field, value) do {\
+	uint64_t peakValue = (uint64_t)(value);\
+	if(peakValue > stats.field) stats.field = peakValue;\
+} while(0)
+
+void startStats(char *jsonPath);
+
+#else
+
+#define STAT_OPCODE(op) do {} while(0)
+#define STAT_PROBE(length) do {} while(0)
+#define STAT_INTERN(hit) do {} while(0)
+#define STAT_ALLOC(oldSize, newSize) do {} while(0)
+#define STAT_PEAK(field, value) do {} while(0)
+
+#endif
+
+#endif
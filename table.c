@@ -1,107 +1,218 @@
 #include "table.h"
+#include "obj.h"
 #include "memory.h"
+#include "stats.h"
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75f
+#define SLOT_EMPTY -1
+#define SLOT_DELETED -2
+
+// entries fill up to 3/4 of the index, so probing always reaches an empty slot
+static int entryCapacity(int size) {
+	return size - size / 4;
+}
 
 void initTable(Table *table) {
-	table->entries = NULL;
 	table->count = 0;
+	table->used = 0;
 	table->size = 0;
+	table->index = NULL;
+	table->entries = NULL;
 }
 
 void freeTable(Table *table) {
-	FREE_ARRAY(Entry, table->entries, table->size);
+	FREE_ARRAY(int32_t, table->index, table->size);
+	FREE_ARRAY(Entry, table->entries, entryCapacity(table->size));
 	initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int size, ObjString *key) {
-	int i = key->hash % size;
-	Entry *tompStone = NULL;
-	while(entries[i].key != NULL || (entries[i].key == NULL && IS_BOOL(entries[i].value))) {
-		if(entries[i].key == key) return entries + i;
-		if(IS_BOOL(entries[i].value) && entries[i].key == NULL) {
-			tompStone = entries+i;
+// murmur3's finalizer, number keys like 1, 2, 3 only differ in their high bits
+static uint32_t mix64(uint64_t bits) {
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdULL;
+	bits ^= bits >> 33;
+	bits *= 0xc4ceb9fe1a85ec53ULL;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+// strings are interned, so they hash by content and compare by pointer like every other object
+uint32_t hashValue(Value key) {
+	switch(key.type) {
+		case VAL_BOOL: return AS_BOOL(key) ? 3 : 5;
+		case VAL_NIL: return 7;
+		case VAL_NUMBER: {
+			double number = AS_NUMBER(key);
+			if(number == 0) number = 0; // -0 == 0
+			uint64_t bits;
+			memcpy(&bits, &number, sizeof(bits));
+			return mix64(bits);
 		}
-		i = (i + 1) % size;
+		case VAL_OBJ:
+			if(IS_STRING(key)) return AS_STRING(key)->hash;
+			return mix64((uint64_t)(uintptr_t)AS_OBJ(key));
 	}
-	return tompStone != NULL ? tompStone : entries + i; // NULL KEY or tompstone if found
+	return 0;
 }
 
-void tableAddAll(Table *from, Table *to) {
-	for(int i=0;i<from->size;i++) {
-		if(from->entries[i].key != NULL) {
-			tableSet(to, from->entries[i].key, from->entries[i].value);
+static bool keysEqual(Value a, Value b) {
+	if(a.type != b.type) return false;
+	switch(a.type) {
+		case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+		case VAL_NIL: return true;
+		case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+		case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+	}
+	return false;
+}
+
+// the slot holding key, otherwise the first reusable slot on its probe sequence
+static int32_t *findSlot(Table *table, Value key, uint32_t hash) {
+	uint32_t mask = table->size - 1;
+	uint32_t i = hash & mask;
+	int32_t *tombStone = NULL;
+	while(1) {
+		int32_t *slot = &table->index[i];
+		if(*slot == SLOT_EMPTY) {
+			STAT_PROBE(((i - hash) & mask) + 1);
+			return tombStone != NULL ? tombStone : slot;
+		}
+		if(*slot == SLOT_DELETED) {
+			if(tombStone == NULL) tombStone = slot;
+		} else {
+			Entry *entry = &table->entries[*slot];
+			if(entry->hash == hash && keysEqual(entry->key, key)) {
+				STAT_PROBE(((i - hash) & mask) + 1);
+				return slot;
+			}
 		}
+		i = (i + 1) & mask;
 	}
 }
 
-bool tableGet(Table *table, ObjString *key, Value *value) {
+// compacts out deleted entries and sizes the index so at least half the entries are free again
+static void rebuild(Table *table) {
+	int size = 8;
+	while(entryCapacity(size) < (table->count + 1) * 2) size *= 2;
+	int32_t *index = ALLOCATE(int32_t, size);
+	Entry *entries = ALLOCATE(Entry, entryCapacity(size));
+	for(int i=0;i<size;i++) index[i] = SLOT_EMPTY;
+	int used = 0;
+	for(int i=0;i<table->used;i++) {
+		Entry *entry = &table->entries[i];
+		if(IS_EMPTY_KEY(entry->key)) continue;
+		uint32_t j = entry->hash & (size - 1);
+		while(index[j] != SLOT_EMPTY) j = (j + 1) & (size - 1);
+		index[j] = used;
+		entries[used++] = *entry;
+	}
+	int count = table->count;
+	freeTable(table);
+	table->count = count;
+	table->used = used;
+	table->size = size;
+	table->index = index;
+	table->entries = entries;
+}
+
+static bool getEntry(Table *table, Value key, uint32_t hash, Value *value) {
 	if(table->count == 0) return false;
-	Entry *entry = findEntry(table->entries, table->size, key);
-	if(entry->key == NULL) return false;
-	*value = entry->value;
+	int32_t *slot = findSlot(table, key, hash);
+	if(*slot < 0) return false;
+	*value = table->entries[*slot].value;
 	return true;
 }
 
-bool tableDelete(Table *table, ObjString *key) {
+static bool setEntry(Table *table, Value key, uint32_t hash, Value value) {
+	int32_t *slot = NULL;
+	if(table->size > 0) {
+		slot = findSlot(table, key, hash);
+		if(*slot >= 0) {
+			table->entries[*slot].value = value;
+			return false;
+		}
+	}
+	if(table->used == entryCapacity(table->size)) {
+		rebuild(table);
+		slot = findSlot(table, key, hash);
+	}
+	*slot = table->used;
+	Entry *entry = &table->entries[table->used++];
+	entry->key = key;
+	entry->value = value;
+	entry->hash = hash;
+	table->count++;
+	return true;
+}
+
+// the entry stays behind as a hole so iteration order and positions hold until the next rebuild
+static bool deleteEntry(Table *table, Value key, uint32_t hash) {
 	if(table->count == 0) return false;
-	Entry *entry = findEntry(table->entries, table->size, key);
-	if(entry->key == NULL) return false;
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
+	int32_t *slot = findSlot(table, key, hash);
+	if(*slot < 0) return false;
+	Entry *entry = &table->entries[*slot];
+	entry->key = EMPTY_KEY;
+	entry->value = NIL_VAL;
+	*slot = SLOT_DELETED;
+	table->count--;
 	return true;
 }
 
+bool tableGetValue(Table *table, Value key, Value *value) {
+	return getEntry(table, key, hashValue(key), value);
+}
 
-static void adjustSize(Table *table, int newSize) {
-	Table newTable;
-	initTable(&newTable);
-	newTable.size = newSize;
-	newTable.entries = ALLOCATE(Entry, newSize);
-	for(int i=0;i<newSize;i++) {
-		newTable.entries[i].key = NULL;
-		newTable.entries[i].value = NIL_VAL;
-	}
-	for(int i=0;i<table->size;i++) {
-		Entry *entry = &table->entries[i];
-		if(entry->key != NULL) {
-			Entry *newEntry = findEntry(table->entries, newSize, entry->key);
-			newEntry->key = entry->key;
-			newEntry->value = entry->value;
-			newTable.count++;
-		}
+bool tableSetValue(Table *table, Value key, Value value) {
+	return setEntry(table, key, hashValue(key), value);
+}
+
+bool tableDeleteValue(Table *table, Value key) {
+	return deleteEntry(table, key, hashValue(key));
+}
+
+bool tableGet(Table *table, ObjString *key, Value *value) {
+	return getEntry(table, OBJ_VAL(key), key->hash, value);
+}
+
+bool tableSet(Table *table, ObjString *key, Value value) {
+	return setEntry(table, OBJ_VAL(key), key->hash, value);
+}
+
+bool tableDelete(Table *table, ObjString *key) {
+	return deleteEntry(table, OBJ_VAL(key), key->hash);
+}
+
+void tableAddAll(Table *from, Table *to) {
+	for(int i=0;i<from->used;i++) {
+		Entry *entry = &from->entries[i];
+		if(!IS_EMPTY_KEY(entry->key)) setEntry(to, entry->key, entry->hash, entry->value);
 	}
-	freeTable(table);
-	table->size = newTable.size;
-	table->entries = newTable.entries;
-	table->count = newTable.count;
 }
 
 ObjString *tableFindString(Table *strings, char *chars, int length, uint32_t hash) {
 	if(strings->count == 0) return NULL;
-	uint32_t i = hash % strings->size;
+	uint32_t mask = strings->size - 1;
+	uint32_t i = hash & mask;
 	while(1) {
-		Entry *entry = &strings->entries[i];
-		if(entry->key == NULL) {
-			if(IS_NIL(entry->value)) return NULL;
-		} else if(entry->key->length == length && entry->key->hash == hash) {
-			if(!memcmp(entry->key->chars, chars, length)) return entry->key;
+		int32_t slot = strings->index[i];
+		if(slot == SLOT_EMPTY) {
+			STAT_PROBE(((i - hash) & mask) + 1);
+			return NULL;
 		}
-		i = (i+1) % strings->size;
+		if(slot != SLOT_DELETED) {
+			Entry *entry = &strings->entries[slot];
+			ObjString *key = AS_STRING(entry->key);
+			if(entry->hash == hash && key->length == length && !memcmp(key->chars, chars, length)) {
+				STAT_PROBE(((i - hash) & mask) + 1);
+				return key;
+			}
+		}
+		i = (i + 1) & mask;
 	}
 }
 
-
-bool tableSet(Table *table, ObjString *key, Value value) {
-	if(table->count >= (int)((float)table->size * TABLE_MAX_LOAD)) {
-		int size = GROW_CAPACITY(table->size);
-		adjustSize(table, size);
-	}
-	Entry *entry = findEntry(table->entries, table->size, key);
-	bool isNewKey = entry->key == NULL;
-	if(isNewKey && IS_NIL(entry->value)) table->count++;
-	entry->key = key;
-	entry->value = value;
-	return isNewKey;
+// what the index and the entries take up, for heap accounting
+size_t tableBytes(Table *table) {
+	if(table->size == 0) return 0;
+	return sizeof(int32_t) * table->size + sizeof(Entry) * entryCapacity(table->size);
 }
@@ -1,24 +1,39 @@
 #ifndef TABLE_H
 #define TABLE_H
 
-#include "obj.h"
+#include <stdint.h>
+#include "value.h"
+
+// a deleted entry keeps its position with a key no script value can equal
+#define EMPTY_KEY OBJ_VAL(NULL)
+#define IS_EMPTY_KEY(v) (IS_OBJ(v) && AS_OBJ(v) == NULL)
 
 typedef struct {
-	ObjString *key;
+	Value key;
 	Value value;
+	uint32_t hash;
 } Entry;
 
+// entries are dense and in insertion order, index maps probe slots to positions in entries
 typedef struct {
-	int count;
-	int size;
+	int count; // live keys
+	int used;  // entries written since the last rebuild, deleted ones included
+	int size;  // index slots, a power of two
+	int32_t *index;
 	Entry *entries;
 } Table;
 
 void initTable(Table *);
 void freeTable(Table *);
+uint32_t hashValue(Value key);
+bool tableGetValue(Table *, Value key, Value *value);
+bool tableSetValue(Table *, Value key, Value value);
+bool tableDeleteValue(Table *, Value key);
 bool tableSet(Table *, ObjString *, Value value);
 bool tableGet(Table *, ObjString *, Value *value);
+bool tableDelete(Table *, ObjString *);
 void tableAddAll(Table *, Table *);
 ObjString *tableFindString(Table *, char*, int, uint32_t);
+size_t tableBytes(Table *);
 
 #endif
@@ -21,19 +21,28 @@ void writeValueArray(ValueArray *varr, Value value) {
 	varr->values[varr->count++] = value;
 }
 
-void printValue(Value v) {
+void writeValue(OutputBuffer *out, Value v) {
 	switch(v.type) {
 		case VAL_BOOL:
-			printf(AS_BOOL(v) ? "true" : "false");
+			if(AS_BOOL(v)) writeOutput(out, "true", 4);
+			else writeOutput(out, "false", 5);
 			break;
 		case VAL_NUMBER:
-			printf("%g", AS_NUMBER(v));
+			writeNumber(out, AS_NUMBER(v));
 			break;
 		case VAL_NIL:
-			printf("nil");
+			writeOutput(out, "nil", 3);
 			break;
 		case VAL_OBJ:
-			printObj(v);
+			writeObj(out, v);
 			break;
 	}
 }
+
+// straight to stdout, for the disassembler and stack traces
+void printValue(Value v) {
+	OutputBuffer out;
+	initOutput(&out);
+	writeValue(&out, v);
+	freeOutput(&out);
+}
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include "output.h"
 
 
 typedef enum {
@@ -14,6 +15,8 @@ typedef enum {
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjShape ObjShape;
+typedef struct VM VM;
 
 typedef struct {
 	ValueType type;
@@ -48,6 +51,7 @@ typedef struct {
 void initValueArray(ValueArray *);
 void freeValueArray(ValueArray *);
 void writeValueArray(ValueArray *, Value);
+void writeValue(OutputBuffer *out, Value v);
 void printValue(Value v);
 
 #endif
@@ -2,44 +2,158 @@
 #include "compiler.h"
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 #include "memory.h"
+#include "list.h"
+#include "mathlib.h"
+#include "map.h"
+#include "f64.h"
+#include "profile.h"
+#include "stats.h"
+#include "heapprof.h"
+#include "cache.h"
 
 #define TRACE_STACK
 #undef TRACE_STACK
 
-VM vm;
+// moves every open upvalue at or above last off the stack and into the upvalue itself
+static void closeUpvalues(VM *vm, Value *last) {
+	ObjFiber *fiber = vm->fiber;
+	while(fiber->openUpvalues != NULL && fiber->openUpvalues->location >= last) {
+		ObjUpvalue *upvalue = fiber->openUpvalues;
+		upvalue->closed = *upvalue->location;
+		upvalue->location = &upvalue->closed;
+		fiber->openUpvalues = upvalue->next;
+	}
+}
+
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
+	ObjUpvalue *prev = NULL;
+	ObjUpvalue *upvalue = vm->fiber->openUpvalues;
+	while(upvalue != NULL && upvalue->location > local) {
+		prev = upvalue;
+		upvalue = upvalue->next;
+	}
+	if(upvalue != NULL && upvalue->location == local) return upvalue;
+	ObjUpvalue *created = newUpvalue(vm, local);
+	created->next = upvalue;
+	if(prev == NULL) vm->fiber->openUpvalues = created;
+	else prev->next = created;
+	return created;
+}
+
+static void resetStack(VM *vm) {
+	closeUpvalues(vm, vm->stack);
+	vm->stackTop = vm->stack;
+	vm->fiber->frameCount = 0;
+}
+
+// frames and open upvalues point into the stack, so they get rebased when it moves
+static void growStack(VM *vm) {
+	ObjFiber *fiber = vm->fiber;
+	int count = (int)(vm->stackTop - vm->stack);
+	int oldCapacity = fiber->stackCapacity;
+	Value *oldStack = fiber->stack;
+	fiber->stackCapacity = GROW_CAPACITY(oldCapacity);
+	fiber->stack = GROW_ARRAY(Value, fiber->stack, oldCapacity, fiber->stackCapacity);
+	for(int i=0;i<fiber->frameCount;i++) {
+		fiber->frames[i].slots = fiber->stack + (fiber->frames[i].slots - oldStack);
+	}
+	for(ObjUpvalue *upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+		upvalue->location = fiber->stack + (upvalue->location - oldStack);
+	}
+	vm->stack = fiber->stack;
+	vm->stackTop = vm->stack + count;
+	vm->stackLimit = vm->stack + fiber->stackCapacity;
+}
+
+void push(VM *vm, Value v) {
+	if(vm->stackTop == vm->stackLimit) growStack(vm);
+	*vm->stackTop = v;
+	vm->stackTop++;
+	STAT_PEAK(peakStack, vm->stackTop - vm->stack);
+}
+
+Value pop(VM *vm) {
+	return *(--vm->stackTop);
+}
+
+static Value peek(VM *vm, int distance) {
+	return *(vm->stackTop - 1 - distance);
+}
+
+// the ip lives in the running fiber's top frame, run() stores it before switching
+static void saveFiber(VM *vm) {
+	vm->fiber->stackTop = vm->stackTop;
+}
+
+static void loadFiber(VM *vm, ObjFiber *fiber) {
+	vm->fiber = fiber;
+	vm->stack = fiber->stack;
+	vm->stackTop = fiber->stackTop;
+	vm->stackLimit = fiber->stack + fiber->stackCapacity;
+}
+
+static bool isReady(VM *vm, ObjFiber *fiber) {
+	return fiber->prevReady != NULL || vm->readyHead == fiber;
+}
+
+static void enqueueFiber(VM *vm, ObjFiber *fiber) {
+	fiber->prevReady = vm->readyTail;
+	fiber->nextReady = NULL;
+	if(vm->readyTail != NULL) vm->readyTail->nextReady = fiber;
+	else vm->readyHead = fiber;
+	vm->readyTail = fiber;
+}
+
+static void enqueueFiberFront(VM *vm, ObjFiber *fiber) {
+	fiber->prevReady = NULL;
+	fiber->nextReady = vm->readyHead;
+	if(vm->readyHead != NULL) vm->readyHead->prevReady = fiber;
+	else vm->readyTail = fiber;
+	vm->readyHead = fiber;
+}
 
-static void resetStack() {
-	vm.stackTop = vm.stack;
+static void unlinkFiber(VM *vm, ObjFiber *fiber) {
+	if(!isReady(vm, fiber)) return;
+	if(fiber->prevReady != NULL) fiber->prevReady->nextReady = fiber->nextReady;
+	else vm->readyHead = fiber->nextReady;
+	if(fiber->nextReady != NULL) fiber->nextReady->prevReady = fiber->prevReady;
+	else vm->readyTail = fiber->prevReady;
+	fiber->prevReady = NULL;
+	fiber->nextReady = NULL;
 }
 
-void push(Value v) {
-	*vm.stackTop = v;
-	vm.stackTop++;
+static ObjFiber *dequeueFiber(VM *vm) {
+	ObjFiber *fiber = vm->readyHead;
+	unlinkFiber(vm, fiber);
+	return fiber;
 }
 
-Value pop() {
-	return *(--vm.stackTop);
+void scheduleFiber(VM *vm, ObjFiber *fiber) {
+	enqueueFiber(vm, fiber);
 }
 
-static Value peek(int distance) {
-	return *(vm.stackTop - 1 - distance);
+// the next fiber to run, blocking in the event loop while every fiber waits on I/O
+static ObjFiber *nextFiber(VM *vm) {
+	while(vm->readyHead == NULL && ioPending(vm)) pollIO(vm, true);
+	return vm->readyHead != NULL ? dequeueFiber(vm) : NULL;
 }
 
 static bool isTrue(Value v) {
 	return (v.type != VAL_NIL && (v.type != VAL_BOOL || AS_BOOL(v)));
 }
 
-static void concatenate() {
-	ObjString *b = AS_STRING(pop());
-	ObjString *a = AS_STRING(pop());
+static void concatenate(VM *vm) {
+	ObjString *b = AS_STRING(pop(vm));
+	ObjString *a = AS_STRING(pop(vm));
 	int length = a->length + b->length;
 	char *chars = ALLOCATE(char, length+1);
 	memcpy(chars, a->chars, a->length);
 	memcpy(chars + a->length, b->chars, b->length);
 	chars[length] = '\0';
-	ObjString *result = takeString(chars, length);
-	push(OBJ_VAL((Obj*)result));
+	ObjString *result = takeString(vm, chars, length);
+	push(vm, OBJ_VAL((Obj*)result));
 }
 
 static bool valuesEqual(Value a, Value b) {
@@ -53,161 +167,854 @@ static bool valuesEqual(Value a, Value b) {
 	}
 }
 
-static void runtimeError(char *format, ...) {
+void runtimeError(VM *vm, char *format, ...) {
+	flushOutput(&vm->out);
 	va_list args;
 	va_start(args, format);
 	vprintf(format, args);
 	va_end(args);
 	printf("\n");
-	size_t instructionIndex = vm.ip - vm.chunk->code - 1;
-	int line = vm.chunk->lines[instructionIndex];
-	printf("[line %d] in script\n", line);
-	resetStack();
+	ObjFiber *fiber = vm->fiber;
+	for(int i=fiber->frameCount-1;i>=0;i--) {
+		CallFrame *frame = &fiber->frames[i];
+		size_t instructionIndex = frame->ip - frame->chunk->code - 1;
+		printf("[line %d] in ", frame->chunk->lines[instructionIndex]);
+		if(frame->function == NULL) printf("script\n");
+		else printf("%s()\n", frame->function->name->chars);
+	}
+	resetStack(vm);
+}
+
+static bool pushFrame(VM *vm, ObjFunction *function, ObjClosure *closure, Chunk *chunk, Value *slots) {
+	ObjFiber *fiber = vm->fiber;
+	if(fiber->frameCount == fiber->frameCapacity) {
+		if(fiber->frameCapacity >= FRAMES_MAX) {
+			runtimeError(vm, "Stack overflow.");
+			return false;
+		}
+		int oldCapacity = fiber->frameCapacity;
+		fiber->frameCapacity = GROW_CAPACITY(oldCapacity);
+		fiber->frames = GROW_ARRAY(CallFrame, fiber->frames, oldCapacity, fiber->frameCapacity);
+	}
+	CallFrame *frame = &fiber->frames[fiber->frameCount++];
+	STAT_PEAK(peakFrames, fiber->frameCount);
+	frame->function = function;
+	frame->closure = closure;
+	frame->chunk = chunk;
+	frame->ip = chunk->code;
+	frame->slots = slots;
+	return true;
+}
+
+typedef enum {
+	CALL_OK,
+	CALL_ERROR,
+	CALL_RETRY,  // a native parked the fiber before producing a result
+	CALL_PARKED, // a native parked the fiber after producing its result
+} CallStatus;
+
+static CallStatus callFunction(VM *vm, ObjFunction *function, ObjClosure *closure, int argCount) {
+	if(argCount != function->arity) {
+		runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+		return CALL_ERROR;
+	}
+	// the arguments already sit where the callee's locals start
+	if(!pushFrame(vm, function, closure, &function->chunk, vm->stackTop - argCount - 1)) return CALL_ERROR;
+	return CALL_OK;
+}
+
+// no frame is pushed, the result simply replaces the callee and its arguments
+static inline CallStatus callNative(VM *vm, ObjNative *native, int argCount) {
+	if(native->arity >= 0 && argCount != native->arity) {
+		runtimeError(vm, "%s() expects %d arguments but got %d.", native->name->chars, native->arity, argCount);
+		return CALL_ERROR;
+	}
+	Value result = NIL_VAL;
+	if(native->unary != NULL) {
+		if(!IS_NUMBER(vm->stackTop[-1])) {
+			runtimeError(vm, "%s() expects a number.", native->name->chars);
+			return CALL_ERROR;
+		}
+		result = NUMBER_VAL(native->unary(AS_NUMBER(vm->stackTop[-1])));
+		vm->stackTop -= 2;
+		push(vm, result);
+		return CALL_OK;
+	}
+	NativeResult status = native->function(vm, argCount, vm->stackTop - argCount, &result);
+	if(status == NATIVE_ERROR) return CALL_ERROR;
+	if(status == NATIVE_RETRY) return CALL_RETRY;
+	vm->stackTop -= argCount + 1;
+	push(vm, result);
+	return status == NATIVE_SUSPEND ? CALL_PARKED : CALL_OK;
+}
+
+// the callee sits below its arguments, a pushed frame or a native's result replaces them
+static CallStatus callValue(VM *vm, Value callee, int argCount) {
+	if(IS_OBJ(callee)) {
+		switch(OBJ_TYPE(callee)) {
+			case OBJ_FUNCTION: return callFunction(vm, AS_FUNCTION(callee), NULL, argCount);
+			case OBJ_CLOSURE: return callFunction(vm, AS_CLOSURE(callee)->function, AS_CLOSURE(callee), argCount);
+			case OBJ_BOUND_METHOD: {
+				ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+				vm->stackTop[-argCount - 1] = bound->receiver;
+				return callValue(vm, bound->method, argCount);
+			}
+			case OBJ_CLASS: {
+				ObjClass *klass = AS_CLASS(callee);
+				vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+				if(!IS_NIL(klass->initializer)) return callValue(vm, klass->initializer, argCount);
+				if(argCount != 0) {
+					runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+					return CALL_ERROR;
+				}
+				return CALL_OK;
+			}
+			case OBJ_NATIVE: return callNative(vm, AS_NATIVE(callee), argCount);
+			default: break;
+		}
+	}
+	runtimeError(vm, "Can only call functions and classes.");
+	return CALL_ERROR;
+}
+
+// bounds checked, the element is then a single load out of the contiguous buffer
+static bool checkIndex(VM *vm, int count, Value index, int *out) {
+	if(!IS_NUMBER(index) || AS_NUMBER(index) != (int)AS_NUMBER(index)) {
+		runtimeError(vm, "Index must be an integer.");
+		return false;
+	}
+	int i = (int)AS_NUMBER(index);
+	if(i < 0 || i >= count) {
+		runtimeError(vm, "Index %d out of bounds for length %d.", i, count);
+		return false;
+	}
+	*out = i;
+	return true;
 }
 
-void initVM() {
-	vm.objects = NULL;
-	initTable(&vm.strings);
-	initTable(&vm.globals);
-	resetStack();
+static CacheEntry *findCacheEntry(InlineCache *cache, ObjShape *shape) {
+	for(int i=0;i<CACHE_WAYS;i++) {
+		if(cache->entries[i].shape == shape) return &cache->entries[i];
+	}
+	return NULL;
+}
+
+// the oldest way falls off the end once the site has seen more than CACHE_WAYS shapes
+static CacheEntry *fillCache(InlineCache *cache, CacheEntry *entry) {
+	memmove(&cache->entries[1], &cache->entries[0], sizeof(CacheEntry) * (CACHE_WAYS - 1));
+	cache->entries[0] = *entry;
+	return &cache->entries[0];
+}
+
+// fields shadow methods, a name that's neither is an error
+static CacheEntry *lookupProperty(VM *vm, InlineCache *cache, ObjInstance *instance, ObjString *name) {
+	CacheEntry *cached = findCacheEntry(cache, instance->shape);
+	if(cached != NULL) return cached;
+	CacheEntry entry = {instance->shape, NULL, NIL_VAL, shapeFind(instance->shape, name)};
+	if(entry.index == -1 && !tableGet(&instance->klass->methods, name, &entry.method)) {
+		runtimeError(vm, "Undefined property '%s'.", name->chars);
+		return NULL;
+	}
+	return fillCache(cache, &entry);
+}
+
+static CacheEntry *lookupField(VM *vm, InlineCache *cache, ObjInstance *instance, ObjString *name) {
+	CacheEntry *cached = findCacheEntry(cache, instance->shape);
+	if(cached != NULL) return cached;
+	CacheEntry entry = {instance->shape, NULL, NIL_VAL, shapeFind(instance->shape, name)};
+	if(entry.index == -1) {
+		entry.transition = shapeTransition(vm, instance->shape, name);
+		entry.index = entry.transition->fieldCount - 1;
+	}
+	return fillCache(cache, &entry);
+}
+
+// the module body runs in a frame of its own on top of the importer's
+static bool runModule(VM *vm, ObjModule *module) {
+	// mark before running so cyclic imports see the module as loaded
+	module->executed = true;
+	return pushFrame(vm, NULL, NULL, module->chunk, vm->stackTop);
+}
+
+// once the module's body has run in this run, the importer chain or a fiber it
+// spawned may still hold the chunk and an ip into it: retire it and compile into a
+// fresh one. after resetVM nothing runs in it any more and it can be reused
+static void replaceModuleChunk(ObjModule *module) {
+	if(!module->executed) {
+		freeChunk(module->chunk);
+		return;
+	}
+	if(module->retiredCount == module->retiredCapacity) {
+		int oldCapacity = module->retiredCapacity;
+		module->retiredCapacity = GROW_CAPACITY(oldCapacity);
+		module->retired = GROW_ARRAY(Chunk *, module->retired, oldCapacity, module->retiredCapacity);
+	}
+	module->retired[module->retiredCount++] = module->chunk;
+	module->chunk = ALLOCATE(Chunk, 1);
+	initChunk(module->chunk);
+}
+
+// modules are cached by path and only recompiled (and rerun) when their source hash changes
+static InterpretResult importModule(VM *vm, ObjString *path) {
+	Value cached;
+	if(tableGet(&vm->modules, path, &cached) && AS_MODULE(cached)->embedded) {
+		// bundled modules never go back to the disk
+		ObjModule *module = AS_MODULE(cached);
+		if(module->executed || runModule(vm, module)) return INTERPRET_OK;
+		return INTERPRET_RUNTIME_ERROR;
+	}
+	Mapping mapping = {NULL, 0};
+	char *source = loadSource(path->chars, &mapping);
+	if(source == NULL) {
+		runtimeError(vm, "Could not open module '%s'", path->chars);
+		return INTERPRET_RUNTIME_ERROR;
+	}
+	int length = (int)strlen(source);
+	uint32_t hash = hashString(source, length);
+	ObjModule *module;
+	if(tableGet(&vm->modules, path, &cached)) {
+		module = AS_MODULE(cached);
+		if(module->sourceHash == hash) {
+			releaseSource(source, &mapping);
+			if(module->executed || runModule(vm, module)) return INTERPRET_OK;
+			return INTERPRET_RUNTIME_ERROR;
+		}
+		replaceModuleChunk(module);
+	} else {
+		module = newModule(vm, path);
+		tableSet(&vm->modules, path, OBJ_VAL(module));
+	}
+	bool compiled = compile(vm, module->chunk, source);
+	releaseSource(source, &mapping);
+	if(!compiled) {
+		freeChunk(module->chunk);
+		module->sourceHash = 0;
+		runtimeError(vm, "Could not compile module '%s'", path->chars);
+		return INTERPRET_RUNTIME_ERROR;
+	}
+	module->sourceHash = hash;
+	return runModule(vm, module) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+}
+
+void defineNative(VM *vm, char *name, NativeFn function, int arity) {
+	ObjString *string = copyString(vm, name, (int)strlen(name));
+	tableSet(&vm->globals, string, OBJ_VAL(newNative(vm, string, function, NULL, arity)));
+}
+
+void defineUnaryNative(VM *vm, char *name, NativeUnaryFn function) {
+	ObjString *string = copyString(vm, name, (int)strlen(name));
+	tableSet(&vm->globals, string, OBJ_VAL(newNative(vm, string, NULL, function, 1)));
 }
 
-void freeVM() {
-	freeTable(&vm.strings);
-	freeObjects();
+static NativeResult flushNative(VM *vm, int argCount, Value *args, Value *result) {
+	flushOutput(&vm->out);
+	return NATIVE_OK;
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_SHORT() (((uint16_t)READ_BYTE() << 8) | (uint16_t)READ_BYTE())
-#define READ_CONSTANT() (vm.chunk->varr.values[*vm.ip++])
+// cpu time of the process, as in the book
+static NativeResult clockNative(VM *vm, int argCount, Value *args, Value *result) {
+	*result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+	return NATIVE_OK;
+}
+
+static void defineNatives(VM *vm) {
+	defineNative(vm, "clock", clockNative, 0);
+	defineNative(vm, "flush", flushNative, 0);
+	defineMathNatives(vm);
+	defineIONatives(vm);
+	defineListNatives(vm);
+	defineMapNatives(vm);
+	defineF64Natives(vm);
+}
+
+void initVM(VM *vm) {
+	vm->objects = NULL;
+	initOutput(&vm->out);
+	initTable(&vm->strings);
+	initTable(&vm->globals);
+	initTable(&vm->natives);
+	initTable(&vm->modules);
+	vm->initString = copyString(vm, "init", 4);
+	vm->readyHead = NULL;
+	vm->readyTail = NULL;
+	vm->root = newFiber(vm, NULL, NULL, NULL, STACK_INITIAL);
+	loadFiber(vm, vm->root);
+	resetStack(vm);
+	initIO(&vm->io);
+	defineNatives(vm);
+	tableAddAll(&vm->globals, &vm->natives);
+}
+
+// back on the root fiber with nothing scheduled
+static void resetFibers(VM *vm) {
+	while(vm->readyHead != NULL) dequeueFiber(vm);
+	if(ioPending(vm)) cancelIO(&vm->io);
+	loadFiber(vm, vm->root);
+	resetStack(vm);
+}
+
+void freeVM(VM *vm) {
+	finishAllocationProfiler(vm);
+	freeTable(&vm->strings);
+	freeTable(&vm->globals);
+	freeTable(&vm->natives);
+	freeTable(&vm->modules);
+	freeIO(&vm->io);
+	freeOutput(&vm->out);
+	freeObjects(vm);
+}
+
+// drops globals and forgets which modules ran, compiled chunks and interned strings stay warm
+void resetVM(VM *vm) {
+	freeTable(&vm->globals);
+	tableAddAll(&vm->natives, &vm->globals);
+	resetFibers(vm);
+	for(int i=0;i<vm->modules.used;i++) {
+		Entry *entry = &vm->modules.entries[i];
+		if(!IS_EMPTY_KEY(entry->key)) AS_MODULE(entry->value)->executed = false;
+	}
+}
+
+// the running frame and its ip are cached in locals, frame->ip is only written
+// back before anything that can switch fibers, push a frame or report an error.
+// profiled is always a constant, see run()
+static inline __attribute__((always_inline)) InterpretResult execute(VM *vm, bool profiled) {
+	CallFrame *frame;
+	uint8_t *ip;
+#define SAVE_IP() (frame->ip = ip)
+#define LOAD_FRAME() do {\
+	frame = &vm->fiber->frames[vm->fiber->frameCount - 1];\
+	ip = frame->ip;\
+} while(0)
+#define SWITCH_FIBER(next) do {\
+	saveFiber(vm);\
+	loadFiber(vm, next);\
+	LOAD_FRAME();\
+} while(0)
+#define FINISH_CALL(status) do {\
+	if(status == CALL_ERROR) return INTERPRET_RUNTIME_ERROR;\
+	/* the native parked this fiber, run something else meanwhile */\
+	if(status == CALL_OK) LOAD_FRAME();\
+	else SWITCH_FIBER(nextFiber(vm));\
+} while(0)
+#define RUNTIME_ERROR(...) do {\
+	SAVE_IP();\
+	runtimeError(vm, __VA_ARGS__);\
+	return INTERPRET_RUNTIME_ERROR;\
+} while(0)
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (frame->chunk->varr.values[*ip++])
 #define READ_STRING() (AS_STRING(READ_CONSTANT()))
 #define BINARY_OP(valueType, op) do {\
-	if(!(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))) {\
-		runtimeError("Operands must be numbers");\
-		return INTERPRET_RUNTIME_ERROR;\
+	if(!(IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))) {\
+		RUNTIME_ERROR("Operands must be numbers");\
 	}\
-	double b = AS_NUMBER(pop()); \
-	double a = AS_NUMBER(pop()); \
-	push(valueType(a op b));\
+	double b = AS_NUMBER(pop(vm)); \
+	double a = AS_NUMBER(pop(vm)); \
+	push(vm, valueType(a op b));\
 } while(0)
 
+	LOAD_FRAME();
 	while(1) {
 #ifdef TRACE_STACK
-		for(int i=0;i<vm.stackTop-vm.stack;i++) {
-			printValue(vm.stack[i]);
+		for(int i=0;i<vm->stackTop-vm->stack;i++) {
+			printValue(vm->stack[i]);
 			printf("\n");
 		}
 #endif
-		uint8_t instruction;
-		switch(instruction = READ_BYTE()) {
+		uint8_t instruction = READ_BYTE();
+		STAT_OPCODE(instruction);
+		if(profiled) {
+			// like a caller's, frame->ip is just past the opcode it's running
+			SAVE_IP();
+			if(profileSampleDue) recordSample(vm);
+		}
+		switch(instruction) {
 			case OP_CONSTANT: {
 				Value constant = READ_CONSTANT();
-				push(constant);
+				push(vm, constant);
 				break;
 				}
-			case OP_RETURN:
-				return INTERPRET_OK;
+			case OP_RETURN: {
+				Value result = pop(vm);
+				if(vm->fiber->openUpvalues != NULL) closeUpvalues(vm, frame->slots);
+				if(--vm->fiber->frameCount == 0) return INTERPRET_OK;
+				// the callee's slots, callee included, are dropped in one go
+				vm->stackTop = frame->slots;
+				// module bodies leave nothing behind on the importer's stack
+				if(frame->function != NULL) push(vm, result);
+				LOAD_FRAME();
+				break;
+			}
 			case OP_NEGATE: {
-				Value T = peek(0);
+				Value T = peek(vm, 0);
 				if(!IS_NUMBER(T)) {
-					runtimeError("Operand must be a number.");
-					return INTERPRET_RUNTIME_ERROR;
+					RUNTIME_ERROR("Operand must be a number.");
 				}
-				pop();
-				push(NUMBER_VAL(-AS_NUMBER(T)));
+				pop(vm);
+				push(vm, NUMBER_VAL(-AS_NUMBER(T)));
 				break;
 			}
 			case OP_ADD: {
-				if(IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-					concatenate();
-				} else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+				if(IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+					concatenate(vm);
+				} else if(IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
 					BINARY_OP(NUMBER_VAL, +);
 				} else {
-					runtimeError("Operands must be numebrs or strings.");
-					return INTERPRET_RUNTIME_ERROR;
+					RUNTIME_ERROR("Operands must be numebrs or strings.");
 				}
 				break;
 			}
 			case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
 			case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
 			case OP_DIVIDE: 	BINARY_OP(NUMBER_VAL, /); break;
-			case OP_TRUE: push(BOOL_VAL(true)); break;
-			case OP_FALSE: push(BOOL_VAL(false)); break;
-			case OP_NIL: push(NIL_VAL); break;
+			case OP_TRUE: push(vm, BOOL_VAL(true)); break;
+			case OP_FALSE: push(vm, BOOL_VAL(false)); break;
+			case OP_NIL: push(vm, NIL_VAL); break;
 			case OP_NOT: {
-				push(BOOL_VAL(!isTrue(pop())));
+				push(vm, BOOL_VAL(!isTrue(pop(vm))));
 				break;
 			}
 			case OP_EQUAL: {
-				Value a = pop();
-				Value b = pop();
-				push(BOOL_VAL(valuesEqual(a, b)));
+				Value a = pop(vm);
+				Value b = pop(vm);
+				push(vm, BOOL_VAL(valuesEqual(a, b)));
 				break;
 			}
 			case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
 			case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
 			case OP_PRINT: {
-				printValue(pop());
-				printf("\n");
+				writeValue(&vm->out, pop(vm));
+				writeOutputChar(&vm->out, '\n');
+				if(vm->out.lineBuffered) flushOutput(&vm->out);
 				break;
 			}
 			case OP_DEFINE_GLOBAL: {
 				ObjString *name = READ_STRING();
-				tableSet(&vm.globals, name, pop());
+				tableSet(&vm->globals, name, pop(vm));
 				break;
 			}
 			case OP_GET_GLOBAL: {
 				ObjString *name = READ_STRING();
 				Value temp;
-				if(!tableGet(&vm.globals, name, &temp)) {
-					runtimeError("Refrence to undefined variable '%s'", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
+				if(!tableGet(&vm->globals, name, &temp)) {
+					RUNTIME_ERROR("Refrence to undefined variable '%s'", name->chars);
 				} else {
-					push(temp);
+					push(vm, temp);
 				}
 				break;
 			}
 			case OP_SET_GLOBAL: {
 				ObjString *name = READ_STRING();
-				if(tableSet(&vm.globals, name, peek(0))) {
-					runtimeError("Undefined variable '%s'", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
+				if(tableSet(&vm->globals, name, peek(vm, 0))) {
+					RUNTIME_ERROR("Undefined variable '%s'", name->chars);
 				} 
 				break;
 			}
-			case OP_POP: pop(); break;
+			case OP_POP: pop(vm); break;
 			case OP_GET_LOCAL: {
 				int index = READ_BYTE();
-				push(vm.stack[index]);
+				push(vm, frame->slots[index]);
 				break;
 			}
 			case OP_SET_LOCAL: {
 				int index = READ_BYTE();
-				vm.stack[index] = peek(0);
+				frame->slots[index] = peek(vm, 0);
 				break;
 			}
 			case OP_JUMP_IF_FALSE: {
-				Value condition = peek(0);
+				Value condition = peek(vm, 0);
 				uint16_t offset = READ_SHORT();
 				if(!isTrue(condition)) {
-					vm.ip += offset;
+					ip += offset;
 				}
 				break;
 			}
 			case OP_JUMP: {
 				uint16_t offset = READ_SHORT();
-				vm.ip += offset;
+				ip += offset;
 				break;
 			}
 			case OP_LOOP: {
 				uint16_t offset = READ_SHORT();
-				vm.ip -= offset;
+				ip -= offset;
+				break;
+			}
+			case OP_IMPORT: {
+				ObjString *path = READ_STRING();
+				SAVE_IP();
+				InterpretResult result = importModule(vm, path);
+				if(result != INTERPRET_OK) return result;
+				LOAD_FRAME();
+				break;
+			}
+			case OP_SPAWN: {
+				uint16_t offset = READ_SHORT();
+				ObjFiber *fiber = newFiber(vm, frame->function, frame->chunk, ip, FIBER_STACK_INITIAL);
+				enqueueFiber(vm, fiber);
+				push(vm, OBJ_VAL(fiber));
+				ip += offset;
+				break;
+			}
+			case OP_YIELD: {
+				if(ioPending(vm)) pollIO(vm, false);
+				if(vm->readyHead == NULL) break;
+				SAVE_IP();
+				enqueueFiber(vm, vm->fiber);
+				SWITCH_FIBER(dequeueFiber(vm));
+				break;
+			}
+			case OP_RESUME: {
+				Value target = pop(vm);
+				if(!IS_FIBER(target)) {
+					RUNTIME_ERROR("Can only resume fibers.");
+				}
+				ObjFiber *fiber = AS_FIBER(target);
+				if(fiber->done) {
+					RUNTIME_ERROR("Cannot resume a finished fiber.");
+				}
+				// a fiber parked on I/O gets scheduled once it's ready
+				if(fiber == vm->fiber || fiber->waiting) break;
+				// the resumer continues as soon as the target yields or ends
+				unlinkFiber(vm, fiber);
+				SAVE_IP();
+				enqueueFiberFront(vm, vm->fiber);
+				SWITCH_FIBER(fiber);
+				break;
+			}
+			case OP_END_FIBER: {
+				ObjFiber *fiber = vm->fiber;
+				fiber->done = true;
+				closeUpvalues(vm, fiber->stack);
+				FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+				FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+				fiber->stack = NULL;
+				fiber->stackTop = NULL;
+				fiber->stackCapacity = 0;
+				fiber->frames = NULL;
+				fiber->frameCount = 0;
+				fiber->frameCapacity = 0;
+				ObjFiber *next = nextFiber(vm);
+				if(next == NULL) return INTERPRET_OK;
+				loadFiber(vm, next);
+				LOAD_FRAME();
+				break;
+			}
+			case OP_TAIL_CALL: {
+				int argCount = ip[0];
+				Value callee = peek(vm, argCount);
+				ObjClosure *closure = IS_CLOSURE(callee) ? AS_CLOSURE(callee) : NULL;
+				ObjFunction *function = closure != NULL ? closure->function : IS_FUNCTION(callee) ? AS_FUNCTION(callee) : NULL;
+				if(function != NULL && function->arity == argCount && !function->usesEnclosing) {
+					// reuse the caller's frame, the callee and its arguments slide down over its slots
+					if(vm->fiber->openUpvalues != NULL) closeUpvalues(vm, frame->slots);
+					Value *args = vm->stackTop - argCount - 1;
+					memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+					vm->stackTop = frame->slots + argCount + 1;
+					frame->function = function;
+					frame->closure = closure;
+					frame->chunk = &function->chunk;
+					ip = function->chunk.code;
+					break;
+				}
+				// natives, arity errors and callees that need this frame take the ordinary call path
+			}
+			// fallthrough
+			case OP_CALL: {
+				int argCount = READ_BYTE();
+				Value callee = peek(vm, argCount);
+				if(IS_NATIVE(callee)) {
+					ObjNative *native = AS_NATIVE(callee);
+					// sqrt(x) and friends: no frame, no status, just the slot rewritten
+					if(native->unary != NULL && argCount == 1 && IS_NUMBER(vm->stackTop[-1])) {
+						vm->stackTop[-2] = NUMBER_VAL(native->unary(AS_NUMBER(vm->stackTop[-1])));
+						vm->stackTop--;
+						break;
+					}
+					SAVE_IP();
+					CallStatus status = callNative(vm, native, argCount);
+					// frame and ip are still current, only parking needs the full treatment
+					if(status == CALL_OK) break;
+					if(status == CALL_RETRY) frame->ip -= 2;
+					FINISH_CALL(status);
+					break;
+				}
+				SAVE_IP();
+				CallStatus status = callValue(vm, callee, argCount);
+				if(status == CALL_RETRY) frame->ip -= 2;
+				FINISH_CALL(status);
+				break;
+			}
+			case OP_CLOSURE: {
+				ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+				ObjClosure *closure = newClosure(vm, function);
+				for(int i=0;i<function->upvalueCount;i++) {
+					uint8_t isLocal = function->upvalues[i*2];
+					uint8_t index = function->upvalues[i*2 + 1];
+					if(isLocal) closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+					else closure->upvalues[i] = frame->closure->upvalues[index];
+				}
+				push(vm, OBJ_VAL(closure));
+				break;
+			}
+			case OP_GET_UPVALUE: {
+				int index = READ_BYTE();
+				push(vm, *frame->closure->upvalues[index]->location);
+				break;
+			}
+			case OP_SET_UPVALUE: {
+				int index = READ_BYTE();
+				*frame->closure->upvalues[index]->location = peek(vm, 0);
+				break;
+			}
+			case OP_CLOSE_UPVALUE: {
+				closeUpvalues(vm, vm->stackTop - 1);
+				pop(vm);
+				break;
+			}
+			case OP_CLASS:
+				push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+				break;
+			case OP_INHERIT: {
+				Value superclass = peek(vm, 1);
+				if(!IS_CLASS(superclass)) {
+					RUNTIME_ERROR("Superclass must be a class.");
+				}
+				ObjClass *subclass = AS_CLASS(peek(vm, 0));
+				// copied down once, the subclass's own methods then overwrite
+				tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+				subclass->initializer = AS_CLASS(superclass)->initializer;
+				pop(vm);
+				break;
+			}
+			case OP_METHOD: {
+				ObjString *name = READ_STRING();
+				ObjClass *klass = AS_CLASS(peek(vm, 1));
+				tableSet(&klass->methods, name, peek(vm, 0));
+				if(name == vm->initString) klass->initializer = peek(vm, 0);
+				pop(vm);
+				break;
+			}
+			case OP_GET_PROPERTY: {
+				ObjString *name = READ_STRING();
+				InlineCache *cache = &frame->chunk->caches[READ_SHORT()];
+				if(!IS_INSTANCE(peek(vm, 0))) {
+					RUNTIME_ERROR("Only instances have properties.");
+				}
+				ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
+				CacheEntry *entry = &cache->entries[0];
+				if(entry->shape != instance->shape) {
+					SAVE_IP();
+					entry = lookupProperty(vm, cache, instance, name);
+					if(entry == NULL) return INTERPRET_RUNTIME_ERROR;
+				}
+				if(entry->index >= 0) vm->stackTop[-1] = instance->fields[entry->index];
+				else vm->stackTop[-1] = OBJ_VAL(newBoundMethod(vm, peek(vm, 0), entry->method));
+				break;
+			}
+			case OP_SET_PROPERTY: {
+				ObjString *name = READ_STRING();
+				InlineCache *cache = &frame->chunk->caches[READ_SHORT()];
+				if(!IS_INSTANCE(peek(vm, 1))) {
+					RUNTIME_ERROR("Only instances have fields.");
+				}
+				ObjInstance *instance = AS_INSTANCE(peek(vm, 1));
+				CacheEntry *entry = &cache->entries[0];
+				if(entry->shape != instance->shape) entry = lookupField(vm, cache, instance, name);
+				if(entry->transition != NULL) {
+					if(entry->index >= instance->fieldCapacity) {
+						int oldCapacity = instance->fieldCapacity;
+						instance->fieldCapacity = GROW_CAPACITY(oldCapacity);
+						instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, instance->fieldCapacity);
+					}
+					instance->shape = entry->transition;
+				}
+				instance->fields[entry->index] = peek(vm, 0);
+				vm->stackTop[-2] = vm->stackTop[-1];
+				vm->stackTop--;
+				break;
+			}
+			case OP_INVOKE: {
+				ObjString *name = READ_STRING();
+				int argCount = READ_BYTE();
+				InlineCache *cache = &frame->chunk->caches[READ_SHORT()];
+				Value receiver = peek(vm, argCount);
+				SAVE_IP();
+				if(!IS_INSTANCE(receiver)) {
+					RUNTIME_ERROR("Only instances have methods.");
+				}
+				ObjInstance *instance = AS_INSTANCE(receiver);
+				CacheEntry *entry = &cache->entries[0];
+				if(entry->shape != instance->shape) {
+					entry = lookupProperty(vm, cache, instance, name);
+					if(entry == NULL) return INTERPRET_RUNTIME_ERROR;
+				}
+				CallStatus status;
+				if(entry->index >= 0) {
+					// a callable field replaces the receiver, it isn't a method
+					Value field = instance->fields[entry->index];
+					vm->stackTop[-argCount - 1] = field;
+					status = callValue(vm, field, argCount);
+				} else {
+					status = callValue(vm, entry->method, argCount);
+				}
+				if(status == CALL_RETRY) {
+					frame->ip -= 5;
+					vm->stackTop[-argCount - 1] = receiver;
+				}
+				FINISH_CALL(status);
+				break;
+			}
+			case OP_GET_SUPER: {
+				ObjString *name = READ_STRING();
+				ObjClass *superclass = AS_CLASS(pop(vm));
+				Value method;
+				if(!tableGet(&superclass->methods, name, &method)) {
+					RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+				}
+				vm->stackTop[-1] = OBJ_VAL(newBoundMethod(vm, peek(vm, 0), method));
+				break;
+			}
+			case OP_SUPER_INVOKE: {
+				ObjString *name = READ_STRING();
+				int argCount = READ_BYTE();
+				ObjClass *superclass = AS_CLASS(pop(vm));
+				Value method;
+				if(!tableGet(&superclass->methods, name, &method)) {
+					RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+				}
+				SAVE_IP();
+				CallStatus status = callValue(vm, method, argCount);
+				FINISH_CALL(status);
+				break;
+			}
+			case OP_BUILD_LIST: {
+				int count = READ_BYTE();
+				ObjList *list = newList(vm);
+				for(int i=count;i>0;i--) writeValueArray(&list->items, vm->stackTop[-i]);
+				vm->stackTop -= count;
+				push(vm, OBJ_VAL(list));
+				break;
+			}
+			case OP_BUILD_MAP: {
+				int count = READ_BYTE();
+				ObjMap *map = newMap(vm);
+				SAVE_IP();
+				for(int i=count*2;i>0;i-=2) {
+					if(!checkMapKey(vm, vm->stackTop[-i])) return INTERPRET_RUNTIME_ERROR;
+					tableSetValue(&map->table, vm->stackTop[-i], vm->stackTop[-i + 1]);
+				}
+				vm->stackTop -= count * 2;
+				push(vm, OBJ_VAL(map));
+				break;
+			}
+			case OP_GET_INDEX: {
+				Value target = peek(vm, 1);
+				int index;
+				SAVE_IP();
+				if(IS_LIST(target)) {
+					ValueArray *items = &AS_LIST(target)->items;
+					if(!checkIndex(vm, items->count, peek(vm, 0), &index)) return INTERPRET_RUNTIME_ERROR;
+					vm->stackTop -= 2;
+					push(vm, items->values[index]);
+				} else if(IS_MAP(target)) {
+					Value value;
+					if(!tableGetValue(&AS_MAP(target)->table, peek(vm, 0), &value)) {
+						RUNTIME_ERROR("Undefined map key.");
+					}
+					vm->stackTop -= 2;
+					push(vm, value);
+				} else if(IS_F64_ARRAY(target)) {
+					ObjF64Array *array = AS_F64_ARRAY(target);
+					if(!checkIndex(vm, array->count, peek(vm, 0), &index)) return INTERPRET_RUNTIME_ERROR;
+					vm->stackTop -= 2;
+					push(vm, NUMBER_VAL(array->values[index]));
+				} else {
+					RUNTIME_ERROR("Can only index lists, maps and float64 arrays.");
+				}
+				break;
+			}
+			case OP_SET_INDEX: {
+				Value target = peek(vm, 2);
+				int index;
+				SAVE_IP();
+				if(IS_LIST(target)) {
+					ValueArray *items = &AS_LIST(target)->items;
+					if(!checkIndex(vm, items->count, peek(vm, 1), &index)) return INTERPRET_RUNTIME_ERROR;
+					items->values[index] = peek(vm, 0);
+				} else if(IS_MAP(target)) {
+					if(!checkMapKey(vm, peek(vm, 1))) return INTERPRET_RUNTIME_ERROR;
+					tableSetValue(&AS_MAP(target)->table, peek(vm, 1), peek(vm, 0));
+				} else if(IS_F64_ARRAY(target)) {
+					ObjF64Array *array = AS_F64_ARRAY(target);
+					if(!checkIndex(vm, array->count, peek(vm, 1), &index)) return INTERPRET_RUNTIME_ERROR;
+					if(!IS_NUMBER(peek(vm, 0))) {
+						RUNTIME_ERROR("Float64 array elements must be numbers.");
+					}
+					array->values[index] = AS_NUMBER(peek(vm, 0));
+				} else {
+					RUNTIME_ERROR("Can only index lists, maps and float64 arrays.");
+				}
+				Value value = pop(vm);
+				vm->stackTop -= 2;
+				push(vm, value);
+				break;
+			}
+			case OP_FOR_ITER: {
+				int slot = READ_BYTE();
+				uint16_t offset = READ_SHORT();
+				Value sequence = frame->slots[slot];
+				int index = (int)AS_NUMBER(frame->slots[slot + 1]);
+				Value element;
+				if(IS_LIST(sequence)) {
+					ValueArray *items = &AS_LIST(sequence)->items;
+					if(index >= items->count) {
+						ip += offset;
+						break;
+					}
+					element = items->values[index];
+				} else if(IS_MAP(sequence)) {
+					// index is a position in the entries, holes left by deletes are skipped
+					Table *table = &AS_MAP(sequence)->table;
+					while(index < table->used && IS_EMPTY_KEY(table->entries[index].key)) index++;
+					if(index >= table->used) {
+						ip += offset;
+						break;
+					}
+					element = table->entries[index].key;
+				} else if(IS_F64_ARRAY(sequence)) {
+					ObjF64Array *array = AS_F64_ARRAY(sequence);
+					if(index >= array->count) {
+						ip += offset;
+						break;
+					}
+					element = NUMBER_VAL(array->values[index]);
+				} else {
+					RUNTIME_ERROR("Can only iterate over lists, maps and float64 arrays.");
+				}
+				frame->slots[slot + 1] = NUMBER_VAL(index + 1);
+				push(vm, element);
+				break;
+			}
+			// a non-escaping function is only ever called directly by the frame that declared it
+			case OP_GET_ENCLOSING: {
+				int index = READ_BYTE();
+				push(vm, frame[-1].slots[index]);
+				break;
+			}
+			case OP_SET_ENCLOSING: {
+				int index = READ_BYTE();
+				frame[-1].slots[index] = peek(vm, 0);
 				break;
 			}
-
 		}
 	}
+#undef SAVE_IP
+#undef LOAD_FRAME
+#undef SWITCH_FIBER
+#undef FINISH_CALL
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef BINARY_OP
@@ -215,16 +1022,93 @@ static InterpretResult run() {
 #undef READ_SHORT
 }
 
-InterpretResult interpret(char *source) {
+// two copies of the loop, so a run without --profile or --allocs never tests the
+// sample flag or saves ip. cold keeps gcc from spending its inlining budget on the profiled copy
+static InterpretResult runPlain(VM *vm) {
+	return execute(vm, false);
+}
+
+__attribute__((cold)) static InterpretResult runProfiled(VM *vm) {
+	return execute(vm, true);
+}
+
+static InterpretResult run(VM *vm) {
+	return profiling || allocationProfiling ? runProfiled(vm) : runPlain(vm);
+}
+
+// the end of the script only finishes the root fiber, spawned ones still get to run
+static InterpretResult finishFibers(VM *vm, InterpretResult result) {
+	if(result == INTERPRET_OK && (vm->readyHead != NULL || ioPending(vm))) {
+		saveFiber(vm);
+		loadFiber(vm, nextFiber(vm));
+		result = run(vm);
+	}
+	resetFibers(vm);
+	flushOutput(&vm->out);
+	return result;
+}
+
+InterpretResult interpretChunk(VM *vm, Chunk *chunk) {
+	pushFrame(vm, NULL, NULL, chunk, vm->stack);
+	return finishFibers(vm, run(vm));
+}
+
+typedef struct {
+	InterpretResult result;
+	// statements that spawned fibers, their bodies live in these chunks
+	Chunk **kept;
+	int keptCount;
+	int keptCapacity;
+} Stream;
+
+static void freeStatement(Chunk *chunk) {
+	freeChunk(chunk);
+	FREE(Chunk, chunk);
+}
+
+// every statement runs on the root fiber as it arrives, spawned fibers wait for the
+// end of the file just like they do without streaming
+static bool runStatement(VM *vm, Chunk *chunk, void *context) {
+	Stream *stream = (Stream *)context;
+	Obj *before = vm->objects;
+	vm->stackTop = vm->stack;
+	pushFrame(vm, NULL, NULL, chunk, vm->stack);
+	stream->result = run(vm);
+	bool spawned = false;
+	for(Obj *obj = vm->objects; obj != before && !spawned; obj = obj->next) {
+		spawned = obj->type == OBJ_FIBER;
+	}
+	if(!spawned) {
+		freeStatement(chunk);
+	} else {
+		if(stream->keptCapacity <= stream->keptCount) {
+			int oldCapacity = stream->keptCapacity;
+			stream->keptCapacity = GROW_CAPACITY(oldCapacity);
+			stream->kept = GROW_ARRAY(Chunk *, stream->kept, oldCapacity, stream->keptCapacity);
+		}
+		stream->kept[stream->keptCount++] = chunk;
+	}
+	return stream->result == INTERPRET_OK;
+}
+
+InterpretResult interpretStream(VM *vm, char *source) {
+	Stream stream = {INTERPRET_OK, NULL, 0, 0};
+	InterpretResult result = INTERPRET_COMPILE_ERROR;
+	if(compileStream(vm, source, runStatement, &stream)) result = stream.result;
+	result = finishFibers(vm, result);
+	for(int i=0;i<stream.keptCount;i++) freeStatement(stream.kept[i]);
+	FREE_ARRAY(Chunk *, stream.kept, stream.keptCapacity);
+	return result;
+}
+
+InterpretResult interpret(VM *vm, char *source) {
 	Chunk chunk;
 	initChunk(&chunk);
-	if(!compile(&chunk, source)) {
+	if(!compile(vm, &chunk, source)) {
+		freeChunk(&chunk);
 		return INTERPRET_COMPILE_ERROR;
 	}
-	vm.chunk = &chunk;
-	vm.ip = vm.chunk->code;
-
-	InterpretResult result = run();
+	InterpretResult result = interpretChunk(vm, &chunk);
 	freeChunk(&chunk);
-	return INTERPRET_OK; 
+	return result;
 }
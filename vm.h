@@ -3,20 +3,34 @@
 
 #include <stdint.h>
 #include "table.h"
+#include "obj.h"
 #include "chunk.h"
 #include "value.h"
+#include "io.h"
+#include "output.h"
 
-typedef struct {
-	Chunk *chunk;
-	uint8_t *ip;
-	Value stack[256];
+#define STACK_INITIAL 256
+#define FIBER_STACK_INITIAL 16
+#define FRAMES_MAX (1 << 16)
+
+struct VM {
+	// the running fiber's stack, swapped in and out on every switch
+	Value *stack;
 	Value *stackTop;
+	Value *stackLimit;
+	ObjFiber *fiber;
+	ObjFiber *root;
+	ObjFiber *readyHead;
+	ObjFiber *readyTail;
 	Obj *objects;
 	Table strings;
 	Table globals;
-} VM;
-
-extern VM vm;
+	Table natives; // the globals as initVM left them, resetVM starts over from these
+	Table modules;
+	ObjString *initString;
+	IOState io;
+	OutputBuffer out;
+};
 
 typedef enum {
 	INTERPRET_OK,
@@ -24,10 +38,17 @@ typedef enum {
 	INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-void push(Value);
-Value pop();
-void initVM();
-void freeVM();
-InterpretResult interpret(char *);
+void push(VM *, Value);
+Value pop(VM *);
+void initVM(VM *);
+void freeVM(VM *);
+void resetVM(VM *);
+InterpretResult interpret(VM *, char *);
+InterpretResult interpretChunk(VM *, Chunk *);
+InterpretResult interpretStream(VM *, char *);
+void runtimeError(VM *, char *format, ...);
+void scheduleFiber(VM *, ObjFiber *);
+void defineNative(VM *, char *name, NativeFn function, int arity);
+void defineUnaryNative(VM *, char *name, NativeUnaryFn function);
 
 #endif